@@ -0,0 +1,772 @@
+/*
+  LC-3 assembler, see assembler.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+
+#include "vm.h"
+#include "image.h"
+#include "assembler.h"
+
+#define ASM_MAX_TOKENS 8
+#define ASM_MIN_SYMBOLS 64
+#define MEMORY_WORDS (sizeof(((vm_t*)0)->memory) / sizeof(uint16_t))
+
+typedef struct
+{
+    const char* s;
+    size_t n;
+    int string;      /* a "quoted" operand, s/n without the quotes */
+} token_t;
+
+// Labels point into the source, nothing is copied
+typedef struct
+{
+    const char* name;   /* NULL for a free slot */
+    uint32_t len;
+    uint16_t value;
+} asm_symbol_t;
+
+typedef struct
+{
+    vm_t* vm;
+    const char* name;
+    int pass;
+    int line;
+    int errors;
+
+    uint32_t pc;        /* next word, can reach the end of memory */
+    int in_block;       /* inside .ORIG ... .END */
+    uint16_t origin;
+    int have_entry;
+    uint16_t entry;
+
+    // Open addressing, never more than half full
+    asm_symbol_t* symbols;
+    uint32_t symbol_cap;
+    uint32_t symbol_count;
+} asm_t;
+
+enum
+{
+    K_ALU,       /* ADD AND */
+    K_NOT,
+    K_BR,
+    K_JMP,
+    K_RET,
+    K_JSR,
+    K_JSRR,
+    K_PCREL,     /* LD LDI LEA ST STI */
+    K_BASE,      /* LDR STR */
+    K_TRAP,
+    K_ALIAS,     /* GETC ... HALT, opcode holds the whole word */
+    K_RTI,
+    K_ORIG,
+    K_FILL,
+    K_BLKW,
+    K_STRINGZ,
+    K_END
+};
+
+typedef struct
+{
+    const char* name;
+    int kind;
+    uint16_t opcode;
+} mnemonic_t;
+
+static const mnemonic_t mnemonics[] =
+{
+    { "ADD", K_ALU, OP_ADD },       { "AND", K_ALU, OP_AND },
+    { "NOT", K_NOT, OP_NOT },       { "JMP", K_JMP, OP_JMP },
+    { "RET", K_RET, OP_JMP },       { "JSR", K_JSR, OP_JSR },
+    { "JSRR", K_JSRR, OP_JSR },     { "LD", K_PCREL, OP_LD },
+    { "LDI", K_PCREL, OP_LDI },     { "LEA", K_PCREL, OP_LEA },
+    { "ST", K_PCREL, OP_ST },       { "STI", K_PCREL, OP_STI },
+    { "LDR", K_BASE, OP_LDR },      { "STR", K_BASE, OP_STR },
+    { "TRAP", K_TRAP, OP_TRAP },    { "RTI", K_RTI, OP_RTI },
+    { "GETC", K_ALIAS, 0xF000 | TRAP_GETC },
+    { "OUT", K_ALIAS, 0xF000 | TRAP_OUT },
+    { "PUTS", K_ALIAS, 0xF000 | TRAP_PUTS },
+    { "IN", K_ALIAS, 0xF000 | TRAP_IN },
+    { "PUTSP", K_ALIAS, 0xF000 | TRAP_PUTSP },
+    { "HALT", K_ALIAS, 0xF000 | TRAP_HALT },
+    { ".ORIG", K_ORIG, 0 },         { ".FILL", K_FILL, 0 },
+    { ".BLKW", K_BLKW, 0 },         { ".STRINGZ", K_STRINGZ, 0 },
+    { ".END", K_END, 0 },
+};
+
+static void asm_error(asm_t* a, const char* fmt, ...)
+{
+    va_list args;
+    fprintf(stderr, "%s:%d: ", a->name, a->line);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    ++a->errors;
+}
+
+// Most problems are reported by the second pass only, so they aren't
+// reported twice
+#define PASS2_ERROR(a, ...) do { if((a)->pass == 2) asm_error((a), __VA_ARGS__); } while(0)
+
+static int token_is(const token_t* t, const char* s)
+{
+    return !t->string && strlen(s) == t->n && strncasecmp(t->s, s, t->n) == 0;
+}
+
+// BR, BRn, BRzp ... as nzp bits, -1 if t isn't a branch
+static int branch_mask(const token_t* t)
+{
+    if(t->string || t->n < 2 || strncasecmp(t->s, "BR", 2) != 0)
+    {
+        return -1;
+    }
+    int mask = 0;
+    for(size_t i = 2; i < t->n; ++i)
+    {
+        switch(t->s[i])
+        {
+            case 'n': case 'N': mask |= FL_NEG; break;
+            case 'z': case 'Z': mask |= FL_ZRO; break;
+            case 'p': case 'P': mask |= FL_POS; break;
+            default: return -1;
+        }
+    }
+    return mask ? mask : (FL_NEG | FL_ZRO | FL_POS);
+}
+
+static const mnemonic_t* find_mnemonic(const token_t* t, int* br_mask)
+{
+    static const mnemonic_t br = { "BR", K_BR, OP_BR };
+    for(size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); ++i)
+    {
+        if(token_is(t, mnemonics[i].name))
+        {
+            return &mnemonics[i];
+        }
+    }
+    *br_mask = branch_mask(t);
+    return *br_mask >= 0 ? &br : NULL;
+}
+
+// Symbols
+
+static asm_symbol_t* symbol_slot(asm_symbol_t* table, uint32_t cap, const char* name, uint32_t len)
+{
+    uint32_t i = (uint32_t)fnv1a(FNV_OFFSET, name, len) & (cap - 1);
+    while(table[i].name && (table[i].len != len || memcmp(table[i].name, name, len) != 0))
+    {
+        i = (i + 1) & (cap - 1);
+    }
+    return &table[i];
+}
+
+static int symbol_grow(asm_t* a)
+{
+    uint32_t cap = a->symbol_cap ? a->symbol_cap * 2 : ASM_MIN_SYMBOLS;
+    asm_symbol_t* table = calloc(cap, sizeof(asm_symbol_t));
+    if(!table)
+    {
+        return 0;
+    }
+    for(uint32_t i = 0; i < a->symbol_cap; ++i)
+    {
+        asm_symbol_t* s = &a->symbols[i];
+        if(s->name)
+        {
+            *symbol_slot(table, cap, s->name, s->len) = *s;
+        }
+    }
+    free(a->symbols);
+    a->symbols = table;
+    a->symbol_cap = cap;
+    return 1;
+}
+
+static void define_symbol(asm_t* a, const token_t* t)
+{
+    if((a->symbol_count + 1) * 2 > a->symbol_cap && !symbol_grow(a))
+    {
+        asm_error(a, "out of memory");
+        return;
+    }
+    asm_symbol_t* s = symbol_slot(a->symbols, a->symbol_cap, t->s, t->n);
+    if(s->name)
+    {
+        asm_error(a, "duplicate label '%.*s'", (int)t->n, t->s);
+        return;
+    }
+    s->name = t->s;
+    s->len = t->n;
+    s->value = a->pc;
+    ++a->symbol_count;
+}
+
+static int lookup_symbol(asm_t* a, const token_t* t, uint16_t* value)
+{
+    if(!a->symbol_cap)
+    {
+        return 0;
+    }
+    asm_symbol_t* s = symbol_slot(a->symbols, a->symbol_cap, t->s, t->n);
+    if(!s->name)
+    {
+        return 0;
+    }
+    *value = s->value;
+    return 1;
+}
+
+// Operands
+
+static int parse_number(const token_t* t, int32_t* out)
+{
+    const char* s = t->s;
+    size_t n = t->n;
+    int base = 10;
+    int neg = 0;
+
+    if(t->string || !n)
+    {
+        return 0;
+    }
+    if(s[0] == '#')
+    {
+        ++s;
+        --n;
+    }
+    else if(s[0] == 'x' || s[0] == 'X')
+    {
+        base = 16;
+        ++s;
+        --n;
+    }
+    if(n && (s[0] == '-' || s[0] == '+'))
+    {
+        neg = s[0] == '-';
+        ++s;
+        --n;
+    }
+    if(base == 10 && n > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        base = 16;
+        s += 2;
+        n -= 2;
+    }
+    if(!n)
+    {
+        return 0;
+    }
+
+    int32_t v = 0;
+    for(size_t i = 0; i < n; ++i)
+    {
+        char c = s[i];
+        int d = c >= '0' && c <= '9' ? c - '0'
+              : c >= 'a' && c <= 'f' ? c - 'a' + 10
+              : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 99;
+        if(d >= base)
+        {
+            return 0;
+        }
+        v = v * base + d;
+        if(v > 0xFFFF)
+        {
+            return 0;
+        }
+    }
+    *out = neg ? -v : v;
+    return 1;
+}
+
+static int is_label(const token_t* t)
+{
+    if(t->string || !t->n || !(t->s[0] == '_' || ((t->s[0] | 0x20) >= 'a' && (t->s[0] | 0x20) <= 'z')))
+    {
+        return 0;
+    }
+    for(size_t i = 1; i < t->n; ++i)
+    {
+        char c = t->s[i];
+        if(!(c == '_' || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int reg_operand(asm_t* a, const token_t* t)
+{
+    if(!t->string && t->n == 2 && (t->s[0] == 'R' || t->s[0] == 'r') && t->s[1] >= '0' && t->s[1] <= '7')
+    {
+        return t->s[1] - '0';
+    }
+    PASS2_ERROR(a, "expected a register, got '%.*s'", (int)t->n, t->s);
+    return 0;
+}
+
+static uint16_t signed_field(asm_t* a, int32_t v, int bits, const char* what)
+{
+    int32_t lo = -(1 << (bits - 1));
+    int32_t hi = (1 << (bits - 1)) - 1;
+    if(v < lo || v > hi)
+    {
+        PASS2_ERROR(a, "%s %d out of range [%d, %d]", what, v, lo, hi);
+    }
+    return (uint16_t)v & ((1 << bits) - 1);
+}
+
+static uint16_t imm_operand(asm_t* a, const token_t* t, int bits)
+{
+    int32_t v;
+    if(!parse_number(t, &v))
+    {
+        PASS2_ERROR(a, "expected a number, got '%.*s'", (int)t->n, t->s);
+        return 0;
+    }
+    return signed_field(a, v, bits, "immediate");
+}
+
+// Label or literal offset from the next instruction
+static uint16_t pc_operand(asm_t* a, const token_t* t, int bits)
+{
+    int32_t v;
+    if(parse_number(t, &v))
+    {
+        return signed_field(a, v, bits, "offset");
+    }
+    if(a->pass == 1)
+    {
+        return 0;
+    }
+    uint16_t target;
+    if(!is_label(t) || !lookup_symbol(a, t, &target))
+    {
+        asm_error(a, "undefined label '%.*s'", (int)t->n, t->s);
+        return 0;
+    }
+    return signed_field(a, (int32_t)target - (int32_t)(a->pc + 1), bits, "offset to label");
+}
+
+// .FILL and .ORIG - a number that fits in a word, or a label
+static uint16_t word_operand(asm_t* a, const token_t* t, int allow_label)
+{
+    int32_t v;
+    if(parse_number(t, &v))
+    {
+        if(v < -0x8000)
+        {
+            PASS2_ERROR(a, "value %d does not fit in a word", v);
+        }
+        return (uint16_t)v;
+    }
+    uint16_t value = 0;
+    if(!allow_label || (a->pass == 2 && (!is_label(t) || !lookup_symbol(a, t, &value))))
+    {
+        PASS2_ERROR(a, allow_label ? "undefined label '%.*s'" : "expected a number, got '%.*s'",
+                    (int)t->n, t->s);
+    }
+    return value;
+}
+
+// Output
+
+static void end_block(asm_t* a)
+{
+    if(a->in_block && a->pass == 2)
+    {
+        record_image_range(a->vm, a->name, a->origin, a->pc - a->origin);
+    }
+    a->in_block = 0;
+}
+
+static void emit(asm_t* a, uint16_t word)
+{
+    if(a->pc >= MEMORY_WORDS)
+    {
+        if(a->pc == MEMORY_WORDS)
+        {
+            PASS2_ERROR(a, "program runs past the end of memory");
+        }
+    }
+    else if(a->pass == 2)
+    {
+        a->vm->memory[a->pc] = word;
+    }
+    ++a->pc;
+}
+
+// .STRINGZ with C style escapes, emits nothing in pass 1 except the length
+static void emit_string(asm_t* a, const token_t* t)
+{
+    for(size_t i = 0; i < t->n; ++i)
+    {
+        char c = t->s[i];
+        if(c == '\\' && i + 1 < t->n)
+        {
+            switch(t->s[++i])
+            {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'e': c = 27; break;
+                case '0': c = 0; break;
+                default: c = t->s[i]; break;
+            }
+        }
+        emit(a, (uint8_t)c);
+    }
+    emit(a, 0);
+}
+
+// Lines
+
+static int tokenize(asm_t* a, const char* p, const char* end, token_t* tokens)
+{
+    int count = 0;
+    while(p < end)
+    {
+        char c = *p;
+        if(c == ';')
+        {
+            break;
+        }
+        if(c == ' ' || c == '\t' || c == ',' || c == '\r')
+        {
+            ++p;
+            continue;
+        }
+        if(count == ASM_MAX_TOKENS)
+        {
+            PASS2_ERROR(a, "too many operands");
+            break;
+        }
+
+        token_t* t = &tokens[count++];
+        if(c == '"')
+        {
+            const char* s = ++p;
+            while(p < end && *p != '"')
+            {
+                p += (*p == '\\' && p + 1 < end) ? 2 : 1;
+            }
+            if(p >= end)
+            {
+                PASS2_ERROR(a, "unterminated string");
+            }
+            t->s = s;
+            t->n = (p < end ? p : end) - s;
+            t->string = 1;
+            ++p;
+            continue;
+        }
+
+        t->s = p;
+        while(p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != ';' && *p != '\r' && *p != '"')
+        {
+            ++p;
+        }
+        t->n = p - t->s;
+        t->string = 0;
+    }
+    return count;
+}
+
+static void need_operands(asm_t* a, int have, int want, const char* name)
+{
+    if(have != want)
+    {
+        PASS2_ERROR(a, "%s takes %d operand%s", name, want, want == 1 ? "" : "s");
+    }
+}
+
+static void assemble_line(asm_t* a, const char* p, const char* end)
+{
+    token_t t[ASM_MAX_TOKENS];
+    int count = tokenize(a, p, end, t);
+    if(!count)
+    {
+        return;
+    }
+
+    int br = -1;
+    int first = 0;
+    const mnemonic_t* m = find_mnemonic(&t[0], &br);
+    if(!m)
+    {
+        // Leading label, with or without a colon
+        token_t label = t[0];
+        if(label.n && label.s[label.n - 1] == ':')
+        {
+            --label.n;
+        }
+        if(!is_label(&label))
+        {
+            PASS2_ERROR(a, "unknown instruction '%.*s'", (int)t[0].n, t[0].s);
+            return;
+        }
+        if(a->pass == 1)
+        {
+            if(!a->in_block)
+            {
+                asm_error(a, "label '%.*s' outside .ORIG", (int)label.n, label.s);
+            }
+            define_symbol(a, &label);
+        }
+        if(count == 1)
+        {
+            return;
+        }
+        first = 1;
+        m = find_mnemonic(&t[1], &br);
+        if(!m)
+        {
+            // More likely a misspelt opcode than a label
+            PASS2_ERROR(a, "unknown instruction '%.*s'", (int)t[0].n, t[0].s);
+            return;
+        }
+    }
+
+    const token_t* op = &t[first + 1];
+    int n = count - first - 1;
+
+    if(m->kind == K_ORIG)
+    {
+        need_operands(a, n, 1, ".ORIG");
+        end_block(a);
+        a->pc = n ? word_operand(a, &op[0], 0) : 0;
+        a->origin = a->pc;
+        a->in_block = 1;
+        if(!a->have_entry)
+        {
+            a->have_entry = 1;
+            a->entry = a->origin;
+        }
+        return;
+    }
+    if(!a->in_block)
+    {
+        if(m->kind != K_END)
+        {
+            PASS2_ERROR(a, "%s outside .ORIG", m->name);
+        }
+        return;
+    }
+
+    uint16_t word = m->opcode << 12;
+    switch(m->kind)
+    {
+        case K_ALU:
+            need_operands(a, n, 3, m->name);
+            if(n == 3)
+            {
+                word |= reg_operand(a, &op[0]) << 9 | reg_operand(a, &op[1]) << 6;
+                int32_t v;
+                if(parse_number(&op[2], &v))
+                {
+                    word |= 1 << 5 | signed_field(a, v, 5, "immediate");
+                }
+                else
+                {
+                    word |= reg_operand(a, &op[2]);
+                }
+            }
+            emit(a, word);
+            break;
+        case K_NOT:
+            need_operands(a, n, 2, m->name);
+            if(n == 2)
+            {
+                word |= reg_operand(a, &op[0]) << 9 | reg_operand(a, &op[1]) << 6 | 0x3F;
+            }
+            emit(a, word);
+            break;
+        case K_BR:
+            need_operands(a, n, 1, "BR");
+            word |= br << 9;
+            if(n == 1)
+            {
+                word |= pc_operand(a, &op[0], 9);
+            }
+            emit(a, word);
+            break;
+        case K_JMP:
+        case K_JSRR:
+            need_operands(a, n, 1, m->name);
+            if(n == 1)
+            {
+                word |= reg_operand(a, &op[0]) << 6;
+            }
+            emit(a, word);
+            break;
+        case K_RET:
+            need_operands(a, n, 0, m->name);
+            emit(a, word | R_R7 << 6);
+            break;
+        case K_JSR:
+            need_operands(a, n, 1, m->name);
+            word |= 1 << 11;
+            if(n == 1)
+            {
+                word |= pc_operand(a, &op[0], 11);
+            }
+            emit(a, word);
+            break;
+        case K_PCREL:
+            need_operands(a, n, 2, m->name);
+            if(n == 2)
+            {
+                word |= reg_operand(a, &op[0]) << 9 | pc_operand(a, &op[1], 9);
+            }
+            emit(a, word);
+            break;
+        case K_BASE:
+            need_operands(a, n, 3, m->name);
+            if(n == 3)
+            {
+                word |= reg_operand(a, &op[0]) << 9 | reg_operand(a, &op[1]) << 6 | imm_operand(a, &op[2], 6);
+            }
+            emit(a, word);
+            break;
+        case K_TRAP:
+        {
+            need_operands(a, n, 1, m->name);
+            int32_t v = 0;
+            if(n == 1 && (!parse_number(&op[0], &v) || v < 0 || v > 0xFF))
+            {
+                PASS2_ERROR(a, "trap vector '%.*s' out of range [x00, xFF]", (int)op[0].n, op[0].s);
+            }
+            emit(a, word | (v & 0xFF));
+            break;
+        }
+        case K_ALIAS:
+            need_operands(a, n, 0, m->name);
+            emit(a, m->opcode);
+            break;
+        case K_RTI:
+            need_operands(a, n, 0, m->name);
+            emit(a, word);
+            break;
+        case K_FILL:
+            need_operands(a, n, 1, m->name);
+            emit(a, n ? word_operand(a, &op[0], 1) : 0);
+            break;
+        case K_BLKW:
+        {
+            need_operands(a, n, 1, m->name);
+            int32_t v = 0;
+            if(n == 1 && (!parse_number(&op[0], &v) || v < 0))
+            {
+                PASS2_ERROR(a, "bad .BLKW count '%.*s'", (int)op[0].n, op[0].s);
+                v = 0;
+            }
+            for(int32_t i = 0; i < v; ++i)
+            {
+                emit(a, 0);
+            }
+            break;
+        }
+        case K_STRINGZ:
+            if(n != 1 || !op[0].string)
+            {
+                PASS2_ERROR(a, ".STRINGZ takes one quoted string");
+                break;
+            }
+            emit_string(a, &op[0]);
+            break;
+        case K_END:
+            end_block(a);
+            break;
+    }
+}
+
+static void assemble_pass(asm_t* a, const char* src, size_t len)
+{
+    const char* end = src + len;
+    a->line = 0;
+    a->pc = 0;
+    a->in_block = 0;
+    for(const char* p = src; p < end;)
+    {
+        const char* eol = memchr(p, '\n', end - p);
+        if(!eol)
+        {
+            eol = end;
+        }
+        ++a->line;
+        assemble_line(a, p, eol);
+        p = eol + 1;
+    }
+    end_block(a);
+}
+
+int assemble(vm_t* vm, const char* name, const char* src, size_t len, uint16_t* entry)
+{
+    asm_t a;
+    memset(&a, 0, sizeof(a));
+    a.vm = vm;
+    a.name = name;
+
+    // Labels and sizes, then the words. The second pass runs even after
+    // an error so everything wrong with the source gets reported.
+    a.pass = 1;
+    assemble_pass(&a, src, len);
+    a.pass = 2;
+    assemble_pass(&a, src, len);
+    if(!a.have_entry && !a.errors)
+    {
+        fprintf(stderr, "%s: no .ORIG\n", name);
+        a.errors = 1;
+    }
+    if(entry && a.have_entry)
+    {
+        *entry = a.entry;
+    }
+
+    free(a.symbols);
+    return !a.errors;
+}
+
+int assemble_file(vm_t* vm, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f)
+    {
+        return 0;
+    }
+    char* src = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    for(;;)
+    {
+        if(len == cap)
+        {
+            cap = cap ? cap * 2 : 64 * 1024;
+            char* grown = realloc(src, cap);
+            if(!grown)
+            {
+                free(src);
+                fclose(f);
+                return 0;
+            }
+            src = grown;
+        }
+        size_t got = fread(src + len, 1, cap - len, f);
+        len += got;
+        if(!got)
+        {
+            break;
+        }
+    }
+    fclose(f);
+
+    int ok = assemble(vm, path, src, len, NULL);
+    free(src);
+    return ok;
+}
@@ -0,0 +1,31 @@
+/*
+  Two pass LC-3 assembler. Source goes straight into a machine's memory,
+  each .ORIG block is recorded like a loaded image, so read_image() takes
+  .asm files as well and --mkimg can turn them into a native image.
+
+  Syntax is the usual one: an optional label, an opcode or directive and
+  its operands, ';' starts a comment. Opcodes, directives and registers
+  are case insensitive, labels are not. Numbers are #10, 10, #-3, x3000 or
+  0x3000. PC relative operands take a label or a literal offset.
+
+    .ORIG addr   .FILL value|label   .BLKW count   .STRINGZ "text"   .END
+    GETC OUT PUTS IN PUTSP HALT      RET   JSRR   BR[n][z][p]   RTI
+
+  Messages go to stderr as name:line: message. Words before an error may
+  already be in memory.
+*/
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct vm;
+
+// Assemble len bytes of source, name is only used for messages and the
+// image map. entry (may be NULL) gets the first .ORIG. Returns 1 without
+// errors, 0 otherwise.
+int assemble(struct vm* vm, const char* name, const char* src, size_t len, uint16_t* entry);
+int assemble_file(struct vm* vm, const char* path);
+
+#endif
@@ -0,0 +1,278 @@
+/*
+  Batch runner - every argument is one job, an image or a comma separated
+  list of images loaded into the same machine. Jobs are spread over a pool of
+  worker threads, each with its own deque; a worker that runs out of jobs
+  steals from the other end of someone else's deque. Each machine writes to
+  its own in-memory stdout, printed in job order once everything finished.
+
+  Jobs run headless, -m and -t stop a job after that many instructions or
+  milliseconds. Every worker counts its machines into a metrics slot of
+  its own (the worker number), -s serves them on a Unix socket.
+
+  lc3 --batch [-j threads] [-m max-instr] [-t timeout-ms] [-s metrics-socket] image[,image...] ...
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "metrics.h"
+
+typedef struct
+{
+    const char* images;  /* comma separated image paths */
+    char* output;        /* captured stdout */
+    size_t output_len;
+} batch_job_t;
+
+// Owner pushes and pops at the tail, thieves take from the head
+typedef struct
+{
+    pthread_mutex_t lock;
+    int* jobs;
+    int head;
+    int tail;
+} batch_queue_t;
+
+typedef struct
+{
+    batch_job_t* jobs;
+    batch_queue_t* queues;
+    int worker_count;
+    uint64_t max_instructions;
+    uint64_t timeout_ms;
+} batch_pool_t;
+
+typedef struct
+{
+    batch_pool_t* pool;
+    int id;
+    int started;  /* has a thread of its own */
+} batch_worker_t;
+
+static int queue_pop(batch_queue_t* q)
+{
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if(q->head < q->tail)
+    {
+        job = q->jobs[--q->tail];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static int queue_steal(batch_queue_t* q)
+{
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if(q->head < q->tail)
+    {
+        job = q->jobs[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static void run_job(batch_pool_t* pool, batch_job_t* job, vm_metrics_t* metrics)
+{
+    FILE* out = open_memstream(&job->output, &job->output_len);
+    if(!out)
+    {
+        return;
+    }
+
+    vm_t* vm = vm_create();
+    if(!vm)
+    {
+        fprintf(out, "failed to allocate vm\n");
+        fclose(out);
+        return;
+    }
+
+    // No terminal and no input in batch mode
+    vm->in = NULL;
+    vm->out = out;
+    vm->max_instructions = pool->max_instructions;
+    vm->timeout_ms = pool->timeout_ms;
+    metrics_attach(vm, metrics);
+
+    int loaded = 1;
+    char* images = strdup(job->images);
+    char* save = NULL;
+    for(char* path = strtok_r(images, ",", &save); path; path = strtok_r(NULL, ",", &save))
+    {
+        if(!read_image(vm, path))
+        {
+            fprintf(out, "failed to load image: %s\n", path);
+            loaded = 0;
+        }
+    }
+    free(images);
+
+    // Unlike the interactive CLI, don't run a job that is missing an image
+    if(loaded)
+    {
+        vm_run(vm, 0);
+        if(vm->exit_reason == VM_EXIT_BUDGET)
+        {
+            fprintf(out, "\nstopped: instruction budget used up\n");
+        }
+        else if(vm->exit_reason == VM_EXIT_TIMEOUT)
+        {
+            fprintf(out, "\nstopped: timed out\n");
+        }
+    }
+
+    vm_destroy(vm);
+    fclose(out);
+}
+
+static void* worker_main(void* arg)
+{
+    batch_worker_t* w = arg;
+    batch_pool_t* pool = w->pool;
+    vm_metrics_t* metrics = metrics_slot(w->id);
+
+    for(;;)
+    {
+        int job = queue_pop(&pool->queues[w->id]);
+
+        // Nothing left locally, go round the other workers
+        for(int i = 1; job < 0 && i < pool->worker_count; ++i)
+        {
+            job = queue_steal(&pool->queues[(w->id + i) % pool->worker_count]);
+        }
+
+        // Jobs are never added once the pool runs, so empty means done
+        if(job < 0)
+        {
+            return NULL;
+        }
+
+        run_job(pool, &pool->jobs[job], metrics);
+    }
+}
+
+int batch_main(int argc, const char* argv[])
+{
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t max_instructions = 0;
+    uint64_t timeout_ms = 0;
+    const char* metrics_socket = NULL;
+
+    int first = 0;
+    for(; first + 1 < argc && argv[first][0] == '-'; first += 2)
+    {
+        if(strcmp(argv[first], "-j") == 0)
+        {
+            threads = atoi(argv[first + 1]);
+        }
+        else if(strcmp(argv[first], "-m") == 0)
+        {
+            max_instructions = strtoull(argv[first + 1], NULL, 0);
+        }
+        else if(strcmp(argv[first], "-t") == 0)
+        {
+            timeout_ms = strtoull(argv[first + 1], NULL, 0);
+        }
+        else if(strcmp(argv[first], "-s") == 0)
+        {
+            metrics_socket = argv[first + 1];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    int job_count = argc - first;
+    if(job_count <= 0)
+    {
+        printf("lc3 --batch [-j threads] [-m max-instr] [-t timeout-ms] [-s metrics-socket] image[,image...] ...\n");
+        return 1;
+    }
+    if(metrics_socket && !vm_serve_metrics(metrics_socket))
+    {
+        printf("failed to open metrics socket: %s\n", metrics_socket);
+        return 1;
+    }
+    if(threads < 1)
+    {
+        threads = 1;
+    }
+    if(threads > job_count)
+    {
+        threads = job_count;
+    }
+
+    batch_pool_t pool;
+    pool.worker_count = threads;
+    pool.max_instructions = max_instructions;
+    pool.timeout_ms = timeout_ms;
+    pool.jobs = calloc(job_count, sizeof(batch_job_t));
+    pool.queues = calloc(threads, sizeof(batch_queue_t));
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    batch_worker_t* workers = calloc(threads, sizeof(batch_worker_t));
+
+    for(int i = 0; i < threads; ++i)
+    {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].jobs = calloc(job_count, sizeof(int));
+    }
+
+    // Deal the jobs out round robin, stealing evens out the rest
+    for(int i = 0; i < job_count; ++i)
+    {
+        batch_queue_t* q = &pool.queues[i % threads];
+        pool.jobs[i].images = argv[first + i];
+        q->jobs[q->tail++] = i;
+    }
+
+    for(int i = 0; i < threads; ++i)
+    {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        workers[i].started = pthread_create(&tids[i], NULL, worker_main, &workers[i]) == 0;
+    }
+    // A worker whose thread could not be started runs here instead, and
+    // steals whatever the others leave
+    for(int i = 0; i < threads; ++i)
+    {
+        if(!workers[i].started)
+        {
+            worker_main(&workers[i]);
+        }
+    }
+    for(int i = 0; i < threads; ++i)
+    {
+        if(workers[i].started)
+        {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+    for(int i = 0; i < job_count; ++i)
+    {
+        batch_job_t* job = &pool.jobs[i];
+        printf("==> %s <==\n", job->images);
+        if(job->output)
+        {
+            fwrite(job->output, 1, job->output_len, stdout);
+            free(job->output);
+        }
+    }
+
+    for(int i = 0; i < threads; ++i)
+    {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+        free(pool.queues[i].jobs);
+    }
+    free(workers);
+    free(tids);
+    free(pool.queues);
+    free(pool.jobs);
+    return 0;
+}
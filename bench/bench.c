@@ -0,0 +1,249 @@
+/*
+  Benchmark harness - runs every workload listed in workloads.txt (see
+  gen.c) through a vm binary with stdin and stdout on /dev/null, and
+  reports guest instructions per second and ns per instruction. Where
+  perf counters are available the host cache misses are reported too.
+  Each workload runs a few times and the fastest run counts. The header
+  of each set of results carries the vm's --version output.
+
+  bench [-r runs] [-l label] [-o results.txt] vm-binary workload-dir
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+/* unix */
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Cache miss counter inherited by the vm child process, -1 if unavailable
+static int open_cache_misses()
+{
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+// Run vm on one image, returns wall seconds or a negative value on failure
+static double run_once(const char* vm, const char* image, int counter, uint64_t* misses)
+{
+#if defined(__linux__)
+    if(counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    double start = now_s();
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        execl(vm, vm, image, (char*)NULL);
+        _exit(127);
+    }
+    int status = 0;
+    if(pid < 0 || waitpid(pid, &status, 0) < 0)
+    {
+        return -1;
+    }
+    double elapsed = now_s() - start;
+#if defined(__linux__)
+    if(counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(counter, misses, sizeof(*misses)) != sizeof(*misses))
+        {
+            *misses = 0;
+        }
+    }
+#endif
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        return -1;
+    }
+    return elapsed;
+}
+
+// The vm's --version lines as "# " comments, empty if it has none
+static void build_info(const char* vm, char* buf, size_t n)
+{
+    buf[0] = 0;
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "'%s' --version 2>/dev/null", vm);
+    FILE* p = popen(cmd, "r");
+    if(!p)
+    {
+        return;
+    }
+    char line[256];
+    size_t len = 0;
+    while(fgets(line, sizeof(line), p))
+    {
+        int w = snprintf(buf + len, n - len, "# %s", line);
+        if(w < 0 || (size_t)w >= n - len)
+        {
+            break;
+        }
+        len += (size_t)w;
+    }
+    pclose(p);
+}
+
+int main(int argc, const char* argv[])
+{
+    int runs = 3;
+    const char* label = "default";
+    const char* results = NULL;
+    int i = 1;
+
+    for(; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if(strcmp(argv[i], "-r") == 0)
+        {
+            runs = atoi(argv[i + 1]);
+        }
+        else if(strcmp(argv[i], "-l") == 0)
+        {
+            label = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "-o") == 0)
+        {
+            results = argv[i + 1];
+        }
+        else
+        {
+            break;
+        }
+    }
+    if(argc - i != 2 || runs < 1)
+    {
+        printf("bench [-r runs] [-l label] [-o results.txt] vm-binary workload-dir\n");
+        return 1;
+    }
+    const char* vm = argv[i];
+    const char* dir = argv[i + 1];
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/workloads.txt", dir);
+    FILE* list = fopen(path, "r");
+    if(!list)
+    {
+        perror(path);
+        return 1;
+    }
+
+    FILE* out = results ? fopen(results, "a") : NULL;
+    if(results && !out)
+    {
+        perror(results);
+        fclose(list);
+        return 1;
+    }
+
+    int counter = open_cache_misses();
+    char stamp[64];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+
+    char build[1024];
+    build_info(vm, build, sizeof(build));
+
+    char header[1536];
+    snprintf(header, sizeof(header), "# %s engine=%s vm=%s runs=%d\n%s"
+             "%-8s %12s %9s %9s %8s %14s\n", stamp, label, vm, runs, build,
+             "workload", "instructions", "seconds", "Minstr/s", "ns/instr", "cache-misses");
+    fputs(header, stdout);
+    if(out)
+    {
+        fputs(header, out);
+    }
+
+    int status = 0;
+    char name[64];
+    unsigned long long count;
+    while(fscanf(list, "%63s %llu", name, &count) == 2)
+    {
+        snprintf(path, sizeof(path), "%s/%s.obj", dir, name);
+
+        double best = -1;
+        uint64_t best_misses = 0;
+        for(int r = 0; r < runs; ++r)
+        {
+            uint64_t misses = 0;
+            double s = run_once(vm, path, counter, &misses);
+            if(s < 0)
+            {
+                best = -1;
+                break;
+            }
+            if(best < 0 || s < best)
+            {
+                best = s;
+                best_misses = misses;
+            }
+        }
+
+        char line[256];
+        if(best < 0)
+        {
+            snprintf(line, sizeof(line), "%-8s failed\n", name);
+            status = 1;
+        }
+        else
+        {
+            char misses[32] = "n/a";
+            if(counter >= 0)
+            {
+                snprintf(misses, sizeof(misses), "%llu", (unsigned long long)best_misses);
+            }
+            snprintf(line, sizeof(line), "%-8s %12llu %9.3f %9.1f %8.2f %14s\n", name, count,
+                     best, count / best / 1e6, best * 1e9 / count, misses);
+        }
+        fputs(line, stdout);
+        if(out)
+        {
+            fputs(line, out);
+        }
+    }
+
+    if(counter >= 0)
+    {
+        close(counter);
+    }
+    if(out)
+    {
+        fclose(out);
+    }
+    fclose(list);
+    return status;
+}
@@ -0,0 +1,347 @@
+/*
+  Writes the benchmark workloads as LC-3 object files, plus workloads.txt
+  with the exact number of instructions each one executes (HALT included).
+  Every workload is deterministic and needs no input.
+
+  gen out-dir
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ORIGIN 0x3000
+
+typedef struct
+{
+    uint16_t words[0x8000];
+    uint16_t len;  /* words emitted, from ORIGIN */
+} image_t;
+
+static uint16_t here(image_t* img)
+{
+    return ORIGIN + img->len;
+}
+
+static void emit(image_t* img, uint16_t w)
+{
+    img->words[img->len++] = w;
+}
+
+// Instruction encoders, PC relative offsets are from the next instruction
+static uint16_t off(uint16_t from, uint16_t to, int bits)
+{
+    return (uint16_t)(to - (from + 1)) & ((1 << bits) - 1);
+}
+
+#define ADD_IMM(d, s, imm) (uint16_t)(0x1020 | (d) << 9 | (s) << 6 | ((imm) & 0x1F))
+#define ADD_REG(d, s1, s2) (uint16_t)(0x1000 | (d) << 9 | (s1) << 6 | (s2))
+#define AND_IMM(d, s, imm) (uint16_t)(0x5020 | (d) << 9 | (s) << 6 | ((imm) & 0x1F))
+#define NOT(d, s)          (uint16_t)(0x903F | (d) << 9 | (s) << 6)
+#define LDR(d, b, o)       (uint16_t)(0x6000 | (d) << 9 | (b) << 6 | ((o) & 0x3F))
+#define STR(s, b, o)       (uint16_t)(0x7000 | (s) << 9 | (b) << 6 | ((o) & 0x3F))
+#define JSRR(b)            (uint16_t)(0x4000 | (b) << 6)
+#define RET                (uint16_t)0xC1C0
+#define TRAP(v)            (uint16_t)(0xF000 | (v))
+
+static void emit_pcrel(image_t* img, uint16_t base, uint16_t target, int bits)
+{
+    uint16_t pc = here(img);
+    emit(img, base | off(pc, target, bits));
+}
+
+// Forward references are patched once the target is known
+static void patch(image_t* img, uint16_t at, uint16_t target, int bits)
+{
+    img->words[at - ORIGIN] |= off(at, target, bits);
+}
+
+#define BR_P 0x0200
+#define BR_NZP 0x0E00
+
+static int write_obj(const char* dir, const char* name, const image_t* img)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.obj", dir, name);
+    FILE* f = fopen(path, "wb");
+    if(!f)
+    {
+        perror(path);
+        return 0;
+    }
+    uint8_t be[2] = { ORIGIN >> 8, ORIGIN & 0xFF };
+    fwrite(be, 1, 2, f);
+    for(uint16_t i = 0; i < img->len; ++i)
+    {
+        be[0] = img->words[i] >> 8;
+        be[1] = img->words[i] & 0xFF;
+        fwrite(be, 1, 2, f);
+    }
+    return fclose(f) == 0;
+}
+
+// Shared two level loop:
+//
+//         LD  R6, OUTER
+//   OL    <setup>
+//         LD  R5, INNER
+//   IL    <body>
+//         ADD R5, R5, #-1
+//         BRp IL
+//         ADD R6, R6, #-1
+//         BRp OL
+//         HALT
+//   OUTER .FILL
+//   INNER .FILL
+//
+// The callbacks emit setup and body and return how many instructions they
+// execute per pass, so the total can be worked out exactly.
+typedef uint64_t (*emit_fn)(image_t* img);
+
+typedef struct
+{
+    const char* name;
+    uint16_t outer;  /* iterations of each loop, at most x7FFF */
+    uint16_t inner;
+    emit_fn setup;
+    emit_fn body;
+    emit_fn tail;  /* data and subroutines after HALT */
+} workload_t;
+
+static uint16_t outer_at, inner_at;
+
+static uint64_t build(image_t* img, const workload_t* w)
+{
+    memset(img, 0, sizeof(*img));
+
+    uint16_t ld_outer = here(img);
+    emit(img, 0x2000 | 6 << 9);
+    uint16_t ol = here(img);
+    uint64_t setup = w->setup ? w->setup(img) : 0;
+    uint16_t ld_inner = here(img);
+    emit(img, 0x2000 | 5 << 9);
+    uint16_t il = here(img);
+    uint64_t body = w->body(img);
+    emit(img, ADD_IMM(5, 5, -1));
+    emit_pcrel(img, BR_P, il, 9);
+    emit(img, ADD_IMM(6, 6, -1));
+    emit_pcrel(img, BR_P, ol, 9);
+    emit(img, TRAP(0x25));
+
+    outer_at = here(img);
+    emit(img, w->outer);
+    inner_at = here(img);
+    emit(img, w->inner);
+    patch(img, ld_outer, outer_at, 9);
+    patch(img, ld_inner, inner_at, 9);
+
+    if(w->tail)
+    {
+        w->tail(img);
+    }
+
+    return 1 + (uint64_t)w->outer * (setup + 1 + (uint64_t)w->inner * (body + 2) + 2) + 1;
+}
+
+// --- arith: ADD/AND/NOT only ---
+static uint64_t arith_body(image_t* img)
+{
+    emit(img, ADD_IMM(0, 0, 1));
+    emit(img, ADD_REG(1, 1, 0));
+    emit(img, AND_IMM(2, 1, 15));
+    emit(img, NOT(3, 2));
+    emit(img, ADD_REG(4, 3, 1));
+    emit(img, ADD_IMM(1, 4, -3));
+    emit(img, AND_IMM(4, 4, 0));
+    emit(img, NOT(0, 0));
+    return 8;
+}
+
+// --- memcpy: 256 words from x4000 to x5000 with LDR/STR ---
+static uint16_t src_at, dst_at;
+static uint16_t src_ld, dst_ld;
+
+static uint64_t memcpy_setup(image_t* img)
+{
+    src_ld = here(img);
+    emit(img, 0x2000 | 1 << 9);  /* LD R1, SRC */
+    dst_ld = here(img);
+    emit(img, 0x2000 | 2 << 9);  /* LD R2, DST */
+    return 2;
+}
+
+static uint64_t memcpy_body(image_t* img)
+{
+    emit(img, LDR(0, 1, 0));
+    emit(img, STR(0, 2, 0));
+    emit(img, ADD_IMM(1, 1, 1));
+    emit(img, ADD_IMM(2, 2, 1));
+    return 4;
+}
+
+static uint64_t memcpy_tail(image_t* img)
+{
+    src_at = here(img);
+    emit(img, 0x4000);
+    dst_at = here(img);
+    emit(img, 0x5000);
+    patch(img, src_ld, src_at, 9);
+    patch(img, dst_ld, dst_at, 9);
+
+    // Source data so the copy moves something other than zeros
+    while(here(img) < 0x4000)
+    {
+        emit(img, 0);
+    }
+    for(int i = 0; i < 256; ++i)
+    {
+        emit(img, (uint16_t)(i * 0x9E37));
+    }
+    return 0;
+}
+
+// --- ldi: chase a shuffled cyclic list of 8192 nodes at x4000 ---
+//   LDI R1, P / ST R1, P  - P moves to the next node each pass
+#define CHASE_NODES 8192
+static uint16_t p_at, chase_ldi, chase_st;
+
+static uint64_t chase_body(image_t* img)
+{
+    chase_ldi = here(img);
+    emit(img, 0xA000 | 1 << 9);  /* LDI R1, P */
+    chase_st = here(img);
+    emit(img, 0x3000 | 1 << 9);  /* ST R1, P */
+    return 2;
+}
+
+static uint64_t chase_tail(image_t* img)
+{
+    static uint16_t order[CHASE_NODES];
+    uint32_t seed = 12345;
+    for(int i = 0; i < CHASE_NODES; ++i)
+    {
+        order[i] = i;
+    }
+    for(int i = CHASE_NODES - 1; i > 0; --i)
+    {
+        seed = seed * 1103515245 + 12345;
+        int k = (seed >> 8) % (i + 1);
+        uint16_t t = order[i];
+        order[i] = order[k];
+        order[k] = t;
+    }
+
+    p_at = here(img);
+    emit(img, 0x4000 + order[0]);
+    patch(img, chase_ldi, p_at, 9);
+    patch(img, chase_st, p_at, 9);
+
+    while(here(img) < 0x4000)
+    {
+        emit(img, 0);
+    }
+    uint16_t base = img->len;
+    for(int i = 0; i < CHASE_NODES; ++i)
+    {
+        emit(img, 0);
+    }
+    for(int i = 0; i < CHASE_NODES; ++i)
+    {
+        img->words[base + order[i]] = 0x4000 + order[(i + 1) % CHASE_NODES];
+    }
+    return 0;
+}
+
+// --- call: JSR to one leaf and JSRR to another every pass ---
+static uint16_t jsr_at, lea_at;
+
+static uint64_t call_setup(image_t* img)
+{
+    lea_at = here(img);
+    emit(img, 0xE000 | 4 << 9);  /* LEA R4, G */
+    return 1;
+}
+
+static uint64_t call_body(image_t* img)
+{
+    jsr_at = here(img);
+    emit(img, 0x4800);           /* JSR F */
+    emit(img, JSRR(4));
+    return 2 + 2 + 2;            /* plus ADD and RET in each leaf */
+}
+
+static uint64_t call_tail(image_t* img)
+{
+    uint16_t f = here(img);
+    emit(img, ADD_IMM(0, 0, 1));
+    emit(img, RET);
+    uint16_t g = here(img);
+    emit(img, ADD_IMM(1, 1, -1));
+    emit(img, RET);
+    patch(img, jsr_at, f, 11);
+    patch(img, lea_at, g, 9);
+    return 0;
+}
+
+// --- puts: a 64 character line through TRAP PUTS every pass ---
+static uint16_t str_lea;
+
+static uint64_t puts_body(image_t* img)
+{
+    str_lea = here(img);
+    emit(img, 0xE000);           /* LEA R0, STR */
+    emit(img, TRAP(0x22));
+    return 2;
+}
+
+static uint64_t puts_tail(image_t* img)
+{
+    const char* line = "the quick brown fox jumps over the lazy dog 0123456789 abcdefgh\n";
+    patch(img, str_lea, here(img), 9);
+    for(const char* c = line; *c; ++c)
+    {
+        emit(img, (uint16_t)*c);
+    }
+    emit(img, 0);
+    return 0;
+}
+
+static const workload_t workloads[] =
+{
+    { "arith",   2000, 10000, NULL,         arith_body,  NULL },
+    { "memcpy", 30000,   256, memcpy_setup, memcpy_body, memcpy_tail },
+    { "ldi",     2000, 10000, NULL,         chase_body,  chase_tail },
+    { "call",    2000,  5000, call_setup,   call_body,   call_tail },
+    { "puts",    2000,   500, NULL,         puts_body,   puts_tail },
+};
+
+int main(int argc, const char* argv[])
+{
+    if(argc != 2)
+    {
+        printf("gen out-dir\n");
+        return 1;
+    }
+
+    static image_t img;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/workloads.txt", argv[1]);
+    FILE* list = fopen(path, "w");
+    if(!list)
+    {
+        perror(path);
+        return 1;
+    }
+
+    for(size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); ++i)
+    {
+        uint64_t count = build(&img, &workloads[i]);
+        if(!write_obj(argv[1], workloads[i].name, &img))
+        {
+            fclose(list);
+            return 1;
+        }
+        fprintf(list, "%s %llu\n", workloads[i].name, (unsigned long long)count);
+    }
+    return fclose(list) != 0;
+}
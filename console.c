@@ -0,0 +1,327 @@
+/*
+  Console I/O for a machine, see console.h
+*/
+#include <stdio.h>
+#include <string.h>
+/* unix */
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vm.h"
+#include "cpu.h"
+#include "interrupt.h"
+
+// Pick the flush policy for the current output stream
+void console_attach(vm_t* vm)
+{
+    console_t* c = &vm->console;
+    c->immediate = !vm->output_fn && vm->out && isatty(fileno(vm->out));
+    if(!c->flush_ms)
+    {
+        c->flush_ms = CONSOLE_FLUSH_MS;
+    }
+    c->last_flush_ms = vm_now_ms();
+}
+
+void console_flush(vm_t* vm)
+{
+    console_t* c = &vm->console;
+    METRIC_ADD(vm, output_bytes, c->len);
+    if(vm->output_fn)
+    {
+        if(c->len)
+        {
+            vm->output_fn(vm->output_ctx, c->buf, c->len);
+            c->len = 0;
+        }
+    }
+    else
+    {
+        if(c->len)
+        {
+            fwrite(c->buf, 1, c->len, vm->out);
+            c->len = 0;
+        }
+        fflush(vm->out);
+    }
+    c->last_flush_ms = vm_now_ms();
+}
+
+void console_write(vm_t* vm, const char* s, size_t n)
+{
+    console_t* c = &vm->console;
+    while(n)
+    {
+        size_t room = CONSOLE_BUFFER_SIZE - c->len;
+        size_t chunk = n < room ? n : room;
+        memcpy(c->buf + c->len, s, chunk);
+        c->len += chunk;
+        s += chunk;
+        n -= chunk;
+        if(c->len >= CONSOLE_FLUSH_THRESHOLD)
+        {
+            console_flush(vm);
+        }
+    }
+}
+
+// Low byte of each word, what PUTS prints for a character. The vector
+// parts return how many words they did.
+#if VM_HAVE_AVX2
+VM_TARGET_AVX2 static size_t narrow_avx2(char* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+    const __m256i low = _mm256_set1_epi16(0x00FF);
+    for(; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + i)), low);
+        __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(src + i + 16)), low);
+        // The pack works within 128 bit lanes, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i*)(dst + i), packed);
+    }
+    return i;
+}
+#endif
+
+static size_t narrow_sse2(char* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i)), low);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + i + 8)), low);
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#endif
+    return i;
+}
+
+static void narrow(char* dst, const uint16_t* src, size_t n)
+{
+#if VM_MULTIVERSION
+    size_t i = cpu_avx2() ? narrow_avx2(dst, src, n) : narrow_sse2(dst, src, n);
+#elif VM_HAVE_AVX2
+    size_t i = narrow_avx2(dst, src, n);
+#else
+    size_t i = narrow_sse2(dst, src, n);
+#endif
+    for(; i < n; ++i)
+    {
+        dst[i] = (char)src[i];
+    }
+}
+
+void console_write_chars(vm_t* vm, const uint16_t* s, size_t n)
+{
+    console_t* c = &vm->console;
+    while(n)
+    {
+        size_t room = CONSOLE_BUFFER_SIZE - c->len;
+        size_t chunk = n < room ? n : room;
+        narrow(c->buf + c->len, s, chunk);
+        c->len += chunk;
+        s += chunk;
+        n -= chunk;
+        if(c->len >= CONSOLE_FLUSH_THRESHOLD)
+        {
+            console_flush(vm);
+        }
+    }
+}
+
+// End of an output trap
+void console_trap_done(vm_t* vm)
+{
+    console_t* c = &vm->console;
+    if(c->immediate || vm_now_ms() - c->last_flush_ms >= c->flush_ms)
+    {
+        console_flush(vm);
+    }
+}
+
+// Write the buffer out once flush_ms has passed since the last write.
+// vm_check_limits() calls this too, so output printed before a long
+// computation shows up on time without another output trap.
+void console_flush_due(vm_t* vm)
+{
+    console_t* c = &vm->console;
+    if(c->len && vm_now_ms() - c->last_flush_ms >= c->flush_ms)
+    {
+        console_flush(vm);
+    }
+}
+
+// Input starts being read on the first poll, machines that never look at
+// the keyboard don't get a reader thread
+static keyboard_t* console_keyboard(vm_t* vm)
+{
+    if(vm->keyboard.data)
+    {
+        return &vm->keyboard;
+    }
+    if(!vm->in)
+    {
+        return NULL;
+    }
+    if(!vm->keyboard.started && !keyboard_start(&vm->keyboard, fileno(vm->in)))
+    {
+        return NULL;
+    }
+    return &vm->keyboard;
+}
+
+// With stop_on_input set, stop the machine if no key is waiting. Returns 1
+// when the machine was stopped.
+int console_wants_stop(vm_t* vm)
+{
+    if(!vm->stop_on_input)
+    {
+        return 0;
+    }
+    keyboard_t* kb = console_keyboard(vm);
+    if(kb && keyboard_ready(kb))
+    {
+        return 0;
+    }
+    vm->running = 0;
+    vm->exit_reason = VM_EXIT_INPUT;
+    return 1;
+}
+
+uint16_t check_key(vm_t* vm)
+{
+    keyboard_t* kb = console_keyboard(vm);
+    if(!kb)
+    {
+        return 0;
+    }
+
+    // The guest is about to wait for a key, let it see what it wrote
+    if(vm->console.len)
+    {
+        console_flush(vm);
+    }
+    return keyboard_poll(kb);
+}
+
+// Next console character, EOF when the machine has no input. Pending output
+// is written first since this may block.
+int console_getchar(vm_t* vm)
+{
+    if(vm->console.len)
+    {
+        console_flush(vm);
+    }
+    keyboard_t* kb = console_keyboard(vm);
+    return kb ? keyboard_getc(kb) : EOF;
+}
+
+// An empty KBSR poll. Once the guest has polled KBD_SPIN_POLLS times in a
+// row from the same instruction, and that instruction sits in a loop that
+// does nothing else (vm_spin_loop()), sleep until a key arrives rather
+// than run the loop again. The guest sees the same polls, only fewer of
+// them. Runs with an instruction budget keep spinning, sleeping would only
+// make them slower to use it up, and so do guests waiting for an interrupt.
+// Returns 1 if a key came in.
+static int spin_wait(vm_t* vm)
+{
+    keyboard_t* kb = console_keyboard(vm);
+    uint16_t pc = vm->reg[R_PC] - 1;
+    if(!kb || kb->data || vm->max_instructions || !vm->running || interrupt_enabled(vm))
+    {
+        return 0;
+    }
+    if(pc != kb->spin_pc)
+    {
+        kb->spin_pc = pc;
+        kb->spin_polls = 0;
+    }
+    if(++kb->spin_polls < KBD_SPIN_POLLS)
+    {
+        return 0;
+    }
+    if(kb->spin_polls == KBD_SPIN_POLLS)
+    {
+        kb->spin_loop = vm_spin_loop(vm, pc);
+    }
+    if(!kb->spin_loop)
+    {
+        return 0;
+    }
+
+    // Wake up for the timeout, and once it has passed have the end of the
+    // loop's block look at the limits instead of waiting for the next check
+    long timeout_us = KBD_SPIN_SLEEP_US;
+    if(vm->deadline_ms)
+    {
+        uint64_t now = vm_now_ms();
+        if(now >= vm->deadline_ms)
+        {
+            vm->next_check = vm->instructions;
+            return 0;
+        }
+        if((vm->deadline_ms - now) * 1000 < (uint64_t)timeout_us)
+        {
+            timeout_us = (long)(vm->deadline_ms - now) * 1000;
+        }
+    }
+    // Nothing runs to flush while the machine sleeps
+    if(vm->console.len)
+    {
+        console_flush(vm);
+    }
+    return keyboard_sleep(kb, timeout_us);
+}
+
+// Keyboard page - KBSR reports a key waiting, reading KBDR takes it. The
+// other words in the page behave like memory. KBSR keeps the interrupt
+// enable the guest stored.
+static uint16_t keyboard_read(vm_t* vm, uint16_t address)
+{
+    if(address == MR_KBSR)
+    {
+        METRIC_ADD(vm, kbsr_polls, 1);
+        int ready = !console_wants_stop(vm) && (check_key(vm) || spin_wait(vm));
+        if(ready)
+        {
+            vm->keyboard.spin_polls = 0;
+        }
+        vm->memory[MR_KBSR] = (uint16_t)((ready ? DEV_READY : 0) | (vm->memory[MR_KBSR] & DEV_IE));
+        vm_mark_dirty(vm, address);
+    }
+    else if(address == MR_KBDR && check_key(vm))
+    {
+        vm->memory[MR_KBDR] = (uint16_t)console_getchar(vm);
+        vm_mark_dirty(vm, address);
+    }
+    return vm->memory[address];
+}
+
+// Only the interrupt enable of KBSR can be stored. Enabling it starts the
+// reader, keys have to come in for the guest to be interrupted.
+static void keyboard_write(vm_t* vm, uint16_t address, uint16_t val)
+{
+    if(address == MR_KBSR)
+    {
+        val = (uint16_t)((vm->memory[MR_KBSR] & DEV_READY) | (val & DEV_IE));
+        if(val & DEV_IE)
+        {
+            console_keyboard(vm);
+            interrupt_raise(vm);
+        }
+    }
+    vm->memory[address] = val;
+    vm_mark_dirty(vm, address);
+    invalidate_decode(vm, address, address + 1);
+}
+
+void console_map_devices(vm_t* vm)
+{
+    static const device_t keyboard = { "keyboard", keyboard_read, keyboard_write };
+    vm_map_device(vm, MR_KBSR >> VM_PAGE_SHIFT, 1, &keyboard);
+}
@@ -0,0 +1,54 @@
+/*
+  Console I/O for a machine - keyboard input and buffered output.
+
+  Output traps append to a per-machine buffer instead of writing and
+  flushing every character. The buffer is written out before the machine
+  can block on input (GETC, IN, KBSR polling), on HALT, when it passes
+  CONSOLE_FLUSH_THRESHOLD bytes and when flush_ms has passed since the last
+  write, which is looked at after every output trap and with the run
+  limits. A terminal is flushed after every output trap, same as before.
+
+  Input goes through the keyboard device (keyboard.h).
+*/
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONSOLE_BUFFER_SIZE (64 * 1024)
+#define CONSOLE_FLUSH_THRESHOLD (CONSOLE_BUFFER_SIZE - 256)
+#define CONSOLE_FLUSH_MS 50
+
+typedef struct
+{
+    char buf[CONSOLE_BUFFER_SIZE];
+    size_t len;
+    int immediate;           /* flush after every output trap */
+    unsigned flush_ms;       /* longest time output may sit in the buffer */
+    uint64_t last_flush_ms;
+} console_t;
+
+struct vm;
+
+void console_attach(struct vm* vm);
+void console_flush(struct vm* vm);
+void console_write(struct vm* vm, const char* s, size_t n);
+void console_write_chars(struct vm* vm, const uint16_t* s, size_t n);
+void console_trap_done(struct vm* vm);
+void console_flush_due(struct vm* vm);
+uint16_t check_key(struct vm* vm);
+int console_wants_stop(struct vm* vm);
+int console_getchar(struct vm* vm);
+void console_map_devices(struct vm* vm);
+
+static inline void console_putc(console_t* c, struct vm* vm, char ch)
+{
+    c->buf[c->len++] = ch;
+    if(c->len >= CONSOLE_FLUSH_THRESHOLD)
+    {
+        console_flush(vm);
+    }
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+  Run time CPU dispatch for the SIMD kernels - the loader's byte swap and
+  the string scans of PUTS and PUTSP.
+
+  Each kernel is written for the vector unit the build targets (SSSE3,
+  SSE2, NEON or none). x86-64 builds that don't target AVX2 also compile
+  an AVX2 version with GCC's target attribute and call it when the CPU
+  they run on has AVX2, so one baseline binary gets the wide kernels where
+  they exist. A build for an AVX2 machine (make MARCH=native on one) calls
+  the AVX2 version directly. Build with -DVM_MULTIVERSION=0 to compile
+  only the targeted version.
+*/
+#ifndef CPU_H
+#define CPU_H
+
+#ifndef VM_MULTIVERSION
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__AVX2__)
+#define VM_MULTIVERSION 1
+#else
+#define VM_MULTIVERSION 0
+#endif
+#endif
+
+// Does this build have AVX2 kernels, and what do they need to compile?
+#if VM_MULTIVERSION
+#define VM_HAVE_AVX2 1
+#define VM_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#define VM_HAVE_AVX2 1
+#define VM_TARGET_AVX2
+#else
+#define VM_HAVE_AVX2 0
+#endif
+
+#if VM_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+// Should the AVX2 kernels run? Compiled in and, for a multiversioned
+// build, supported by this CPU.
+static inline int cpu_avx2()
+{
+#if VM_MULTIVERSION
+    return __builtin_cpu_supports("avx2");
+#else
+    return VM_HAVE_AVX2;
+#endif
+}
+
+// Kernels in use, for --version
+static inline const char* cpu_swap_kernel()
+{
+    if(cpu_avx2())
+    {
+        return "avx2";
+    }
+#if defined(__SSSE3__)
+    return "ssse3";
+#elif defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+static inline const char* cpu_scan_kernel()
+{
+    if(cpu_avx2())
+    {
+        return "avx2";
+    }
+#if defined(__SSE2__)
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+#endif
@@ -0,0 +1,1166 @@
+/*
+  Debugger - breakpoints in the decode cache, watchpoints in the device
+  map, and the two front ends: a command line on the terminal and a GDB
+  remote protocol stub. See debug.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "vm.h"
+#include "debug.h"
+#include "interrupt.h"
+
+#define DEBUG_WORDS (sizeof(((vm_t*)0)->memory) / sizeof(uint16_t))
+
+// Largest remote packet, advertised in hex by qSupported
+#define GDB_PACKET_SIZE 4096
+
+// Machine stopped by SIGINT in the command line front end
+static vm_t* debug_vm = NULL;
+
+// Installed in place of the handler at a breakpoint. The loop already
+// moved PC past the instruction, so step back in front of it.
+static void pd_break(vm_t* vm, const decoded_t* d)
+{
+    (void)d;
+    vm->reg[R_PC]--;
+    vm->debug->stop = DEBUG_STOP_BREAK;
+    vm->running = 0;
+}
+
+// Called by predecode() for every entry it decodes while debugging
+void debug_patch(vm_t* vm, uint16_t pc)
+{
+    if(vm->debug->breakpoint[pc])
+    {
+        vm->decode_cache[pc].fn = pd_break;
+    }
+}
+
+// The device that had the page before the watch device, NULL for memory
+static const device_t* saved_device(vm_t* vm, uint16_t address)
+{
+    uint8_t dev = vm->debug->saved_page[address >> VM_PAGE_SHIFT];
+    return dev ? &vm->devices[dev - 1] : NULL;
+}
+
+static uint16_t watch_read(vm_t* vm, uint16_t address)
+{
+    const device_t* dev = saved_device(vm, address);
+    return dev && dev->read ? dev->read(vm, address) : vm->memory[address];
+}
+
+// Does what mem_write() would have done, then stops the machine if the
+// address is watched. The instruction finishes first.
+static void watch_write(vm_t* vm, uint16_t address, uint16_t val)
+{
+    debug_t* dbg = vm->debug;
+    const device_t* dev = saved_device(vm, address);
+    uint16_t old = vm->memory[address];
+
+    if(dev && dev->write)
+    {
+        dev->write(vm, address, val);
+    }
+    else
+    {
+        vm->memory[address] = val;
+        vm_mark_dirty(vm, address);
+        invalidate_decode(vm, address, address + 1);
+    }
+
+    if(dbg->watchpoint[address])
+    {
+        dbg->watch_address = address;
+        dbg->watch_old = old;
+        dbg->watch_new = val;
+        dbg->stop = DEBUG_STOP_WATCH;
+        vm->running = 0;
+    }
+}
+
+static const device_t watch_device = { "watch", watch_read, watch_write };
+
+int debug_attach(vm_t* vm)
+{
+    if(vm->debug)
+    {
+        return 1;
+    }
+    debug_t* dbg = calloc(1, sizeof(debug_t));
+    if(!dbg)
+    {
+        return 0;
+    }
+    // Registered without pages, debug_watch() hands them over
+    if(!vm_map_device(vm, 0, 0, &watch_device))
+    {
+        free(dbg);
+        return 0;
+    }
+    dbg->device = vm->device_count;
+    vm->debug = dbg;
+
+    // Entries decoded so far may be superinstructions, which would run
+    // straight over a breakpoint in their middle
+    invalidate_decode(vm, 0, DEBUG_WORDS);
+    console_attach(vm);
+    return 1;
+}
+
+// Give the pages back and drop the breakpoints. The watch device stays
+// registered, with no pages.
+void debug_detach(vm_t* vm)
+{
+    debug_t* dbg = vm->debug;
+    if(!dbg)
+    {
+        return;
+    }
+    for(int p = 0; p < VM_PAGE_COUNT; ++p)
+    {
+        if(dbg->page_watches[p])
+        {
+            vm->device_page[p] = dbg->saved_page[p];
+        }
+    }
+    vm->debug = NULL;
+    invalidate_decode(vm, 0, DEBUG_WORDS);
+    free(dbg);
+}
+
+// Set or clear a breakpoint. Every address is in memory, so this can't
+// fail, the result is there for the callers.
+int debug_break(vm_t* vm, uint16_t address, int on)
+{
+    vm->debug->breakpoint[address] = on != 0;
+    // Decoded again on the next visit, with or without the breakpoint
+    vm->decode_cache[address].fn = NULL;
+    return 1;
+}
+
+// Set or clear a watchpoint. The first one on a page maps the page to the
+// watch device, the last one gives it back.
+int debug_watch(vm_t* vm, uint16_t address, int on)
+{
+    debug_t* dbg = vm->debug;
+    if(!dbg->watchpoint[address] == !on)
+    {
+        return 1;
+    }
+
+    uint8_t page = address >> VM_PAGE_SHIFT;
+    dbg->watchpoint[address] = on != 0;
+    if(on && dbg->page_watches[page]++ == 0)
+    {
+        dbg->saved_page[page] = vm->device_page[page];
+        vm->device_page[page] = dbg->device;
+    }
+    else if(!on && --dbg->page_watches[page] == 0)
+    {
+        vm->device_page[page] = dbg->saved_page[page];
+    }
+    return 1;
+}
+
+static void start(vm_t* vm)
+{
+    vm->running = 1;
+    vm->exit_reason = VM_EXIT_HALT;
+    vm->debug->stop = DEBUG_STOP_STEP;
+    vm->block_start = vm->reg[R_PC];
+    vm->next_check = 0;
+    vm_check_limits(vm);
+}
+
+// Count what ran since start(), so the debugger can move PC before the
+// next one. A stop always lands in straight line code, end_block() has
+// seen everything up to block_start.
+static int finish(vm_t* vm)
+{
+    debug_t* dbg = vm->debug;
+    console_flush(vm);
+    vm_count(vm, vm->reg[R_PC]);
+    vm->block_start = vm->reg[R_PC];
+    if(!vm->running && dbg->stop == DEBUG_STOP_STEP)
+    {
+        dbg->stop = vm->exit_reason == VM_EXIT_FAULT ? DEBUG_STOP_FAULT : DEBUG_STOP_HALT;
+    }
+    vm->running = 0;
+    return dbg->stop;
+}
+
+// Run the instruction at PC, even if there is a breakpoint on it
+int debug_step(vm_t* vm)
+{
+    debug_t* dbg = vm->debug;
+    uint16_t pc = vm->reg[R_PC];
+    decoded_t* d = &vm->decode_cache[pc];
+
+    start(vm);
+    if(!d->fn || d->fn == pd_break)
+    {
+        uint8_t bp = dbg->breakpoint[pc];
+        dbg->breakpoint[pc] = 0;
+        predecode(vm, pc);
+        dbg->breakpoint[pc] = bp;
+    }
+    vm->reg[R_PC]++;
+    d->fn(vm, d);
+    // Unless the instruction stored over itself
+    if(d->fn)
+    {
+        debug_patch(vm, pc);
+    }
+    return finish(vm);
+}
+
+// Continue until something stops the machine. With poll set the machine
+// runs DEBUG_SLICE instructions at a time and stops once poll() returns 1.
+static int resume(vm_t* vm, int (*poll)(void* ctx), void* ctx)
+{
+    debug_t* dbg = vm->debug;
+    int stop = debug_step(vm);
+    if(stop != DEBUG_STOP_STEP)
+    {
+        return stop;
+    }
+
+    for(;;)
+    {
+        vm->max_instructions = poll ? vm->instructions + DEBUG_SLICE : 0;
+        start(vm);
+        run_predecoded(vm);
+        if(vm->exit_reason != VM_EXIT_BUDGET || dbg->stop != DEBUG_STOP_STEP)
+        {
+            break;
+        }
+        if(poll(ctx))
+        {
+            dbg->stop = DEBUG_STOP_INTERRUPT;
+            break;
+        }
+    }
+    vm->max_instructions = 0;
+    return finish(vm);
+}
+
+int debug_continue(vm_t* vm)
+{
+    return resume(vm, NULL, NULL);
+}
+
+void debug_disassemble(uint16_t pc, uint16_t instr, char* buf, size_t n)
+{
+    static const char* names[16] =
+    {
+        "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+        "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+    };
+    static const char* traps[] = { "GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT",
+                                   "MEMCPY", "MEMSET", "MUL", "DIV", "PUTN" };
+    int op = instr >> 12;
+    int dr = (instr >> 9) & 0x7;
+    int sr = (instr >> 6) & 0x7;
+    uint16_t next = pc + 1;
+
+    switch(op)
+    {
+        case OP_BR:
+            if(!dr)
+            {
+                snprintf(buf, n, "NOP");
+                break;
+            }
+            snprintf(buf, n, "BR%s%s%s x%04X", dr & 4 ? "n" : "", dr & 2 ? "z" : "", dr & 1 ? "p" : "",
+                     (uint16_t)(next + sign_extend(instr & 0x1FF, 9)));
+            break;
+        case OP_ADD:
+        case OP_AND:
+            if((instr >> 5) & 1)
+            {
+                snprintf(buf, n, "%s R%d, R%d, #%d", names[op], dr, sr, (int16_t)sign_extend(instr & 0x1F, 5));
+            }
+            else
+            {
+                snprintf(buf, n, "%s R%d, R%d, R%d", names[op], dr, sr, instr & 0x7);
+            }
+            break;
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            snprintf(buf, n, "%s R%d, x%04X", names[op], dr, (uint16_t)(next + sign_extend(instr & 0x1FF, 9)));
+            break;
+        case OP_LDR:
+        case OP_STR:
+            snprintf(buf, n, "%s R%d, R%d, #%d", names[op], dr, sr, (int16_t)sign_extend(instr & 0x3F, 6));
+            break;
+        case OP_NOT:
+            snprintf(buf, n, "NOT R%d, R%d", dr, sr);
+            break;
+        case OP_JMP:
+            if(sr == 7)
+            {
+                snprintf(buf, n, "RET");
+            }
+            else
+            {
+                snprintf(buf, n, "JMP R%d", sr);
+            }
+            break;
+        case OP_JSR:
+            if((instr >> 11) & 1)
+            {
+                snprintf(buf, n, "JSR x%04X", (uint16_t)(next + sign_extend(instr & 0x7FF, 11)));
+            }
+            else
+            {
+                snprintf(buf, n, "JSRR R%d", sr);
+            }
+            break;
+        case OP_TRAP:
+            if((instr & 0xFF) >= TRAP_GETC && (instr & 0xFF) <= TRAP_PUTN)
+            {
+                snprintf(buf, n, "%s", traps[(instr & 0xFF) - TRAP_GETC]);
+            }
+            else
+            {
+                snprintf(buf, n, "TRAP x%02X", instr & 0xFF);
+            }
+            break;
+        case OP_RTI:
+            snprintf(buf, n, "RTI");
+            break;
+        default:
+            snprintf(buf, n, ".FILL x%04X", instr);
+            break;
+    }
+}
+
+// Debugger stores, no watchpoint or device sees them
+static void poke(vm_t* vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val;
+    vm_mark_dirty(vm, address);
+    invalidate_decode(vm, address, address + 1);
+}
+
+// R0-R7, PC, then the PSR as the remote protocol numbers them
+static uint16_t get_reg(vm_t* vm, int r)
+{
+    return r == R_COND ? vm_psr(vm) : vm->reg[r];
+}
+
+static void set_reg(vm_t* vm, int r, uint16_t val)
+{
+    if(r == R_COND)
+    {
+        vm_set_cond(vm, val);
+        vm->psr = val & PSR_MASK;
+    }
+    else
+    {
+        vm->reg[r] = val;
+    }
+}
+
+// Command line front end
+
+static void debug_interrupt(int signal)
+{
+    (void)signal;
+    if(debug_vm)
+    {
+        debug_vm->debug->stop = DEBUG_STOP_INTERRUPT;
+        debug_vm->running = 0;
+    }
+}
+
+// x3000, 0x3000, #12 or 12
+static int parse_number(const char* s, long* value)
+{
+    char* end;
+    const char* digits = s;
+    int base = 0;
+    if(s[0] == 'x' || s[0] == 'X')
+    {
+        digits = s + 1;
+        base = 16;
+    }
+    else if(s[0] == '#')
+    {
+        digits = s + 1;
+        base = 10;
+    }
+    *value = strtol(digits, &end, base);
+    return end != digits && *end == '\0';
+}
+
+static int parse_address(const char* s, uint16_t* address)
+{
+    long v;
+    if(!parse_number(s, &v) || v < 0 || (unsigned long)v >= DEBUG_WORDS)
+    {
+        printf("bad address: %s\n", s);
+        return 0;
+    }
+    *address = (uint16_t)v;
+    return 1;
+}
+
+// R0-R7, PC or CC, -1 for anything else
+static int parse_reg(const char* s)
+{
+    if((s[0] == 'r' || s[0] == 'R') && s[1] >= '0' && s[1] <= '7' && !s[2])
+    {
+        return s[1] - '0';
+    }
+    if(strcasecmp(s, "pc") == 0)
+    {
+        return R_PC;
+    }
+    if(strcasecmp(s, "cc") == 0)
+    {
+        return R_COND;
+    }
+    return -1;
+}
+
+static void print_where(vm_t* vm)
+{
+    uint16_t pc = vm->reg[R_PC];
+    char text[32];
+    debug_disassemble(pc, vm->memory[pc], text, sizeof(text));
+    printf("x%04X: x%04X  %s\n", pc, vm->memory[pc], text);
+}
+
+static void print_regs(vm_t* vm)
+{
+    uint16_t cc = vm_cond(vm);
+    for(int r = 0; r < 8; ++r)
+    {
+        printf("R%d x%04X%s", r, vm->reg[r], r % 4 == 3 ? "\n" : "  ");
+    }
+    printf("PC x%04X  CC %s  PSR x%04X (%s, PL%d)  instructions %llu  cycles %llu\n", vm->reg[R_PC],
+           cc & FL_NEG ? "N" : cc & FL_ZRO ? "Z" : "P", vm_psr(vm),
+           vm->psr & PSR_USER ? "user" : "supervisor", PSR_PRIORITY(vm->psr),
+           (unsigned long long)vm->instructions, (unsigned long long)vm->cycles);
+}
+
+static void print_memory(vm_t* vm, uint16_t address, long count)
+{
+    for(long i = 0; i < count && address + i < (long)DEBUG_WORDS; ++i)
+    {
+        if(i % 8 == 0)
+        {
+            printf("%sx%04X:", i ? "\n" : "", (unsigned)(address + i));
+        }
+        printf(" x%04X", vm->memory[address + i]);
+    }
+    printf("\n");
+}
+
+static void list(vm_t* vm, uint16_t address, int count)
+{
+    char text[32];
+    for(int i = 0; i < count && address + i < (long)DEBUG_WORDS; ++i)
+    {
+        uint16_t a = address + i;
+        debug_disassemble(a, vm->memory[a], text, sizeof(text));
+        printf("%c%c x%04X: x%04X  %s\n", a == vm->reg[R_PC] ? '>' : ' ',
+               vm->debug->breakpoint[a] ? '*' : ' ', a, vm->memory[a], text);
+    }
+}
+
+static void print_points(vm_t* vm)
+{
+    debug_t* dbg = vm->debug;
+    for(size_t a = 0; a < DEBUG_WORDS; ++a)
+    {
+        if(dbg->breakpoint[a])
+        {
+            printf("breakpoint x%04X\n", (unsigned)a);
+        }
+        if(dbg->watchpoint[a])
+        {
+            printf("watchpoint x%04X\n", (unsigned)a);
+        }
+    }
+}
+
+static void report(vm_t* vm, int stop)
+{
+    debug_t* dbg = vm->debug;
+    switch(stop)
+    {
+        case DEBUG_STOP_BREAK:
+            printf("breakpoint x%04X\n", vm->reg[R_PC]);
+            break;
+        case DEBUG_STOP_WATCH:
+            printf("watchpoint x%04X: x%04X -> x%04X\n", dbg->watch_address, dbg->watch_old, dbg->watch_new);
+            break;
+        case DEBUG_STOP_INTERRUPT:
+            printf("interrupted\n");
+            break;
+        case DEBUG_STOP_FAULT:
+            printf("illegal instruction x%04X\n", vm->memory[vm->reg[R_PC]]);
+            break;
+        case DEBUG_STOP_HALT:
+            printf("halted after %llu instructions\n", (unsigned long long)vm->instructions);
+            return;
+    }
+    print_where(vm);
+}
+
+// Without an input file the guest reads the terminal through the keyboard
+// ring, so commands come out of the same ring and neither side takes the
+// other's input
+static int read_line(vm_t* vm, char* buf, size_t n)
+{
+    if(vm->keyboard.data || !vm->in)
+    {
+        if(!fgets(buf, (int)n, stdin))
+        {
+            return 0;
+        }
+        buf[strcspn(buf, "\r\n")] = '\0';
+        return 1;
+    }
+    if(!keyboard_start(&vm->keyboard, fileno(vm->in)))
+    {
+        return 0;
+    }
+
+    size_t len = 0;
+    int c;
+    while((c = keyboard_getc(&vm->keyboard)) != EOF && c != '\n')
+    {
+        if(len + 1 < n && c != '\r')
+        {
+            buf[len++] = (char)c;
+        }
+    }
+    buf[len] = '\0';
+    return c != EOF || len;
+}
+
+static void cli_help()
+{
+    printf("b addr      break at addr              d addr      delete the breakpoint\n"
+           "w addr      stop after stores to addr  u addr      delete the watchpoint\n"
+           "s [n]       step n instructions        c           continue\n"
+           "r           registers                  x addr [n]  n words of memory\n"
+           "l [addr]    list instructions          set reg|addr value (cc: 4 N, 2 Z, 1 P)\n"
+           "i           breakpoints, watchpoints   q           quit\n"
+           "an empty line repeats the last command\n");
+}
+
+static int cli_session(vm_t* vm)
+{
+    char line[256];
+    char last[256] = "";
+    int halted = 0;
+
+    debug_vm = vm;
+    signal(SIGINT, debug_interrupt);
+    print_where(vm);
+
+    for(;;)
+    {
+        printf("(lc3) ");
+        fflush(stdout);
+        if(!read_line(vm, line, sizeof(line)))
+        {
+            break;
+        }
+        if(!line[0])
+        {
+            strcpy(line, last);
+        }
+        strcpy(last, line);
+
+        char* args[4];
+        int argc = 0;
+        for(char* t = strtok(line, " \t"); t && argc < 4; t = strtok(NULL, " \t"))
+        {
+            args[argc++] = t;
+        }
+        if(!argc)
+        {
+            continue;
+        }
+
+        const char* cmd = args[0];
+        uint16_t address;
+        long value;
+        if(strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0)
+        {
+            break;
+        }
+        else if(strcmp(cmd, "h") == 0 || strcmp(cmd, "help") == 0)
+        {
+            cli_help();
+        }
+        else if((strcmp(cmd, "b") == 0 || strcmp(cmd, "d") == 0) && argc == 2)
+        {
+            if(parse_address(args[1], &address))
+            {
+                debug_break(vm, address, cmd[0] == 'b');
+            }
+        }
+        else if((strcmp(cmd, "w") == 0 || strcmp(cmd, "u") == 0) && argc == 2)
+        {
+            if(parse_address(args[1], &address))
+            {
+                debug_watch(vm, address, cmd[0] == 'w');
+            }
+        }
+        else if((strcmp(cmd, "s") == 0 || strcmp(cmd, "c") == 0) && halted)
+        {
+            printf("the program has halted\n");
+        }
+        else if(strcmp(cmd, "s") == 0 && argc <= 2)
+        {
+            long count = 1;
+            if(argc == 2 && (!parse_number(args[1], &count) || count < 1))
+            {
+                printf("bad count: %s\n", args[1]);
+                continue;
+            }
+            int stop = DEBUG_STOP_STEP;
+            for(long i = 0; i < count && stop == DEBUG_STOP_STEP; ++i)
+            {
+                stop = debug_step(vm);
+            }
+            halted = stop == DEBUG_STOP_HALT;
+            report(vm, stop);
+        }
+        else if(strcmp(cmd, "c") == 0 && argc == 1)
+        {
+            int stop = debug_continue(vm);
+            halted = stop == DEBUG_STOP_HALT;
+            report(vm, stop);
+        }
+        else if(strcmp(cmd, "r") == 0 && argc == 1)
+        {
+            print_regs(vm);
+        }
+        else if(strcmp(cmd, "x") == 0 && (argc == 2 || argc == 3))
+        {
+            long count = 8;
+            if(argc == 3 && (!parse_number(args[2], &count) || count < 1))
+            {
+                printf("bad count: %s\n", args[2]);
+            }
+            else if(parse_address(args[1], &address))
+            {
+                print_memory(vm, address, count);
+            }
+        }
+        else if(strcmp(cmd, "l") == 0 && argc <= 2)
+        {
+            address = vm->reg[R_PC];
+            if(argc == 1 || parse_address(args[1], &address))
+            {
+                list(vm, address, 10);
+            }
+        }
+        else if(strcmp(cmd, "set") == 0 && argc == 3)
+        {
+            int r = parse_reg(args[1]);
+            if(!parse_number(args[2], &value) || value < -0x8000 || value > 0xFFFF)
+            {
+                printf("bad value: %s\n", args[2]);
+            }
+            else if(r >= 0)
+            {
+                set_reg(vm, r, (uint16_t)value);
+            }
+            else if(parse_address(args[1], &address))
+            {
+                poke(vm, address, (uint16_t)value);
+            }
+        }
+        else if(strcmp(cmd, "i") == 0 && argc == 1)
+        {
+            print_points(vm);
+        }
+        else
+        {
+            printf("unknown command: %s, h for help\n", cmd);
+        }
+    }
+
+    signal(SIGINT, SIG_DFL);
+    debug_vm = NULL;
+    return 0;
+}
+
+// GDB remote protocol front end
+
+typedef struct
+{
+    int fd;
+    char buf[GDB_PACKET_SIZE];  /* received, not looked at yet */
+    size_t len;
+    size_t pos;
+} gdb_t;
+
+static int gdb_getc(gdb_t* g)
+{
+    if(g->pos == g->len)
+    {
+        ssize_t n;
+        do
+        {
+            n = recv(g->fd, g->buf, sizeof(g->buf), 0);
+        } while(n < 0 && errno == EINTR);
+        if(n <= 0)
+        {
+            return -1;
+        }
+        g->len = (size_t)n;
+        g->pos = 0;
+    }
+    return (uint8_t)g->buf[g->pos++];
+}
+
+static int hex_digit(int c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Hex number at *s, moves *s past it
+static unsigned long hex_number(const char** s)
+{
+    unsigned long v = 0;
+    while(hex_digit(**s) >= 0)
+    {
+        v = v * 16 + hex_digit(*(*s)++);
+    }
+    return v;
+}
+
+static int gdb_write(gdb_t* g, const char* s, size_t n)
+{
+    while(n)
+    {
+        ssize_t w = send(g->fd, s, n, MSG_NOSIGNAL);
+        if(w < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(w <= 0)
+        {
+            return 0;
+        }
+        s += w;
+        n -= (size_t)w;
+    }
+    return 1;
+}
+
+// Next packet into out, acknowledged. Returns 0 once the client is gone.
+static int gdb_recv(gdb_t* g, char* out, size_t cap)
+{
+    for(;;)
+    {
+        int c;
+        do
+        {
+            c = gdb_getc(g);
+        } while(c >= 0 && c != '$');
+
+        size_t len = 0;
+        uint8_t sum = 0;
+        while((c = gdb_getc(g)) >= 0 && c != '#')
+        {
+            if(len + 1 < cap)
+            {
+                out[len++] = (char)c;
+            }
+            sum += (uint8_t)c;
+        }
+        int hi = c < 0 ? -1 : gdb_getc(g);
+        int lo = hi < 0 ? -1 : gdb_getc(g);
+        if(lo < 0)
+        {
+            return 0;
+        }
+        out[len] = '\0';
+        if(hex_digit(hi) * 16 + hex_digit(lo) == sum)
+        {
+            return gdb_write(g, "+", 1);
+        }
+        if(!gdb_write(g, "-", 1))
+        {
+            return 0;
+        }
+    }
+}
+
+static int gdb_send(gdb_t* g, const char* s)
+{
+    char tail[4];
+    uint8_t sum = 0;
+    for(const char* p = s; *p; ++p)
+    {
+        sum += (uint8_t)*p;
+    }
+    snprintf(tail, sizeof(tail), "#%02x", sum);
+
+    for(;;)
+    {
+        if(!gdb_write(g, "$", 1) || !gdb_write(g, s, strlen(s)) || !gdb_write(g, tail, 3))
+        {
+            return 0;
+        }
+        int c;
+        do
+        {
+            c = gdb_getc(g);
+        } while(c >= 0 && c != '+' && c != '-');
+        if(c != '-')
+        {
+            return c == '+';
+        }
+    }
+}
+
+// Between slices of a continue, 1 once the client sent 0x03 or went away
+static int gdb_poll(void* ctx)
+{
+    gdb_t* g = ctx;
+    struct pollfd p = { g->fd, POLLIN, 0 };
+    while(g->pos < g->len || poll(&p, 1, 0) > 0)
+    {
+        int c = gdb_getc(g);
+        if(c == 0x03 || c < 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void gdb_stop_reply(vm_t* vm, int stop, char* out, size_t n)
+{
+    switch(stop)
+    {
+        case DEBUG_STOP_HALT:
+            snprintf(out, n, "W00");
+            break;
+        case DEBUG_STOP_WATCH:
+            snprintf(out, n, "T05watch:%04x;", vm->debug->watch_address);
+            break;
+        case DEBUG_STOP_INTERRUPT:
+            snprintf(out, n, "S02");
+            break;
+        case DEBUG_STOP_FAULT:
+            snprintf(out, n, "S04");
+            break;
+        default:
+            snprintf(out, n, "S05");
+            break;
+    }
+}
+
+static int gdb_listen(int port)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if(s < 0)
+    {
+        fprintf(stderr, "failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 1) != 0)
+    {
+        fprintf(stderr, "failed to listen on port %d: %s\n", port, strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    fprintf(stderr, "waiting for a debugger on localhost:%d\n", port);
+    int fd = accept(s, NULL, NULL);
+    close(s);
+    if(fd < 0)
+    {
+        fprintf(stderr, "failed to accept: %s\n", strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// One packet, the reply goes in out. Returns 0 for k and D.
+static int gdb_packet(vm_t* vm, gdb_t* g, const char* packet, char* out, size_t n, int* stop)
+{
+    const char* p = packet + 1;
+    out[0] = '\0';
+
+    switch(packet[0])
+    {
+        case '?':
+            gdb_stop_reply(vm, *stop, out, n);
+            break;
+        case 'g':
+            for(int r = 0; r < R_COUNT; ++r)
+            {
+                snprintf(out + r * 4, n - r * 4, "%04x", get_reg(vm, r));
+            }
+            break;
+        case 'G':
+            for(int r = 0; r < R_COUNT && strlen(p) >= 4; ++r, p += 4)
+            {
+                char word[5] = { p[0], p[1], p[2], p[3], '\0' };
+                const char* w = word;
+                set_reg(vm, r, (uint16_t)hex_number(&w));
+            }
+            snprintf(out, n, "OK");
+            break;
+        case 'p':
+        {
+            unsigned long r = hex_number(&p);
+            if(r < R_COUNT)
+            {
+                snprintf(out, n, "%04x", get_reg(vm, (int)r));
+            }
+            else
+            {
+                snprintf(out, n, "E01");
+            }
+            break;
+        }
+        case 'P':
+        {
+            unsigned long r = hex_number(&p);
+            if(r < R_COUNT && *p++ == '=')
+            {
+                set_reg(vm, (int)r, (uint16_t)hex_number(&p));
+                snprintf(out, n, "OK");
+            }
+            else
+            {
+                snprintf(out, n, "E01");
+            }
+            break;
+        }
+        case 'm':
+        case 'M':
+        {
+            unsigned long address = hex_number(&p);
+            unsigned long count = *p == ',' ? (++p, hex_number(&p)) : 0;
+            if(address + count > DEBUG_WORDS || count * 4 >= n)
+            {
+                snprintf(out, n, "E01");
+                break;
+            }
+            if(packet[0] == 'm')
+            {
+                for(unsigned long i = 0; i < count; ++i)
+                {
+                    snprintf(out + i * 4, n - i * 4, "%04x", vm->memory[address + i]);
+                }
+                break;
+            }
+            if(*p++ != ':' || strlen(p) < count * 4)
+            {
+                snprintf(out, n, "E01");
+                break;
+            }
+            for(unsigned long i = 0; i < count; ++i, p += 4)
+            {
+                char word[5] = { p[0], p[1], p[2], p[3], '\0' };
+                const char* w = word;
+                poke(vm, (uint16_t)(address + i), (uint16_t)hex_number(&w));
+            }
+            snprintf(out, n, "OK");
+            break;
+        }
+        case 'c':
+        case 's':
+            if(*p)
+            {
+                vm->reg[R_PC] = (uint16_t)hex_number(&p);
+            }
+            *stop = packet[0] == 'c' ? resume(vm, gdb_poll, g) : debug_step(vm);
+            gdb_stop_reply(vm, *stop, out, n);
+            break;
+        case 'Z':
+        case 'z':
+        {
+            int type = (int)hex_number(&p);
+            unsigned long address = *p == ',' ? (++p, hex_number(&p)) : DEBUG_WORDS;
+            int ok = 1;
+            if(type == 0 && address < DEBUG_WORDS)
+            {
+                debug_break(vm, (uint16_t)address, packet[0] == 'Z');
+            }
+            else if(type == 2 && address < DEBUG_WORDS)
+            {
+                debug_watch(vm, (uint16_t)address, packet[0] == 'Z');
+            }
+            else
+            {
+                ok = type == 0 || type == 2;
+            }
+            // An empty reply tells the client the type isn't supported
+            if(ok)
+            {
+                snprintf(out, n, address < DEBUG_WORDS ? "OK" : "E01");
+            }
+            break;
+        }
+        case 'H':
+            snprintf(out, n, "OK");
+            break;
+        case 'q':
+            if(strncmp(packet, "qSupported", 10) == 0)
+            {
+                snprintf(out, n, "PacketSize=%x", GDB_PACKET_SIZE);
+            }
+            else if(strcmp(packet, "qAttached") == 0)
+            {
+                snprintf(out, n, "1");
+            }
+            break;
+        case 'D':
+            snprintf(out, n, "OK");
+            return 0;
+        case 'k':
+            return 0;
+    }
+    return 1;
+}
+
+static int gdb_session(vm_t* vm, int port)
+{
+    gdb_t g;
+    g.fd = gdb_listen(port);
+    g.len = 0;
+    g.pos = 0;
+    if(g.fd < 0)
+    {
+        return 1;
+    }
+
+    char packet[GDB_PACKET_SIZE + 1];
+    char reply[GDB_PACKET_SIZE + 1];
+    int stop = DEBUG_STOP_BREAK;
+    int detach = 0;
+    while(gdb_recv(&g, packet, sizeof(packet)))
+    {
+        int more = gdb_packet(vm, &g, packet, reply, sizeof(reply), &stop);
+        if(packet[0] != 'k' && !gdb_send(&g, reply))
+        {
+            break;
+        }
+        if(!more)
+        {
+            detach = packet[0] == 'D';
+            break;
+        }
+    }
+    close(g.fd);
+
+    // A detached program runs on to the end, like under gdb
+    if(detach && stop != DEBUG_STOP_HALT)
+    {
+        debug_detach(vm);
+        vm_run(vm, 0);
+    }
+    return 0;
+}
+
+int debug_main(int argc, const char* argv[])
+{
+    const char* input_path = NULL;
+    int port = 0;
+    int i = 0;
+
+    for(; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            input_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+        {
+            port = atoi(argv[++i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i == argc || port < 0 || port > 0xFFFF)
+    {
+        printf("lc3 --debug [-i input] [-g port] image-file1 ...\n");
+        return 1;
+    }
+
+    vm_t* vm = vm_create();
+    if(!vm)
+    {
+        printf("failed to allocate vm\n");
+        return 1;
+    }
+    if(input_path && !vm_load_input(vm, input_path))
+    {
+        printf("failed to read input: %s\n", input_path);
+        vm_destroy(vm);
+        return 1;
+    }
+    for(; i < argc; ++i)
+    {
+        if(!read_image(vm, argv[i]))
+        {
+            printf("failed to load image: %s\n", argv[i]);
+            vm_destroy(vm);
+            return 1;
+        }
+    }
+    if(!debug_attach(vm))
+    {
+        printf("failed to start debugger\n");
+        vm_destroy(vm);
+        return 1;
+    }
+
+    int status = port ? gdb_session(vm, port) : cli_session(vm);
+    vm_destroy(vm);
+    return status;
+}
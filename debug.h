@@ -0,0 +1,73 @@
+/*
+  Debugger. lc3 --debug [-i input] [-g port] image-file1 ... loads the
+  images and stops in front of the first instruction, then takes commands
+  from the terminal, or with -g from a GDB remote protocol client that
+  connects to localhost:port.
+
+  Nothing is checked per instruction, so runs without the debugger don't
+  pay for it. A session always runs the predecoded engine:
+
+    Breakpoints replace the handler of their decode_cache[] entry with one
+    that stops the machine in front of the instruction. predecode() puts
+    the breakpoint back whenever the entry is decoded again.
+
+    Watchpoints take their page over in the device map. Stores go through
+    to memory, or to the device that owned the page, and a store to a
+    watched address stops the machine after the instruction.
+
+  Remote protocol: GDB has no LC-3 target, so the stub speaks in LC-3
+  terms. Addresses and lengths count words, a word is four hex digits with
+  the most significant first. g/G/p/P registers are R0-R7, PC and PSR
+  (user mode in bit 15, priority in bits 10-8, N/Z/P in bits 2-0).
+  Supported: ? g G p P m M c s Z0 z0 Z2 z2 k D, qSupported and 0x03 to
+  interrupt.
+*/
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+// Instructions between looks at the remote connection while running
+#define DEBUG_SLICE (1 << 20)
+
+// Why the machine stopped
+enum
+{
+    DEBUG_STOP_STEP = 0,   /* single step done */
+    DEBUG_STOP_BREAK,      /* PC reached a breakpoint */
+    DEBUG_STOP_WATCH,      /* a store to a watched address */
+    DEBUG_STOP_INTERRUPT,  /* SIGINT or 0x03 from the remote */
+    DEBUG_STOP_HALT,       /* TRAP HALT */
+    DEBUG_STOP_FAULT       /* exception without a handler, PC is left on it */
+};
+
+typedef struct debug
+{
+    uint8_t breakpoint[UINT16_MAX + 1];
+    uint8_t watchpoint[UINT16_MAX + 1];
+
+    // Watchpoints on each page and the device_page[] entry the page had
+    // before the watch device took it over
+    uint16_t page_watches[VM_PAGE_COUNT];
+    uint8_t saved_page[VM_PAGE_COUNT];
+    uint8_t device;         /* watch device, index into devices[] plus one */
+
+    int stop;               /* DEBUG_STOP_* */
+    uint16_t watch_address; /* last watchpoint hit */
+    uint16_t watch_old;
+    uint16_t watch_new;
+} debug_t;
+
+int debug_attach(vm_t* vm);
+void debug_detach(vm_t* vm);
+int debug_break(vm_t* vm, uint16_t address, int on);
+int debug_watch(vm_t* vm, uint16_t address, int on);
+int debug_step(vm_t* vm);
+int debug_continue(vm_t* vm);
+void debug_patch(vm_t* vm, uint16_t pc);
+void debug_disassemble(uint16_t pc, uint16_t instr, char* buf, size_t n);
+int debug_main(int argc, const char* argv[]);
+
+#endif
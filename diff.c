@@ -0,0 +1,565 @@
+/*
+  Differential testing - run the same program on two engines and check
+  that they agree.
+
+  lc3 --diff [-a engine] [-b engine] [-n interval] [-m max-instr] [-i input] image...
+  lc3 --diff [-a engine] [-b engine] [-n interval] [-m max-instr] -r seed[,count]
+
+  Engines go by their DISPATCH names, -a defaults to switch and -b to the
+  engine this build runs. With -n both machines run interval instructions
+  at a time, to the end of the basic block the count falls in, and their
+  hashes of registers, memory, instruction count and output are compared
+  after each stretch. Without it (bulk compare) they run to the end and are
+  compared word for word once; a mismatch reruns the program with
+  checkpoints to find where it went wrong.
+
+  At the first checkpoint that differs both machines go back to the last
+  one that matched. The stretch is bisected down to the first basic block
+  that ends differently, and that block is run up to a HALT put after each
+  of its instructions in turn to find the first one that differs.
+
+  -r runs count random programs (default 1) instead of images. Program i
+  comes from seed + i, so -r with that number alone reruns it. Each one is
+  DIFF_PROGRAM_WORDS words of random instructions at x3000 that every
+  engine implements, with random registers and input. The rest of memory is
+  zero with a HALT at the end of every page, so a wild jump halts soon.
+  -m defaults to DIFF_MAX_INSTR for them.
+
+  An exception without a handler faults, which ends that side's run like
+  a HALT, and the two are compared. The random programs leave out RTI and
+  the reserved opcode.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "debug.h"
+#include "snapshot.h"
+#include "interrupt.h"
+
+#define DIFF_PROGRAM_WORDS 32
+#define DIFF_INPUT_BYTES 16
+#define DIFF_MAX_INSTR 100000
+// Memory words shown when the machines differ
+#define DIFF_SHOW_WORDS 8
+
+#define DIFF_WORDS (sizeof(((vm_t*)0)->memory) / sizeof(uint16_t))
+
+typedef struct
+{
+    vm_t* vm;
+    int engine;
+    int halted;
+
+    // Last checkpoint both sides agreed on
+    vm_snapshot_t* snap;
+    size_t input_pos;
+    size_t output_len;
+    int snap_halted;
+} side_t;
+
+typedef struct
+{
+    side_t side[2];
+    uint64_t interval;
+    uint64_t max_instructions;
+} diff_t;
+
+// Everything the guest can see. Machines that agree hash the same.
+static uint64_t state_hash(vm_t* vm)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t len;
+    const char* out = vm_output(vm, &len);
+    const uint8_t* parts[2] = { (const uint8_t*)vm->memory, (const uint8_t*)out };
+    size_t sizes[2] = { sizeof(vm->memory), len };
+
+    for(int r = 0; r < R_COND; ++r)
+    {
+        h = (h ^ vm->reg[r]) * 0x100000001b3ULL;
+    }
+    h = (h ^ vm_cond(vm)) * 0x100000001b3ULL;
+    h = (h ^ vm->psr ^ (uint64_t)vm->saved_ssp << 16 ^ (uint64_t)vm->saved_usp << 32) * 0x100000001b3ULL;
+    h = (h ^ vm->instructions) * 0x100000001b3ULL;
+    h = (h ^ vm->cycles) * 0x100000001b3ULL;
+    h = (h ^ len) * 0x100000001b3ULL;
+    for(int p = 0; p < 2; ++p)
+    {
+        size_t i = 0;
+        for(; i + 8 <= sizes[p]; i += 8)
+        {
+            uint64_t w;
+            memcpy(&w, parts[p] + i, 8);
+            h = (h ^ w) * 0x100000001b3ULL;
+        }
+        for(; i < sizes[p]; ++i)
+        {
+            h = (h ^ parts[p][i]) * 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+// Word for word, the bulk compare
+static int same_state(vm_t* a, vm_t* b)
+{
+    size_t a_len, b_len;
+    const char* a_out = vm_output(a, &a_len);
+    const char* b_out = vm_output(b, &b_len);
+    return memcmp(a->reg, b->reg, R_COND * sizeof(uint16_t)) == 0 &&
+           vm_cond(a) == vm_cond(b) &&
+           a->psr == b->psr && a->saved_ssp == b->saved_ssp && a->saved_usp == b->saved_usp &&
+           a->instructions == b->instructions && a->cycles == b->cycles &&
+           a_len == b_len && (!a_len || memcmp(a_out, b_out, a_len) == 0) &&
+           memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+// Run until HALT, a fault or max_instructions
+static void run_side(side_t* s)
+{
+    vm_t* vm = s->vm;
+    vm_run_engine(vm, s->engine);
+    s->halted = vm->exit_reason == VM_EXIT_HALT || vm->exit_reason == VM_EXIT_FAULT;
+}
+
+// Run on to the first block end at or after count, unless halted
+static void run_to(side_t* s, uint64_t count)
+{
+    if(s->halted || s->vm->instructions >= count)
+    {
+        return;
+    }
+    s->vm->max_instructions = count;
+    run_side(s);
+}
+
+static void save(side_t* s)
+{
+    vm_t* vm = s->vm;
+    vm_snapshot_update(vm, s->snap);
+    s->input_pos = vm->keyboard.data_pos;
+    vm_output(vm, &s->output_len);
+    s->snap_halted = s->halted;
+}
+
+// Back to the last checkpoint, output written since included
+static void restore(side_t* s)
+{
+    vm_t* vm = s->vm;
+    vm_restore(vm, s->snap);
+    vm->keyboard.data_pos = s->input_pos;
+    vm->console.len = 0;
+    fseeko(vm->capture_stream, (off_t)s->output_len, SEEK_SET);
+    s->halted = s->snap_halted;
+}
+
+// Both sides from the checkpoint to count
+static int agree_at(diff_t* d, uint64_t count)
+{
+    for(int i = 0; i < 2; ++i)
+    {
+        restore(&d->side[i]);
+        run_to(&d->side[i], count);
+    }
+    return same_state(d->side[0].vm, d->side[1].vm);
+}
+
+// Both sides from the checkpoint through the first n instructions of the
+// block that starts there, n less than the block's length. A HALT after
+// them stops the machine, then the word is put back.
+static int agree_after(diff_t* d, uint16_t pc, uint64_t n)
+{
+    uint16_t address = (uint16_t)(pc + n);
+    for(int i = 0; i < 2; ++i)
+    {
+        side_t* s = &d->side[i];
+        restore(s);
+        uint16_t word = s->vm->memory[address];
+        vm_write(s->vm, address, 0xF000 | TRAP_HALT);
+        s->vm->max_instructions = 0;
+        run_side(s);
+        vm_write(s->vm, address, word);
+    }
+    return same_state(d->side[0].vm, d->side[1].vm);
+}
+
+static void report(diff_t* d, uint16_t pc, uint64_t count)
+{
+    vm_t* a = d->side[0].vm;
+    vm_t* b = d->side[1].vm;
+    char text[32];
+    debug_disassemble(pc, a->memory[pc], text, sizeof(text));
+    printf("engines differ after instruction %llu, x%04X: %s\n", (unsigned long long)count, pc, text);
+    printf("         %-12s %-12s\n", vm_engine_names[d->side[0].engine], vm_engine_names[d->side[1].engine]);
+
+    static const char* names[R_COUNT] = { "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "PC", "CC" };
+    for(int r = 0; r < R_COUNT; ++r)
+    {
+        uint16_t x = r == R_COND ? vm_cond(a) : a->reg[r];
+        uint16_t y = r == R_COND ? vm_cond(b) : b->reg[r];
+        if(x != y)
+        {
+            printf("%-8s x%04X        x%04X\n", names[r], x, y);
+        }
+    }
+    if(a->psr != b->psr)
+    {
+        printf("PSR      x%04X        x%04X\n", vm_psr(a), vm_psr(b));
+    }
+    if(a->instructions != b->instructions)
+    {
+        printf("count    %-12llu %-12llu\n", (unsigned long long)a->instructions, (unsigned long long)b->instructions);
+    }
+    if(a->cycles != b->cycles)
+    {
+        printf("cycles   %-12llu %-12llu\n", (unsigned long long)a->cycles, (unsigned long long)b->cycles);
+    }
+
+    int shown = 0;
+    for(size_t i = 0; i < DIFF_WORDS; ++i)
+    {
+        if(a->memory[i] != b->memory[i] && shown++ < DIFF_SHOW_WORDS)
+        {
+            printf("x%04X    x%04X        x%04X\n", (unsigned)i, a->memory[i], b->memory[i]);
+        }
+    }
+    if(shown > DIFF_SHOW_WORDS)
+    {
+        printf("and %d more words\n", shown - DIFF_SHOW_WORDS);
+    }
+
+    size_t a_len, b_len;
+    const char* a_out = vm_output(a, &a_len);
+    const char* b_out = vm_output(b, &b_len);
+    if(a_len != b_len || (a_len && memcmp(a_out, b_out, a_len) != 0))
+    {
+        printf("output   %-12zu %-12zu bytes\n", a_len, b_len);
+    }
+}
+
+// The two sides differ at count but agreed at the checkpoint. Narrow it
+// down to one block, then to one of its instructions, and report it.
+static void bisect(diff_t* d, uint64_t count)
+{
+    uint64_t lo = d->side[0].snap->instructions;
+    uint64_t hi = count;
+    while(hi - lo > 1)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(agree_at(d, mid))
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    // Both stop exactly at lo, the block after it goes wrong
+    agree_at(d, lo);
+    save(&d->side[0]);
+    save(&d->side[1]);
+    uint16_t pc = d->side[0].vm->reg[R_PC];
+    agree_at(d, lo + 1);
+    uint64_t len = d->side[0].vm->instructions - lo;
+    if(d->side[1].vm->instructions - lo < len)
+    {
+        len = d->side[1].vm->instructions - lo;
+    }
+
+    uint64_t n = 1;
+    while(n < len && agree_after(d, pc, n))
+    {
+        ++n;
+    }
+    if(n < len)
+    {
+        restore(&d->side[0]);
+        restore(&d->side[1]);
+        agree_after(d, pc, n);
+    }
+    else
+    {
+        agree_at(d, lo + 1);
+    }
+    report(d, (uint16_t)(pc + n - 1), lo + n);
+}
+
+// Run both sides to the end from where they are now. Returns 1 if they
+// agree all the way.
+static int lockstep(diff_t* d)
+{
+    uint64_t max = d->max_instructions ? d->max_instructions : UINT64_MAX;
+    save(&d->side[0]);
+    save(&d->side[1]);
+
+    if(!d->interval)
+    {
+        run_to(&d->side[0], max);
+        run_to(&d->side[1], max);
+        if(same_state(d->side[0].vm, d->side[1].vm))
+        {
+            return 1;
+        }
+        restore(&d->side[0]);
+        restore(&d->side[1]);
+    }
+
+    uint64_t interval = d->interval ? d->interval : DIFF_MAX_INSTR;
+    for(;;)
+    {
+        uint64_t start = d->side[0].vm->instructions;
+        uint64_t count = max - start > interval ? start + interval : max;
+        run_to(&d->side[0], count);
+        run_to(&d->side[1], count);
+        int halted = d->side[0].halted && d->side[1].halted;
+        if(state_hash(d->side[0].vm) != state_hash(d->side[1].vm) ||
+           d->side[0].halted != d->side[1].halted)
+        {
+            bisect(d, count);
+            return 0;
+        }
+        if(halted || d->side[0].vm->instructions >= max)
+        {
+            break;
+        }
+        save(&d->side[0]);
+        save(&d->side[1]);
+    }
+
+    if(!d->interval)
+    {
+        printf("engines differ at the end of the run but agree at every checkpoint\n");
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t next_random(uint64_t* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// Any instruction but RTI and the reserved opcode, which would fault most
+// programs within a few instructions. Traps only go to the vectors the VM
+// implements.
+static uint16_t random_instr(uint64_t* s)
+{
+    for(;;)
+    {
+        uint16_t w = (uint16_t)next_random(s);
+        int op = w >> 12;
+        if(op == OP_RTI || op == OP_RES)
+        {
+            continue;
+        }
+        if(op == OP_TRAP)
+        {
+            w = 0xF000 | (TRAP_GETC + next_random(s) % (TRAP_HALT - TRAP_GETC + 1));
+        }
+        return w;
+    }
+}
+
+// Program seed into the machine, which template holds empty memory for
+static void load_random(vm_t* vm, const vm_snapshot_t* template, uint64_t seed)
+{
+    uint64_t s = seed * 0x9E3779B97F4A7C15ULL + 1;
+    uint8_t input[DIFF_INPUT_BYTES];
+
+    vm_restore(vm, template);
+    for(int i = 0; i < DIFF_PROGRAM_WORDS; ++i)
+    {
+        vm_write(vm, PC_START + i, random_instr(&s));
+    }
+    for(int r = 0; r < R_PC; ++r)
+    {
+        vm->reg[r] = (uint16_t)next_random(&s);
+    }
+    vm->reg[R_PC] = PC_START;
+    vm->reg[R_COND] = (uint16_t)next_random(&s);
+    for(int i = 0; i < DIFF_INPUT_BYTES; ++i)
+    {
+        input[i] = (uint8_t)next_random(&s);
+    }
+    vm_set_input(vm, input, sizeof(input));
+    vm->console.len = 0;
+    fseeko(vm->capture_stream, 0, SEEK_SET);
+}
+
+static int parse_engine(const char* name)
+{
+    for(int e = 0; e < VM_ENGINE_COUNT; ++e)
+    {
+        if(strcmp(name, vm_engine_names[e]) == 0)
+        {
+            if(!vm_has_engine(e))
+            {
+                printf("engine not in this build: %s\n", name);
+                return -1;
+            }
+            return e;
+        }
+    }
+    printf("unknown engine: %s\n", name);
+    return -1;
+}
+
+int diff_main(int argc, const char* argv[])
+{
+    diff_t d;
+    memset(&d, 0, sizeof(d));
+    d.side[0].engine = VM_ENGINE_SWITCH;
+    d.side[1].engine = VM_ENGINE_DEFAULT == VM_ENGINE_SWITCH ? VM_ENGINE_PREDECODE : VM_ENGINE_DEFAULT;
+    const char* input_path = NULL;
+    const char* random = NULL;
+    int i = 0;
+
+    for(; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if((strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+        {
+            int e = parse_engine(argv[i + 1]);
+            if(e < 0)
+            {
+                return 1;
+            }
+            d.side[argv[i][1] == 'b'].engine = e;
+            ++i;
+        }
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            d.interval = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            d.max_instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+        {
+            input_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            random = argv[++i];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(random ? i != argc : i == argc)
+    {
+        printf("lc3 --diff [-a engine] [-b engine] [-n interval] [-m max-instr] [-i input] image...\n");
+        printf("lc3 --diff [-a engine] [-b engine] [-n interval] [-m max-instr] -r seed[,count]\n");
+        return 1;
+    }
+
+    int status = 0;
+    for(int s = 0; s < 2; ++s)
+    {
+        side_t* side = &d.side[s];
+        side->vm = vm_create();
+        side->snap = malloc(sizeof(vm_snapshot_t));
+        if(!side->vm || !side->snap || !vm_capture_output(side->vm))
+        {
+            printf("failed to allocate vm\n");
+            status = 1;
+            goto done;
+        }
+        if(input_path && !vm_load_input(side->vm, input_path))
+        {
+            printf("failed to read input: %s\n", input_path);
+            status = 1;
+            goto done;
+        }
+        if(!input_path)
+        {
+            vm_set_input(side->vm, "", 0);
+        }
+        for(int j = i; j < argc; ++j)
+        {
+            if(!read_image(side->vm, argv[j]))
+            {
+                printf("failed to load image: %s\n", argv[j]);
+                status = 1;
+                goto done;
+            }
+        }
+    }
+
+    if(!random)
+    {
+        if(lockstep(&d))
+        {
+            printf("%s and %s agree over %llu instructions\n", vm_engine_names[d.side[0].engine],
+                   vm_engine_names[d.side[1].engine], (unsigned long long)d.side[0].vm->instructions);
+        }
+        else
+        {
+            status = 1;
+        }
+        goto done;
+    }
+
+    char* end;
+    uint64_t seed = strtoull(random, &end, 0);
+    uint64_t count = *end == ',' ? strtoull(end + 1, NULL, 0) : 1;
+    if(!d.max_instructions)
+    {
+        d.max_instructions = DIFF_MAX_INSTR;
+    }
+
+    // Empty memory with a HALT closing every page, in user mode like a
+    // new machine
+    vm_snapshot_t* template = calloc(1, sizeof(vm_snapshot_t));
+    if(!template)
+    {
+        printf("failed to allocate vm\n");
+        status = 1;
+        goto done;
+    }
+    template->psr = PSR_USER;
+    template->saved_ssp = VM_SSP_START;
+    for(size_t a = (1 << VM_PAGE_SHIFT) - 1; a < DIFF_WORDS; a += 1 << VM_PAGE_SHIFT)
+    {
+        template->memory[a] = 0xF000 | TRAP_HALT;
+    }
+
+    uint64_t total = 0;
+    for(uint64_t n = 0; n < count; ++n)
+    {
+        for(int s = 0; s < 2; ++s)
+        {
+            load_random(d.side[s].vm, template, seed + n);
+            d.side[s].halted = 0;
+        }
+        if(!lockstep(&d))
+        {
+            printf("program %llu, rerun with -r %llu\n", (unsigned long long)n, (unsigned long long)(seed + n));
+            status = 1;
+            break;
+        }
+        total += d.side[0].vm->instructions;
+    }
+    if(!status)
+    {
+        printf("%s and %s agree on %llu programs, %llu instructions\n", vm_engine_names[d.side[0].engine],
+               vm_engine_names[d.side[1].engine], (unsigned long long)count, (unsigned long long)total);
+    }
+    vm_snapshot_free(template);
+
+done:
+    for(int s = 0; s < 2; ++s)
+    {
+        vm_destroy(d.side[s].vm);
+        free(d.side[s].snap);
+    }
+    return status;
+}
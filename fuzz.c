@@ -0,0 +1,376 @@
+/*
+  Fuzzing - one machine runs input after input and is put back into its
+  freshly created state between them.
+
+  lc3 --fuzz [-m max-instr] [-n rounds] corpus-file-or-dir ...
+  lc3 --fuzz [-m max-instr] -r seed[,count]
+  lc3 --fuzz [-m max-instr] -
+
+  An input is an image like a .obj file, a big-endian origin followed by
+  big-endian words; an odd trailing byte is dropped. The machine starts at
+  the origin with max-instr instructions to run (FUZZ_MAX_INSTR by
+  default), an empty keyboard and output going to a buffer nobody reads.
+  The machine starts in user mode with an empty vector table, so RTI and
+  the reserved opcode end the run with a fault like any other stop unless
+  the input stores a handler first.
+
+  The reset is vm_restore() of a snapshot taken when the machine was
+  created, which only copies back the pages the run stored to. Nothing
+  else the guest can see survives a run.
+
+  Corpus files, and the regular files in corpus directories, are read up
+  front and run rounds times each (default 1). -r runs count random inputs
+  (default FUZZ_RANDOM_COUNT) of up to FUZZ_RANDOM_BYTES bytes made from
+  seed. Either way the executions per second and how the runs ended are
+  printed at the end. - runs the input on stdin, or once built with
+  afl-clang-fast, every input AFL++ hands over in persistent mode.
+
+  Built with -DVM_FUZZ=1 (make fuzz) this file is a libFuzzer target,
+  LLVMFuzzerTestOneInput() runs one input and the fuzzer owns main().
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "vm.h"
+#include "snapshot.h"
+
+#define FUZZ_MAX_INSTR 1000
+#define FUZZ_RANDOM_BYTES 64
+#define FUZZ_RANDOM_COUNT 1000000
+// Inputs AFL++ runs in one process before it forks a fresh one
+#define FUZZ_AFL_LOOP 100000
+
+#define FUZZ_WORDS (sizeof(((vm_t*)0)->memory) / sizeof(uint16_t))
+
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+typedef struct
+{
+    vm_t* vm;
+    vm_snapshot_t* reset;
+
+    uint64_t runs;
+    uint64_t instructions;
+    uint64_t exits[VM_EXIT_FAULT + 1];
+} fuzz_t;
+
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+} fuzz_input_t;
+
+static const char* exit_names[VM_EXIT_FAULT + 1] = { "halt", "budget", "timeout", "input", "fault" };
+
+static int fuzz_init(fuzz_t* f, uint64_t max_instructions)
+{
+    memset(f, 0, sizeof(*f));
+    f->vm = vm_create();
+    if(!f->vm || !vm_capture_output(f->vm) || !vm_set_input(f->vm, "", 0))
+    {
+        return 0;
+    }
+    f->vm->max_instructions = max_instructions;
+    f->reset = vm_snapshot(f->vm);
+    return f->reset != NULL;
+}
+
+static void fuzz_free(fuzz_t* f)
+{
+    vm_destroy(f->vm);
+    vm_snapshot_free(f->reset);
+}
+
+// Load, run, reset
+static void fuzz_one(fuzz_t* f, const uint8_t* data, size_t size)
+{
+    vm_t* vm = f->vm;
+    if(size < 2)
+    {
+        return;
+    }
+
+    uint16_t origin = (uint16_t)(data[0] << 8 | data[1]);
+    size_t count = (size - 2) / 2;
+    if(count > FUZZ_WORDS - origin)
+    {
+        count = FUZZ_WORDS - origin;
+    }
+    for(size_t i = 0; i < count; ++i)
+    {
+        vm_write(vm, (uint16_t)(origin + i), (uint16_t)(data[2 + 2 * i] << 8 | data[3 + 2 * i]));
+    }
+    vm->reg[R_PC] = origin;
+    vm_run(vm, 0);
+
+    f->runs++;
+    f->instructions += vm->instructions;
+    f->exits[vm->exit_reason]++;
+
+    vm_restore(vm, f->reset);
+    vm->keyboard.data_pos = 0;
+    vm->console.len = 0;
+    fseeko(vm->capture_stream, 0, SEEK_SET);
+}
+
+#if VM_FUZZ
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static fuzz_t f;
+    if(!f.vm && !fuzz_init(&f, FUZZ_MAX_INSTR))
+    {
+        fprintf(stderr, "failed to allocate vm\n");
+        abort();
+    }
+    fuzz_one(&f, data, size);
+    return 0;
+}
+#endif
+
+static int read_input(FILE* file, fuzz_input_t* in)
+{
+    size_t cap = 4096;
+    in->size = 0;
+    in->data = malloc(cap);
+    while(in->data)
+    {
+        in->size += fread(in->data + in->size, 1, cap - in->size, file);
+        if(in->size < cap)
+        {
+            return !ferror(file);
+        }
+        uint8_t* grown = realloc(in->data, cap * 2);
+        if(!grown)
+        {
+            break;
+        }
+        in->data = grown;
+        cap *= 2;
+    }
+    free(in->data);
+    in->data = NULL;
+    return 0;
+}
+
+static int add_file(fuzz_input_t** inputs, size_t* count, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(!file)
+    {
+        return 0;
+    }
+    fuzz_input_t in;
+    int ok = read_input(file, &in);
+    fclose(file);
+    if(!ok)
+    {
+        return 0;
+    }
+    fuzz_input_t* grown = realloc(*inputs, (*count + 1) * sizeof(fuzz_input_t));
+    if(!grown)
+    {
+        free(in.data);
+        return 0;
+    }
+    *inputs = grown;
+    (*inputs)[(*count)++] = in;
+    return 1;
+}
+
+// A file, or every regular file in a directory
+static int add_corpus(fuzz_input_t** inputs, size_t* count, const char* path)
+{
+    struct stat st;
+    if(stat(path, &st) != 0)
+    {
+        return 0;
+    }
+    if(!S_ISDIR(st.st_mode))
+    {
+        return add_file(inputs, count, path);
+    }
+
+    DIR* dir = opendir(path);
+    if(!dir)
+    {
+        return 0;
+    }
+    int ok = 1;
+    struct dirent* e;
+    while(ok && (e = readdir(dir)))
+    {
+        char file[4096];
+        snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+        if(stat(file, &st) == 0 && S_ISREG(st.st_mode))
+        {
+            ok = add_file(inputs, count, file);
+            if(!ok)
+            {
+                printf("failed to read input: %s\n", file);
+            }
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+static uint64_t next_random(uint64_t* s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void print_stats(fuzz_t* f, uint64_t ms)
+{
+    printf("%llu runs, %llu instructions in %llu ms", (unsigned long long)f->runs,
+           (unsigned long long)f->instructions, (unsigned long long)ms);
+    if(ms)
+    {
+        printf(", %llu execs/sec", (unsigned long long)(f->runs * 1000 / ms));
+    }
+    printf("\n");
+    for(int r = 0; r <= VM_EXIT_FAULT; ++r)
+    {
+        if(f->exits[r])
+        {
+            printf("  %-8s %llu\n", exit_names[r], (unsigned long long)f->exits[r]);
+        }
+    }
+}
+
+int fuzz_main(int argc, const char* argv[])
+{
+    uint64_t max_instructions = FUZZ_MAX_INSTR;
+    long rounds = 1;
+    int random = 0;
+    uint64_t seed = 0;
+    uint64_t random_count = FUZZ_RANDOM_COUNT;
+    int i = 0;
+    for(; i < argc && argv[i][0] == '-' && argv[i][1]; ++i)
+    {
+        if(strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            max_instructions = strtoull(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            rounds = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+        {
+            char* end;
+            random = 1;
+            seed = strtoull(argv[++i], &end, 0);
+            if(*end == ',')
+            {
+                random_count = strtoull(end + 1, NULL, 0);
+            }
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if((random ? i != argc : i == argc) || !max_instructions || rounds < 1)
+    {
+        printf("lc3 --fuzz [-m max-instr] [-n rounds] corpus-file-or-dir ...\n");
+        printf("lc3 --fuzz [-m max-instr] -r seed[,count]\n");
+        printf("lc3 --fuzz [-m max-instr] -\n");
+        return 1;
+    }
+
+    fuzz_t f;
+    if(!fuzz_init(&f, max_instructions))
+    {
+        printf("failed to allocate vm\n");
+        fuzz_free(&f);
+        return 1;
+    }
+
+    int status = 0;
+    if(!random && i + 1 == argc && strcmp(argv[i], "-") == 0)
+    {
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+        // AFL++ persistent mode, inputs come through shared memory
+        __AFL_INIT();
+        const uint8_t* buf = __AFL_FUZZ_TESTCASE_BUF;
+        while(__AFL_LOOP(FUZZ_AFL_LOOP))
+        {
+            fuzz_one(&f, buf, __AFL_FUZZ_TESTCASE_LEN);
+        }
+#else
+        fuzz_input_t in;
+        if(!read_input(stdin, &in))
+        {
+            printf("failed to read input: -\n");
+            fuzz_free(&f);
+            return 1;
+        }
+        fuzz_one(&f, in.data, in.size);
+        free(in.data);
+        print_stats(&f, 0);
+#endif
+        fuzz_free(&f);
+        return 0;
+    }
+
+    if(random)
+    {
+        uint8_t buf[FUZZ_RANDOM_BYTES];
+        uint64_t start = vm_now_ms();
+        for(uint64_t n = 0; n < random_count; ++n)
+        {
+            uint64_t s = (seed + n) * 0x9E3779B97F4A7C15ULL + 1;
+            size_t size = 2 + next_random(&s) % (FUZZ_RANDOM_BYTES - 1);
+            for(size_t b = 0; b < size; ++b)
+            {
+                buf[b] = (uint8_t)next_random(&s);
+            }
+            fuzz_one(&f, buf, size);
+        }
+        print_stats(&f, vm_now_ms() - start);
+        fuzz_free(&f);
+        return 0;
+    }
+
+    fuzz_input_t* inputs = NULL;
+    size_t count = 0;
+    for(; i < argc; ++i)
+    {
+        if(!add_corpus(&inputs, &count, argv[i]))
+        {
+            printf("failed to read input: %s\n", argv[i]);
+            status = 1;
+            break;
+        }
+    }
+    if(!status)
+    {
+        uint64_t start = vm_now_ms();
+        for(long r = 0; r < rounds; ++r)
+        {
+            for(size_t n = 0; n < count; ++n)
+            {
+                fuzz_one(&f, inputs[n].data, inputs[n].size);
+            }
+        }
+        print_stats(&f, vm_now_ms() - start);
+    }
+    for(size_t n = 0; n < count; ++n)
+    {
+        free(inputs[n].data);
+    }
+    free(inputs);
+    fuzz_free(&f);
+    return status;
+}
@@ -0,0 +1,371 @@
+/*
+  Native image format (.lc3img), see image.h
+*/
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm.h"
+#include "image.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t fnv1a(uint64_t h, const void* data, size_t n)
+{
+    const uint8_t* p = data;
+    while(n--)
+    {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+int image_is_native(const void* data, size_t size)
+{
+    return size >= sizeof(lc3img_header_t) && memcmp(data, LC3IMG_MAGIC, 6) == 0;
+}
+
+int read_native_image(vm_t* vm, const char* path, const void* data, size_t size)
+{
+    const uint8_t* base = data;
+    const lc3img_header_t* h = data;
+
+    if(h->byte_order != LC3IMG_BYTE_ORDER || h->version != LC3IMG_VERSION)
+    {
+        fprintf(stderr, "%s: image was written for another host or version\n", path);
+        return 0;
+    }
+
+    size_t tables = sizeof(lc3img_header_t) + h->range_count * sizeof(lc3img_range_t)
+                  + (size_t)h->block_count * sizeof(lc3img_block_t);
+    if(h->range_count > LC3IMG_MAX_RANGES || h->block_count > LC3IMG_MAX_BLOCKS || tables > size)
+    {
+        fprintf(stderr, "%s: corrupt image header\n", path);
+        return 0;
+    }
+
+    const lc3img_range_t* ranges = (const lc3img_range_t*)(base + sizeof(lc3img_header_t));
+    const lc3img_block_t* blocks = (const lc3img_block_t*)(ranges + h->range_count);
+
+    uint64_t hash = fnv1a(FNV_OFFSET, h, offsetof(lc3img_header_t, hash));
+    hash = fnv1a(hash, ranges, tables - sizeof(lc3img_header_t));
+    for(int i = 0; i < h->range_count; ++i)
+    {
+        const lc3img_range_t* r = &ranges[i];
+        if(r->offset > size || r->length * 2 > size - r->offset ||
+           (uint32_t)r->origin + r->length > VM_MEMORY_WORDS)
+        {
+            fprintf(stderr, "%s: corrupt image range %d\n", path, i);
+            return 0;
+        }
+        hash = fnv1a(hash, base + r->offset, r->length * 2);
+    }
+    if(hash != h->hash)
+    {
+        fprintf(stderr, "%s: checksum mismatch\n", path);
+        return 0;
+    }
+
+    // Blocks are predecoded from several threads, each has to be made of
+    // loaded words no other block has
+    uint8_t* owner = calloc(VM_MEMORY_WORDS, 1);
+    if(!owner)
+    {
+        return 0;
+    }
+    for(int i = 0; i < h->range_count; ++i)
+    {
+        memset(owner + ranges[i].origin, 1, ranges[i].length);
+    }
+    for(uint32_t i = 0; i < h->block_count; ++i)
+    {
+        uint32_t end = (uint32_t)blocks[i].start + blocks[i].length;
+        for(uint32_t a = blocks[i].start; a < end; ++a)
+        {
+            if(a >= VM_MEMORY_WORDS || owner[a] != 1)
+            {
+                fprintf(stderr, "%s: corrupt image block %u\n", path, (unsigned)i);
+                free(owner);
+                return 0;
+            }
+            owner[a] = 2;
+        }
+    }
+    free(owner);
+
+    // Words are already in host order
+    for(int i = 0; i < h->range_count; ++i)
+    {
+        const lc3img_range_t* r = &ranges[i];
+        memcpy(vm->memory + r->origin, base + r->offset, r->length * 2);
+        record_image_range(vm, path, r->origin, r->length);
+    }
+
+    // Start with a warm decode cache
+    predecode_blocks(vm, blocks, h->block_count);
+
+    vm->reg[R_PC] = h->entry;
+    return 1;
+}
+
+// Walk the code reachable from entry and each loaded range's origin,
+// following static branch targets. JMP/JSRR targets are unknown and
+// are picked up by the interpreter at run time instead.
+size_t discover_blocks(vm_t* vm, uint16_t entry, lc3img_block_t* blocks, size_t max)
+{
+    uint8_t* loaded = calloc(UINT16_MAX + 1, 1);
+    uint8_t* seen = calloc(UINT16_MAX + 1, 1);
+    size_t work_cap = 2 * (UINT16_MAX + 1);
+    uint16_t* work = malloc(work_cap * sizeof(uint16_t));
+    size_t work_len = 0;
+    size_t count = 0;
+
+    if(!loaded || !seen || !work)
+    {
+        free(loaded);
+        free(seen);
+        free(work);
+        return 0;
+    }
+
+    for(int i = 0; i < vm->image_count; ++i)
+    {
+        memset(loaded + vm->images[i].origin, 1, vm->images[i].length);
+        work[work_len++] = vm->images[i].origin;
+    }
+    work[work_len++] = entry;
+
+#define PUSH(a) do { if(work_len < work_cap) work[work_len++] = (a); } while(0)
+
+    while(work_len)
+    {
+        uint16_t pc = work[--work_len];
+        uint16_t start = pc;
+        uint16_t length = 0;
+
+        while(loaded[pc] && !seen[pc] && pc < MR_KBSR)
+        {
+            uint16_t instr = vm->memory[pc];
+            uint16_t op = instr >> 12;
+            uint16_t next = pc + 1;
+            seen[pc] = 1;
+            ++length;
+
+            if(!OP_ENDS_BLOCK(op))
+            {
+                pc = next;
+                continue;
+            }
+
+            uint16_t nzp = (instr >> 9) & 0x7;
+            switch(op)
+            {
+                case OP_BR:
+                    if(nzp)
+                    {
+                        PUSH(next + sign_extend(instr & 0x1FF, 9));
+                    }
+                    if(nzp != 0x7)
+                    {
+                        PUSH(next);
+                    }
+                    break;
+                case OP_JSR:
+                    if((instr >> 11) & 1)
+                    {
+                        PUSH(next + sign_extend(instr & 0x7FF, 11));
+                    }
+                    PUSH(next);
+                    break;
+                case OP_TRAP:
+                    if((instr & 0xFF) != TRAP_HALT)
+                    {
+                        PUSH(next);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        }
+
+        if(length && count < max)
+        {
+            blocks[count].start = start;
+            blocks[count].length = length;
+            ++count;
+        }
+    }
+
+#undef PUSH
+
+    free(loaded);
+    free(seen);
+    free(work);
+    return count;
+}
+
+static int write_padding(FILE* f, size_t n)
+{
+    static const uint8_t zeros[LC3IMG_PAGE];
+    while(n)
+    {
+        size_t chunk = n < sizeof(zeros) ? n : sizeof(zeros);
+        if(fwrite(zeros, 1, chunk, f) != chunk)
+        {
+            return 0;
+        }
+        n -= chunk;
+    }
+    return 1;
+}
+
+// Snapshot every address filled by read_image() into a native image
+int write_native_image(vm_t* vm, const char* path, uint16_t entry)
+{
+    static lc3img_range_t ranges[LC3IMG_MAX_RANGES];
+    static lc3img_block_t blocks[LC3IMG_MAX_BLOCKS];
+    uint8_t* used = calloc(VM_MEMORY_WORDS, 1);
+    if(!used)
+    {
+        return 0;
+    }
+
+    for(int i = 0; i < vm->image_count; ++i)
+    {
+        memset(used + vm->images[i].origin, 1, vm->images[i].length);
+    }
+
+    // Coalesce the loaded images into disjoint runs of memory
+    int range_count = 0;
+    for(uint32_t a = 0; a < VM_MEMORY_WORDS && range_count < LC3IMG_MAX_RANGES;)
+    {
+        if(!used[a])
+        {
+            ++a;
+            continue;
+        }
+        uint32_t start = a;
+        while(a < VM_MEMORY_WORDS && used[a])
+        {
+            ++a;
+        }
+        ranges[range_count].origin = start;
+        ranges[range_count].reserved = 0;
+        ranges[range_count].length = a - start;
+        ++range_count;
+    }
+    free(used);
+
+    uint32_t block_count = discover_blocks(vm, entry, blocks, LC3IMG_MAX_BLOCKS);
+
+    // Place each range at an offset congruent to its address in memory
+    uint64_t offset = sizeof(lc3img_header_t) + range_count * sizeof(lc3img_range_t)
+                    + block_count * sizeof(lc3img_block_t);
+    for(int i = 0; i < range_count; ++i)
+    {
+        uint64_t want = (ranges[i].origin * 2) % LC3IMG_PAGE;
+        offset += (want - offset % LC3IMG_PAGE + LC3IMG_PAGE) % LC3IMG_PAGE;
+        ranges[i].offset = offset;
+        offset += ranges[i].length * 2;
+    }
+
+    lc3img_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LC3IMG_MAGIC, 6);
+    h.byte_order = LC3IMG_BYTE_ORDER;
+    h.version = LC3IMG_VERSION;
+    h.entry = entry;
+    h.range_count = range_count;
+    h.block_count = block_count;
+    h.hash = fnv1a(FNV_OFFSET, &h, offsetof(lc3img_header_t, hash));
+    h.hash = fnv1a(h.hash, ranges, range_count * sizeof(lc3img_range_t));
+    h.hash = fnv1a(h.hash, blocks, block_count * sizeof(lc3img_block_t));
+    for(int i = 0; i < range_count; ++i)
+    {
+        h.hash = fnv1a(h.hash, vm->memory + ranges[i].origin, ranges[i].length * 2);
+    }
+
+    FILE* f = fopen(path, "wb");
+    if(!f)
+    {
+        return 0;
+    }
+
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1
+          && fwrite(ranges, sizeof(lc3img_range_t), range_count, f) == (size_t)range_count
+          && fwrite(blocks, sizeof(lc3img_block_t), block_count, f) == block_count;
+
+    for(int i = 0; ok && i < range_count; ++i)
+    {
+        ok = write_padding(f, ranges[i].offset - (uint64_t)ftell(f))
+          && fwrite(vm->memory + ranges[i].origin, 2, ranges[i].length, f) == ranges[i].length;
+    }
+
+    ok = fclose(f) == 0 && ok;
+    return ok;
+}
+
+// lc3 --mkimg [-e entry] -o out.lc3img image...
+int mkimg_main(int argc, const char* argv[])
+{
+    const char* out = NULL;
+    int entry = -1;
+    int i = 0;
+
+    for(; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if(strcmp(argv[i], "-o") == 0)
+        {
+            out = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "-e") == 0)
+        {
+            // LC-3 style x3000 as well as 0x3000
+            const char* s = argv[i + 1];
+            entry = (uint16_t)strtol(s[0] == 'x' ? s + 1 : s, NULL, s[0] == 'x' ? 16 : 0);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(!out || i >= argc)
+    {
+        printf("lc3 --mkimg [-e entry] -o out.lc3img [image-file1] ...\n");
+        return 1;
+    }
+
+    vm_t* vm = vm_create();
+    if(!vm)
+    {
+        printf("failed to allocate vm\n");
+        return 1;
+    }
+
+    int status = 0;
+    int loaded = read_images(vm, argv + i, argc - i);
+    if(loaded < argc - i)
+    {
+        printf("failed to load image: %s\n", argv[i + loaded]);
+        status = 1;
+    }
+
+    // Default to where the machine would start, PC_START or a loaded .lc3img's entry
+    if(entry < 0)
+    {
+        entry = vm->reg[R_PC];
+    }
+
+    if(!status && !write_native_image(vm, out, entry))
+    {
+        printf("failed to write image: %s\n", out);
+        status = 1;
+    }
+
+    vm_destroy(vm);
+    return status;
+}
@@ -0,0 +1,67 @@
+/*
+  Native image format (.lc3img) - a memory snapshot that loads without any
+  byte swapping.
+
+    header        lc3img_header_t
+    ranges        range_count x lc3img_range_t
+    blocks        block_count x lc3img_block_t, basic blocks to predecode
+    words         host-endian words for each range
+
+  Each range's words sit at a file offset congruent to its memory address
+  modulo the page size, so a range can be mapped as well as copied. The hash
+  is FNV-1a over the header fields in front of it and everything after the
+  header. Blocks must lie inside the ranges and not overlap.
+*/
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LC3IMG_MAGIC "LC3IMG"
+#define LC3IMG_VERSION 2
+#define LC3IMG_BYTE_ORDER 0x0102
+#define LC3IMG_PAGE 4096
+#define LC3IMG_MAX_RANGES 256
+#define LC3IMG_MAX_BLOCKS 8192
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+typedef struct
+{
+    char magic[6];          /* LC3IMG */
+    uint16_t byte_order;    /* LC3IMG_BYTE_ORDER as written by the host */
+    uint32_t version;
+    uint16_t entry;         /* initial PC */
+    uint16_t range_count;
+    uint32_t block_count;
+    uint32_t reserved;
+    uint64_t hash;
+} lc3img_header_t;
+
+typedef struct
+{
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t length;        /* words */
+    uint64_t offset;        /* file offset of the words */
+} lc3img_range_t;
+
+typedef struct
+{
+    uint16_t start;
+    uint16_t length;        /* instructions, including the terminator */
+} lc3img_block_t;
+
+struct vm;
+
+uint64_t fnv1a(uint64_t h, const void* data, size_t n);
+int image_is_native(const void* data, size_t size);
+int read_native_image(struct vm* vm, const char* path, const void* data, size_t size);
+int write_native_image(struct vm* vm, const char* path, uint16_t entry);
+size_t discover_blocks(struct vm* vm, uint16_t entry, lc3img_block_t* blocks, size_t max);
+
+// lc3 --mkimg, see image.c
+int mkimg_main(int argc, const char* argv[]);
+
+#endif
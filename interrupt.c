@@ -0,0 +1,147 @@
+/*
+  Privilege and interrupts, see interrupt.h
+*/
+#include <stdio.h>
+
+#include "vm.h"
+#include "interrupt.h"
+
+// Timer status - reading it takes the expired bit, the guest can only set
+// the interrupt enable
+static uint16_t system_read(vm_t* vm, uint16_t address)
+{
+    switch(address)
+    {
+        case MR_TMR:
+            vm->memory[MR_TMR] = (uint16_t)((vm->memory[MR_TMR] & DEV_IE) |
+                                            (timer_expired(&vm->timer) ? DEV_READY : 0));
+            vm_mark_dirty(vm, address);
+            break;
+        case MR_PSR:
+            return vm_psr(vm);
+        case MR_MCR:
+            return MCR_CLOCK;
+    }
+    return vm->memory[address];
+}
+
+static void system_write(vm_t* vm, uint16_t address, uint16_t val)
+{
+    switch(address)
+    {
+        case MR_TMR:
+            val = (uint16_t)((vm->memory[MR_TMR] & DEV_READY) | (val & DEV_IE));
+            interrupt_raise(vm);
+            break;
+        case MR_TMI:
+            timer_set(&vm->timer, val);
+            break;
+        case MR_PSR:
+            vm_set_cond(vm, val);
+            if(!(vm->psr & PSR_USER))
+            {
+                vm->psr = val & PSR_MASK;
+            }
+            interrupt_raise(vm);
+            return;
+        case MR_MCR:
+            if(!(val & MCR_CLOCK))
+            {
+                vm->halt_pending = 1;
+                interrupt_raise(vm);
+            }
+            return;
+    }
+    vm->memory[address] = val;
+    vm_mark_dirty(vm, address);
+    invalidate_decode(vm, address, address + 1);
+}
+
+void interrupt_init(vm_t* vm)
+{
+    static const device_t system = { "system", system_read, system_write };
+    vm->psr = PSR_USER;
+    vm->saved_ssp = VM_SSP_START;
+    vm->keyboard.irq = &vm->irq;
+    vm->timer.irq = &vm->irq;
+    vm_map_device(vm, MR_PSR >> VM_PAGE_SHIFT, 1, &system);
+}
+
+// Switch to the supervisor stack, push PSR and PC and go to the handler
+// at the new priority. Returns 0, with nothing changed, if the vector has
+// no handler.
+int interrupt_enter(vm_t* vm, uint16_t vector, int priority)
+{
+    uint16_t handler = vm->memory[VM_VECTOR_TABLE + vector];
+    if(!handler)
+    {
+        return 0;
+    }
+
+    uint16_t psr = vm_psr(vm);
+    if(vm->psr & PSR_USER)
+    {
+        vm->saved_usp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_ssp;
+    }
+    vm_write(vm, --vm->reg[R_R6], psr);
+    vm_write(vm, --vm->reg[R_R6], vm->reg[R_PC]);
+    vm->psr = (uint16_t)(priority << 8);
+    vm->reg[R_PC] = handler;
+    return 1;
+}
+
+// RTI. Returns 0 in user mode, where it is a privilege violation.
+int interrupt_return(vm_t* vm)
+{
+    if(vm->psr & PSR_USER)
+    {
+        return 0;
+    }
+
+    uint16_t pc = vm_read(vm, vm->reg[R_R6]++);
+    uint16_t psr = vm_read(vm, vm->reg[R_R6]++);
+    vm->reg[R_PC] = pc;
+    vm->psr = psr & PSR_MASK;
+    vm_set_cond(vm, psr);
+    if(vm->psr & PSR_USER)
+    {
+        vm->saved_ssp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_usp;
+    }
+
+    // The priority may have dropped below a device that is still waiting
+    interrupt_raise(vm);
+    return 1;
+}
+
+// Slow path of the block end check once vm->irq is set: stop for the MCR,
+// or take the highest priority interrupt that is enabled, ready and above
+// the PSR's priority
+void interrupt_deliver(vm_t* vm)
+{
+    // Cleared first, a device that asks while we look is seen next time
+    atomic_store(&vm->irq, 0);
+    if(vm->halt_pending)
+    {
+        vm->halt_pending = 0;
+        vm->exit_reason = VM_EXIT_HALT;
+        vm->running = 0;
+        return;
+    }
+
+    int priority = PSR_PRIORITY(vm->psr);
+    int taken = 0;
+    if(TIMER_PRIORITY > priority && (vm->memory[MR_TMR] & DEV_IE) && atomic_load(&vm->timer.expired))
+    {
+        taken = interrupt_enter(vm, VEC_TIMER, TIMER_PRIORITY);
+    }
+    else if(KBD_PRIORITY > priority && (vm->memory[MR_KBSR] & DEV_IE) && keyboard_ready(&vm->keyboard))
+    {
+        taken = interrupt_enter(vm, VEC_KEYBOARD, KBD_PRIORITY);
+    }
+    if(taken)
+    {
+        vm->block_start = vm->reg[R_PC];
+    }
+}
@@ -0,0 +1,90 @@
+/*
+  Privilege and interrupts.
+
+  The PSR holds the privilege mode (bit 15, set in user mode), the
+  priority level (bits 10-8) and N/Z/P (bits 2-0). N/Z/P stay in
+  reg[R_COND] as before, vm->psr holds the other bits; vm_psr() puts them
+  together. Machines start in user mode at priority 0.
+
+  Interrupts and exceptions find their handler in the vector table, the
+  word at VM_VECTOR_TABLE + vector. Taking one from user mode saves R6 as
+  the user stack pointer and loads the supervisor stack pointer, then the
+  PSR and the PC are pushed on the supervisor stack and the machine runs
+  the handler in supervisor mode. RTI pops PC and PSR and swaps the user
+  stack back if it returns to user mode.
+
+  Exceptions are RTI in user mode (VEC_PRIVILEGE) and the reserved opcode
+  (VEC_ILLEGAL). Without a handler in the table they stop the machine with
+  VM_EXIT_FAULT, like they did before there was a table.
+
+  Devices interrupt while their interrupt enable bit (bit 14 of the status
+  register) is set and they are ready, the keyboard (KBSR) at KBD_PRIORITY
+  and the timer (TMR) at TIMER_PRIORITY; only a priority above the PSR's
+  gets through. A device asks by setting vm->irq, from whatever thread it
+  runs on. The engines test it together with the run limits at the end of
+  every basic block and interrupt_deliver() takes the interrupt there, so
+  nothing is checked per instruction. Devices stay ready until the guest
+  reads KBDR or TMR, so instead of remembering masked requests, RTI, PSR
+  stores and interrupt enables set vm->irq to have another look.
+
+  The system page xFF holds the timer status (TMR) and interval in ms
+  (TMI, 0 stops it), the PSR, and the machine control register (MCR).
+  Clearing bit 15 of the MCR halts the machine at the end of the basic
+  block, the same place on every engine. A store to the PSR from
+  user mode only changes N/Z/P. Instruction fetches from the page still
+  read plain memory.
+*/
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#define VM_VECTOR_TABLE 0x0100
+// Supervisor stack pointer a machine starts with, the stack grows down
+#define VM_SSP_START 0x3000
+
+enum
+{
+    VEC_PRIVILEGE = 0x00,  /* RTI in user mode */
+    VEC_ILLEGAL = 0x01,    /* reserved opcode */
+    VEC_KEYBOARD = 0x80,
+    VEC_TIMER = 0x81
+};
+
+#define PSR_USER (1 << 15)
+#define PSR_PRIORITY(psr) (((psr) >> 8) & 0x7)
+#define PSR_MASK (PSR_USER | (0x7 << 8))
+
+#define KBD_PRIORITY 4
+#define TIMER_PRIORITY 6
+
+// Device status register bits
+#define DEV_READY (1 << 15)
+#define DEV_IE (1 << 14)
+#define MCR_CLOCK (1 << 15)
+
+// Look at pending interrupts at the next basic block end
+VM_INLINE void interrupt_raise(vm_t* vm)
+{
+    atomic_store_explicit(&vm->irq, 1, memory_order_relaxed);
+}
+
+// Can a device interrupt at all?
+VM_INLINE int interrupt_enabled(const vm_t* vm)
+{
+    return ((vm->memory[MR_KBSR] | vm->memory[MR_TMR]) & DEV_IE) != 0;
+}
+
+VM_INLINE uint16_t vm_psr(const vm_t* vm)
+{
+    return vm->psr | vm_cond(vm);
+}
+
+void interrupt_init(vm_t* vm);
+int interrupt_enter(vm_t* vm, uint16_t vector, int priority);
+int interrupt_return(vm_t* vm);
+void interrupt_deliver(vm_t* vm);
+
+#endif
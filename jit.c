@@ -0,0 +1,623 @@
+/*
+  Basic-block JIT for x86-64.
+
+  Guest registers stay in vm->reg[] for the whole time native code runs, so
+  every exit leaves the machine in the same state the interpreter would.
+  While a block runs the host registers hold:
+
+    rbx - vm->reg[]        r12 - vm->memory[]
+    r13 - jit->entry[]     r14 - vm->decode_cache[]
+    r15 - vm->block_map[]
+
+  A block returns to jit_run() with one of the JIT_EXIT_* codes in rax, or
+  with the address of its exit stub so the stub can be patched into a direct
+  jump once the successor block is compiled. Every exit and every chain
+  first adds the instructions - and their cycles - run since the block
+  started to vm->instructions and vm->cycles, through rbx.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "vm.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+#define JIT_BUFFER_SIZE (16 << 20)
+// Worst case bytes for one block - instructions, side exits and stubs
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK * 256)
+
+// Exit codes, anything larger is the address of a chainable stub
+enum
+{
+    JIT_EXIT_LOOKUP = 0,  /* PC is set, look up the next block */
+    JIT_EXIT_INTERP,      /* the interpreter must execute the instruction at PC */
+    JIT_EXIT_FLUSH,       /* a store hit a block, its address is in store_address */
+    JIT_EXIT_CHECK        /* PC is set, a limit is due or an interrupt pending */
+};
+
+typedef uintptr_t (*jit_enter_t)(void* code, uint16_t* regs, uint16_t* mem,
+                                 void** entry, decoded_t* decode, uint8_t* block_map);
+
+_Static_assert(sizeof(decoded_t) == 16, "native stores scale addresses by 16");
+_Static_assert(offsetof(decoded_t, fn) == 0, "native stores clear decoded_t.fn");
+_Static_assert(offsetof(vm_t, decode_cache) - offsetof(vm_t, decode_guard) ==
+               (VM_FUSE_MAX - 1) * sizeof(decoded_t), "native stores reach back into decode_guard");
+
+#define REG(r) ((uint8_t)((r) * 2))
+// Other fields of the machine, as a displacement from rbx
+#define VM_FIELD(f) ((uint32_t)(offsetof(vm_t, f) - offsetof(vm_t, reg)))
+
+static void emit8(jit_t* j, uint8_t b)
+{
+    *j->cur++ = b;
+}
+
+static void emit_bytes(jit_t* j, const uint8_t* bytes, size_t n)
+{
+    memcpy(j->cur, bytes, n);
+    j->cur += n;
+}
+
+#define EMIT(j, ...) \
+    emit_bytes(j, (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+static void emit16(jit_t* j, uint16_t v)
+{
+    emit8(j, v & 0xFF);
+    emit8(j, v >> 8);
+}
+
+static void emit32(jit_t* j, uint32_t v)
+{
+    emit16(j, v & 0xFFFF);
+    emit16(j, v >> 16);
+}
+
+static void emit64(jit_t* j, uint64_t v)
+{
+    emit32(j, v & 0xFFFFFFFF);
+    emit32(j, v >> 32);
+}
+
+static void patch_rel32(uint8_t* site, uint8_t* target)
+{
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, sizeof(rel));
+}
+
+// movzx <host>, word [rbx + r*2]
+static void emit_load_reg(jit_t* j, int host, int r)
+{
+    EMIT(j, 0x0F, 0xB7, 0x43 | (host << 3), REG(r));
+}
+
+// mov word [rbx + r*2], <host>
+static void emit_store_reg(jit_t* j, int host, int r)
+{
+    EMIT(j, 0x66, 0x89, 0x43 | (host << 3), REG(r));
+}
+
+// mov word [rbx + r*2], imm16
+static void emit_store_reg_imm(jit_t* j, int r, uint16_t imm)
+{
+    EMIT(j, 0x66, 0xC7, 0x43, REG(r)); emit16(j, imm);
+}
+
+// R_COND keeps the result itself, same as update_flags()
+static void emit_flags(jit_t* j, int r)
+{
+    emit_load_reg(j, 0, r);
+    emit_store_reg(j, 0, R_COND);
+}
+
+// Every ALU/load op sets the flags, so only the last one before something
+// that can observe R_COND (an exit or a branch) needs to be materialised
+static void flush_flags(jit_t* j)
+{
+    if(j->pending_flags >= 0)
+    {
+        emit_flags(j, j->pending_flags);
+        j->pending_flags = -1;
+    }
+}
+
+// Count the instructions from the start of the block up to end
+static void emit_count(jit_t* j, uint16_t end)
+{
+    uint32_t n = (uint16_t)(end - j->block_pc);
+    uint32_t cycles = 0;
+    for(uint16_t pc = j->block_pc; pc != end; ++pc)
+    {
+        cycles += vm_op_cycles[j->memory[pc] >> 12];
+    }
+    if(n)
+    {
+        // add qword [rbx + field], imm32
+        EMIT(j, 0x48, 0x81, 0x83); emit32(j, VM_FIELD(instructions)); emit32(j, n);
+        EMIT(j, 0x48, 0x81, 0x83); emit32(j, VM_FIELD(cycles)); emit32(j, cycles);
+    }
+}
+
+static void emit_exit(jit_t* j, uint16_t pc, int code)
+{
+    if(code == JIT_EXIT_CHECK)
+    {
+        // Counted and PC stored in front of the check
+        emit8(j, 0xB8); emit32(j, code);                  /* mov eax, code */
+        emit8(j, 0xC3);                                   /* ret */
+        return;
+    }
+    if(code == JIT_EXIT_FLUSH)
+    {
+        EMIT(j, 0x48, 0xB8); emit64(j, (uintptr_t)&j->store_address); /* mov rax, &store_address */
+        EMIT(j, 0x66, 0x89, 0x08);                        /* mov word [rax], cx */
+    }
+    emit_count(j, pc);
+    emit_store_reg_imm(j, R_PC, pc);
+    if(code == JIT_EXIT_LOOKUP)
+    {
+        EMIT(j, 0x31, 0xC0);                              /* xor eax, eax */
+    }
+    else
+    {
+        emit8(j, 0xB8); emit32(j, code);                  /* mov eax, code */
+    }
+    emit8(j, 0xC3);                                       /* ret */
+}
+
+// Conditional jump to a side exit, patched once the block body is done
+static void emit_side_exit(jit_t* j, uint8_t cc, uint16_t pc, int code)
+{
+    EMIT(j, 0x0F, cc); emit32(j, 0);
+    jit_side_exit_t* e = &j->side_exits[j->side_exit_count++];
+    e->site = j->cur - 4;
+    e->pc = pc;
+    e->code = code;
+}
+
+// Continue at a known guest address - a direct jump when the target is
+// already compiled, otherwise a stub that jit_run() patches later
+static void emit_chain(jit_t* j, uint16_t target)
+{
+    if(j->entry[target])
+    {
+        emit8(j, 0xE9); emit32(j, 0);
+        patch_rel32(j->cur - 4, j->entry[target]);
+        return;
+    }
+
+    uint8_t* stub = j->cur;
+    emit_store_reg_imm(j, R_PC, target);
+    EMIT(j, 0x48, 0x8D, 0x05); emit32(j, 0);              /* lea rax, [rip + stub] */
+    patch_rel32(j->cur - 4, stub);
+    emit8(j, 0xC3);                                       /* ret */
+}
+
+// The end of a basic block, with R_PC stored. Leave if vm_check_limits()
+// has something to do, like end_block(). Clobbers rdx.
+static void emit_check(jit_t* j)
+{
+    EMIT(j, 0x48, 0x8B, 0x93); emit32(j, VM_FIELD(instructions)); /* mov rdx, [rbx + instructions] */
+    EMIT(j, 0x48, 0x3B, 0x93); emit32(j, VM_FIELD(next_check));   /* cmp rdx, [rbx + next_check] */
+    emit_side_exit(j, 0x83, 0, JIT_EXIT_CHECK);           /* jae */
+    EMIT(j, 0x83, 0xBB); emit32(j, VM_FIELD(irq)); emit8(j, 0);    /* cmp dword [rbx + irq], 0 */
+    emit_side_exit(j, 0x85, 0, JIT_EXIT_CHECK);           /* jne */
+}
+
+// End the block and continue at a known guest address
+static void emit_next(jit_t* j, uint16_t end, uint16_t target)
+{
+    emit_count(j, end);
+    emit_store_reg_imm(j, R_PC, target);
+    emit_check(j);
+    emit_chain(j, target);
+}
+
+// Continue at the guest address in eax (already stored to R_PC)
+static void emit_indirect(jit_t* j)
+{
+    EMIT(j, 0x49, 0x8B, 0x4C, 0xC5, 0x00);                /* mov rcx, [r13 + rax*8] */
+    EMIT(j, 0x48, 0x85, 0xC9);                            /* test rcx, rcx */
+    EMIT(j, 0x74, 0x02);                                  /* jz +2 */
+    EMIT(j, 0xFF, 0xE1);                                  /* jmp rcx */
+    EMIT(j, 0x31, 0xC0);                                  /* xor eax, eax */
+    emit8(j, 0xC3);                                       /* ret */
+}
+
+// Mark the page dirty, clear decode_cache[addr].fn and leave the block if
+// a block was built from addr (vm->block_map). The address is in rcx,
+// clobbers rax and rdx.
+static void emit_store_invalidate(jit_t* j, uint16_t next_pc)
+{
+    EMIT(j, 0x0F, 0xB6, 0xD5);                            /* movzx edx, ch */
+    EMIT(j, 0x48, 0xB8); emit64(j, (uintptr_t)j->dirty_page); /* mov rax, dirty_page */
+    EMIT(j, 0xC6, 0x04, 0x10, 0x01);                      /* mov byte [rax + rdx], 1 */
+    EMIT(j, 0x48, 0x89, 0xCA);                            /* mov rdx, rcx */
+    EMIT(j, 0x48, 0xC1, 0xE2, 0x04);                      /* shl rdx, 4 */
+    EMIT(j, 0x49, 0xC7, 0x04, 0x16); emit32(j, 0);        /* mov qword [r14 + rdx], 0 */
+#if VM_FUSE
+    // Superinstructions starting one or two words earlier, see decode_guard
+    EMIT(j, 0x49, 0xC7, 0x44, 0x16, 0xF0); emit32(j, 0);  /* mov qword [r14 + rdx - 16], 0 */
+    EMIT(j, 0x49, 0xC7, 0x44, 0x16, 0xE0); emit32(j, 0);  /* mov qword [r14 + rdx - 32], 0 */
+#endif
+    EMIT(j, 0x41, 0x80, 0x3C, 0x0F, 0x00);                /* cmp byte [r15 + rcx], 0 */
+    emit_side_exit(j, 0x85, next_pc, JIT_EXIT_FLUSH);     /* jne */
+}
+
+// rcx = (reg[base] + offset) & 0xFFFF, leaving the block if it is in a
+// device page. Clobbers rax and rdx.
+static void emit_address(jit_t* j, int base, uint16_t offset, uint16_t pc)
+{
+    emit_load_reg(j, 1, base);
+    EMIT(j, 0x66, 0x81, 0xC1); emit16(j, offset);         /* add cx, offset */
+    EMIT(j, 0x0F, 0xB6, 0xD5);                            /* movzx edx, ch */
+    EMIT(j, 0x48, 0xB8); emit64(j, (uintptr_t)j->device_page); /* mov rax, device_page */
+    EMIT(j, 0x80, 0x3C, 0x10, 0x00);                      /* cmp byte [rax + rdx], 0 */
+    emit_side_exit(j, 0x85, pc, JIT_EXIT_INTERP);         /* jne */
+}
+
+// Compile one instruction. Returns 1 to keep going, 0 once the block is
+// closed. Instructions that cannot be compiled close the block with an exit
+// to the interpreter at their own address.
+static int compile_instr(jit_t* j, uint16_t pc, uint16_t instr)
+{
+    uint16_t next = pc + 1;
+    uint16_t op = instr >> 12;
+    uint16_t r0 = (instr >> 9) & 0x7;
+    uint16_t r1 = (instr >> 6) & 0x7;
+    uint16_t r2 = instr & 0x7;
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    switch(op)
+    {
+        case OP_ADD:
+        case OP_AND:
+            emit_load_reg(j, 0, r1);
+            if(imm_flag)
+            {
+                EMIT(j, 0x66, op == OP_ADD ? 0x05 : 0x25); /* add/and ax, imm16 */
+                emit16(j, sign_extend(instr & 0x1F, 5));
+            }
+            else
+            {
+                EMIT(j, 0x66, op == OP_ADD ? 0x03 : 0x23); /* add/and ax, [rbx + r2*2] */
+                EMIT(j, 0x43, REG(r2));
+            }
+            emit_store_reg(j, 0, r0);
+            j->pending_flags = r0;
+            return 1;
+
+        case OP_NOT:
+            emit_load_reg(j, 0, r1);
+            EMIT(j, 0x66, 0xF7, 0xD0);                    /* not ax */
+            emit_store_reg(j, 0, r0);
+            j->pending_flags = r0;
+            return 1;
+
+        case OP_LEA:
+            emit_store_reg_imm(j, r0, next + sign_extend(instr & 0x1FF, 9));
+            j->pending_flags = r0;
+            return 1;
+
+        case OP_LD:
+        {
+            uint16_t address = next + sign_extend(instr & 0x1FF, 9);
+            if(j->device_page[address >> VM_PAGE_SHIFT])
+            {
+                break;
+            }
+            EMIT(j, 0x41, 0x0F, 0xB7, 0x84, 0x24);        /* movzx eax, word [r12 + disp32] */
+            emit32(j, address * 2);
+            emit_store_reg(j, 0, r0);
+            j->pending_flags = r0;
+            return 1;
+        }
+
+        case OP_ST:
+        {
+            uint16_t address = next + sign_extend(instr & 0x1FF, 9);
+            if(j->device_page[address >> VM_PAGE_SHIFT])
+            {
+                break;
+            }
+            flush_flags(j);
+            emit_load_reg(j, 0, r0);
+            EMIT(j, 0x66, 0x41, 0x89, 0x84, 0x24);        /* mov word [r12 + disp32], ax */
+            emit32(j, address * 2);
+            emit8(j, 0xB9); emit32(j, address);           /* mov ecx, address */
+            emit_store_invalidate(j, next);
+            return 1;
+        }
+
+        case OP_LDR:
+            flush_flags(j);
+            emit_address(j, r1, sign_extend(instr & 0x3F, 6), pc);
+            EMIT(j, 0x41, 0x0F, 0xB7, 0x04, 0x4C);        /* movzx eax, word [r12 + rcx*2] */
+            emit_store_reg(j, 0, r0);
+            j->pending_flags = r0;
+            return 1;
+
+        case OP_STR:
+            flush_flags(j);
+            emit_address(j, r1, sign_extend(instr & 0x3F, 6), pc);
+            emit_load_reg(j, 0, r0);
+            EMIT(j, 0x66, 0x41, 0x89, 0x04, 0x4C);        /* mov word [r12 + rcx*2], ax */
+            emit_store_invalidate(j, next);
+            return 1;
+
+        case OP_BR:
+        {
+            uint16_t target = next + sign_extend(instr & 0x1FF, 9);
+            flush_flags(j);
+            if(r0 == 0)
+            {
+                // BR with no condition bits never branches, but still ends
+                // the block for the limits
+                emit_next(j, next, next);
+                return 0;
+            }
+            if(r0 == 0x7)
+            {
+                emit_next(j, next, target);
+                return 0;
+            }
+            // Signed compare of the last result against zero, nzp picks the jcc
+            static const uint8_t jcc[8] = { 0, 0x8F, 0x84, 0x8D, 0x8C, 0x85, 0x8E, 0 };
+            EMIT(j, 0x66, 0x83, 0x7B, REG(R_COND), 0x00); /* cmp word [R_COND], 0 */
+            EMIT(j, 0x0F, jcc[r0]); emit32(j, 0);         /* jg/je/jge/jl/jne/jle taken */
+            uint8_t* taken = j->cur - 4;
+            emit_next(j, next, next);
+            patch_rel32(taken, j->cur);
+            emit_next(j, next, target);
+            return 0;
+        }
+
+        case OP_JMP:
+            flush_flags(j);
+            emit_load_reg(j, 0, r1);
+            emit_store_reg(j, 0, R_PC);
+            emit_count(j, next);
+            emit_check(j);
+            emit_indirect(j);
+            return 0;
+
+        case OP_JSR:
+            flush_flags(j);
+            if((instr >> 11) & 1)
+            {
+                emit_store_reg_imm(j, R_R7, next);
+                emit_next(j, next, next + sign_extend(instr & 0x7FF, 11));
+            }
+            else
+            {
+                emit_load_reg(j, 0, r1);
+                emit_store_reg_imm(j, R_R7, next);
+                emit_store_reg(j, 0, R_PC);
+                emit_count(j, next);
+                emit_check(j);
+                emit_indirect(j);
+            }
+            return 0;
+
+        default:
+            break;
+    }
+
+    // TRAP, LDI, STI, RTI and device accesses go back to the interpreter
+    flush_flags(j);
+    emit_exit(j, pc, JIT_EXIT_INTERP);
+    return 0;
+}
+
+// Host side of the call into native code, saves the callee-saved registers
+// and loads the base pointers listed at the top of this file
+static void emit_trampoline(jit_t* j)
+{
+    emit8(j, 0x53);                                       /* push rbx */
+    EMIT(j, 0x41, 0x54);                                  /* push r12 */
+    EMIT(j, 0x41, 0x55);                                  /* push r13 */
+    EMIT(j, 0x41, 0x56);                                  /* push r14 */
+    EMIT(j, 0x41, 0x57);                                  /* push r15 */
+    EMIT(j, 0x48, 0x89, 0xF3);                            /* mov rbx, rsi */
+    EMIT(j, 0x49, 0x89, 0xD4);                            /* mov r12, rdx */
+    EMIT(j, 0x49, 0x89, 0xCD);                            /* mov r13, rcx */
+    EMIT(j, 0x4D, 0x89, 0xC6);                            /* mov r14, r8 */
+    EMIT(j, 0x4D, 0x89, 0xCF);                            /* mov r15, r9 */
+    EMIT(j, 0xFF, 0xD7);                                  /* call rdi */
+    EMIT(j, 0x41, 0x5F);                                  /* pop r15 */
+    EMIT(j, 0x41, 0x5E);                                  /* pop r14 */
+    EMIT(j, 0x41, 0x5D);                                  /* pop r13 */
+    EMIT(j, 0x41, 0x5C);                                  /* pop r12 */
+    emit8(j, 0x5B);                                       /* pop rbx */
+    emit8(j, 0xC3);                                       /* ret */
+}
+
+jit_t* jit_create()
+{
+    jit_t* j = calloc(1, sizeof(jit_t));
+    if(!j)
+    {
+        return NULL;
+    }
+
+    void* buf = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(buf == MAP_FAILED)
+    {
+        perror("jit: mmap");
+        free(j);
+        return NULL;
+    }
+
+    j->buf = buf;
+    j->cur = j->buf;
+    emit_trampoline(j);
+    j->code_start = j->cur;
+    return j;
+}
+
+void jit_destroy(jit_t* jit)
+{
+    if(!jit)
+    {
+        return;
+    }
+    munmap(jit->buf, JIT_BUFFER_SIZE);
+    free(jit);
+}
+
+// Drop every compiled block. Blocks are chained into each other, so this is
+// simpler and safer than unlinking a single one.
+void jit_flush(jit_t* jit)
+{
+    jit->cur = jit->code_start;
+    memset(jit->entry, 0, sizeof(jit->entry));
+    memset(jit->code_map, 0, sizeof(jit->code_map));
+    memset(jit->hits, 0, sizeof(jit->hits));
+    ++jit->flushes;
+}
+
+void* jit_compile(vm_t* vm, uint16_t pc)
+{
+    jit_t* j = vm->jit;
+    j->memory = vm->memory;
+    j->device_page = vm->device_page;
+    j->dirty_page = vm->dirty_page;
+    if(j->device_page[pc >> VM_PAGE_SHIFT])
+    {
+        return NULL;
+    }
+
+    if(j->cur + JIT_MAX_BLOCK_BYTES > j->buf + JIT_BUFFER_SIZE)
+    {
+        jit_flush(j);
+    }
+
+    // A block has to contain at least one compilable instruction
+    uint16_t first = vm->memory[pc];
+    uint16_t op = first >> 12;
+    if(op == OP_TRAP || op == OP_LDI || op == OP_STI || op == OP_RTI || op == OP_RES)
+    {
+        return NULL;
+    }
+
+    // Registered up front so a block that loops to itself jumps directly
+    uint8_t* code = j->cur;
+    uint16_t end = pc;
+    jit_side_exit_t* e;
+    j->side_exit_count = 0;
+    j->pending_flags = -1;
+    j->block_pc = pc;
+    j->entry[pc] = code;
+
+    for(int n = 0;; ++n)
+    {
+        if(n == JIT_MAX_BLOCK || j->device_page[end >> VM_PAGE_SHIFT])
+        {
+            // Not a basic block end, the limits wait for the real one
+            flush_flags(j);
+            emit_count(j, end);
+            emit_chain(j, end);
+            break;
+        }
+        if(!compile_instr(j, end, vm->memory[end]))
+        {
+            ++end;
+            break;
+        }
+        ++end;
+    }
+
+    for(e = j->side_exits; e < j->side_exits + j->side_exit_count; ++e)
+    {
+        patch_rel32(e->site, j->cur);
+        emit_exit(j, e->pc, e->code);
+    }
+
+    for(uint16_t a = pc; a != end; ++a)
+    {
+        j->code_map[a] = 1;
+        vm->block_map[a] = 1;
+    }
+
+    ++j->compiles;
+    METRIC_ADD(vm, jit_compiles, 1);
+    return code;
+}
+
+// Run native code until the interpreter is needed. Returns 1 if the
+// instruction at R_PC has to be interpreted, 0 to carry on dispatching.
+// Native code has counted everything up to R_PC.
+int jit_run(vm_t* vm, void* code)
+{
+    jit_t* j = vm->jit;
+    jit_enter_t enter = (jit_enter_t)j->buf;
+
+    for(;;)
+    {
+        uintptr_t exit = enter(code, vm->reg, vm->memory, j->entry, vm->decode_cache, vm->block_map);
+        vm->block_start = vm->reg[R_PC];
+
+        if(exit == JIT_EXIT_INTERP)
+        {
+            return 1;
+        }
+        if(exit == JIT_EXIT_FLUSH)
+        {
+            block_invalidate(vm, j->store_address);
+            return 0;
+        }
+        if(exit == JIT_EXIT_CHECK)
+        {
+            vm_check_limits(vm);
+            return 0;
+        }
+
+        code = j->entry[vm->reg[R_PC]];
+        if(!code)
+        {
+            return 0;
+        }
+
+        if(exit != JIT_EXIT_LOOKUP)
+        {
+            // Patch the stub into a direct jump to its now compiled target
+            uint8_t* stub = (uint8_t*)exit;
+            stub[0] = 0xE9;
+            patch_rel32(stub + 1, code);
+        }
+    }
+}
+
+#else
+
+jit_t* jit_create()
+{
+    return NULL;
+}
+
+void jit_destroy(jit_t* jit)
+{
+}
+
+void* jit_compile(vm_t* vm, uint16_t pc)
+{
+    return NULL;
+}
+
+int jit_run(vm_t* vm, void* code)
+{
+    return 1;
+}
+
+void jit_flush(jit_t* jit)
+{
+}
+
+#endif
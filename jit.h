@@ -0,0 +1,68 @@
+/*
+  Basic-block JIT - hot blocks of straight-line LC-3 code are translated to
+  native code in an mmap'ed executable buffer and chained to each other.
+  Blocks add up their instructions and cycles with totals worked out when
+  they are compiled, and look at the limits and vm->irq where the
+  interpreter would, at each basic block end. Only an x86-64 backend
+  exists; elsewhere jit_create() fails and the interpreter runs everything.
+*/
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+// Executions of a block start before it is compiled
+#define JIT_THRESHOLD 32
+#define JIT_MAX_BLOCK 64
+
+// Side exits are emitted after the block body
+typedef struct
+{
+    uint8_t* site;   /* rel32 to patch */
+    uint16_t pc;     /* guest PC on exit */
+    int code;        /* JIT_EXIT_* */
+} jit_side_exit_t;
+
+// Per machine JIT state
+typedef struct jit
+{
+    // Native entry point for each guest address, NULL if not compiled
+    void* entry[UINT16_MAX + 1];
+
+    // Non-zero for every guest address covered by a compiled block. Native
+    // stores test vm->block_map, which has these set too.
+    uint8_t code_map[UINT16_MAX + 1];
+
+    // Executions seen by the interpreter at each block start
+    uint16_t hits[UINT16_MAX + 1];
+
+    // Code buffer
+    uint8_t* buf;
+    uint8_t* cur;
+    uint8_t* code_start;
+
+    // Block being compiled
+    jit_side_exit_t side_exits[JIT_MAX_BLOCK * 2 + 4];
+    int side_exit_count;
+    int pending_flags;
+    uint16_t block_pc;
+    const uint16_t* memory;      /* vm->memory, for the cycle counts */
+    const uint8_t* device_page;  /* vm->device_page, accesses there exit */
+    uint8_t* dirty_page;         /* vm->dirty_page, native stores mark it */
+
+    // Address of the store that left through JIT_EXIT_FLUSH
+    uint16_t store_address;
+
+    uint64_t compiles;
+    uint64_t flushes;
+} jit_t;
+
+jit_t* jit_create();
+void jit_destroy(jit_t* jit);
+void* jit_compile(vm_t* vm, uint16_t pc);
+int jit_run(vm_t* vm, void* code);
+void jit_flush(jit_t* jit);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+  Keyboard device, see keyboard.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+/* unix */
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "keyboard.h"
+
+static void* reader_main(void* arg)
+{
+    keyboard_t* kb = arg;
+    struct pollfd fds[2];
+    fds[0].fd = kb->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = kb->wake[0];
+    fds[1].events = POLLIN;
+
+    for(;;)
+    {
+        uint32_t head = atomic_load_explicit(&kb->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&kb->tail, memory_order_acquire);
+        uint32_t space = KBD_RING_SIZE - (head - tail);
+
+        // Ring is full, wait for the machine to catch up
+        fds[0].events = space ? POLLIN : 0;
+        if(poll(fds, 2, space ? -1 : 1) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if(fds[1].revents)
+        {
+            return NULL;
+        }
+        if(!space || !fds[0].revents)
+        {
+            continue;
+        }
+
+        // Don't read past the end of the ring, the next read wraps
+        uint32_t offset = head % KBD_RING_SIZE;
+        uint32_t chunk = KBD_RING_SIZE - offset < space ? KBD_RING_SIZE - offset : space;
+        ssize_t n = read(kb->fd, kb->ring + offset, chunk);
+        if(n < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            break;
+        }
+
+        pthread_mutex_lock(&kb->lock);
+        atomic_store_explicit(&kb->head, head + (uint32_t)n, memory_order_release);
+        pthread_cond_broadcast(&kb->cond);
+        pthread_mutex_unlock(&kb->lock);
+        if(kb->irq)
+        {
+            atomic_store(kb->irq, 1);
+        }
+    }
+
+    pthread_mutex_lock(&kb->lock);
+    atomic_store(&kb->eof, 1);
+    pthread_cond_broadcast(&kb->cond);
+    pthread_mutex_unlock(&kb->lock);
+    return NULL;
+}
+
+int keyboard_start(keyboard_t* kb, int fd)
+{
+    if(kb->started)
+    {
+        return 1;
+    }
+
+    atomic_store(&kb->head, 0);
+    atomic_store(&kb->tail, 0);
+    atomic_store(&kb->eof, 0);
+    kb->fd = fd;
+    if(pipe(kb->wake) != 0)
+    {
+        return 0;
+    }
+    pthread_mutex_init(&kb->lock, NULL);
+    pthread_cond_init(&kb->cond, NULL);
+
+    if(pthread_create(&kb->thread, NULL, reader_main, kb) != 0)
+    {
+        close(kb->wake[0]);
+        close(kb->wake[1]);
+        pthread_mutex_destroy(&kb->lock);
+        pthread_cond_destroy(&kb->cond);
+        return 0;
+    }
+    kb->started = 1;
+    return 1;
+}
+
+int keyboard_set_buffer(keyboard_t* kb, const void* data, size_t len)
+{
+    uint8_t* copy = malloc(len ? len : 1);
+    if(!copy)
+    {
+        return 0;
+    }
+    memcpy(copy, data, len);
+    free(kb->data);
+    kb->data = copy;
+    kb->data_len = len;
+    kb->data_pos = 0;
+    kb->data_cap = len;
+    kb->refill = NULL;
+    return 1;
+}
+
+// Take input from refill() instead, asked for up to KBD_RING_SIZE bytes
+// whenever the last lot has been read
+int keyboard_set_callback(keyboard_t* kb, keyboard_refill_t refill, void* ctx)
+{
+    uint8_t* buf = malloc(KBD_RING_SIZE);
+    if(!buf)
+    {
+        return 0;
+    }
+    free(kb->data);
+    kb->data = buf;
+    kb->data_len = 0;
+    kb->data_pos = 0;
+    kb->data_cap = KBD_RING_SIZE;
+    kb->refill = refill;
+    kb->refill_ctx = ctx;
+    return 1;
+}
+
+// Anything left in the buffer? Refills it first if it has a callback.
+static int data_left(keyboard_t* kb)
+{
+    if(kb->data_pos == kb->data_len && kb->refill)
+    {
+        kb->data_len = kb->refill(kb->refill_ctx, kb->data, kb->data_cap);
+        kb->data_pos = 0;
+    }
+    return kb->data_pos < kb->data_len;
+}
+
+void keyboard_stop(keyboard_t* kb)
+{
+    free(kb->data);
+    kb->data = NULL;
+    kb->refill = NULL;
+    if(!kb->started)
+    {
+        return;
+    }
+
+    char c = 0;
+    if(write(kb->wake[1], &c, 1) == 1)
+    {
+        pthread_join(kb->thread, NULL);
+    }
+    else
+    {
+        pthread_detach(kb->thread);
+    }
+    close(kb->wake[0]);
+    close(kb->wake[1]);
+    pthread_mutex_destroy(&kb->lock);
+    pthread_cond_destroy(&kb->cond);
+    kb->started = 0;
+}
+
+// In a forked child the reader thread is gone, drop it without joining.
+// Bytes already in the ring can still be read.
+void keyboard_forget(keyboard_t* kb)
+{
+    if(kb->started)
+    {
+        close(kb->wake[0]);
+        close(kb->wake[1]);
+        kb->started = 0;
+    }
+    atomic_store(&kb->eof, 1);
+}
+
+static int ring_empty(keyboard_t* kb)
+{
+    return atomic_load_explicit(&kb->head, memory_order_acquire) ==
+           atomic_load_explicit(&kb->tail, memory_order_relaxed);
+}
+
+// Is a byte waiting? Unlike keyboard_poll() this never idles.
+int keyboard_ready(keyboard_t* kb)
+{
+    if(kb->data)
+    {
+        return data_left(kb);
+    }
+    return kb->started && !ring_empty(kb);
+}
+
+// Wait until a byte arrives, input ends or the timeout passes (0 = forever)
+static void wait_input(keyboard_t* kb, long timeout_us)
+{
+    struct timespec deadline;
+    if(timeout_us)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += timeout_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+    }
+
+    pthread_mutex_lock(&kb->lock);
+    while(ring_empty(kb) && !atomic_load(&kb->eof))
+    {
+        if(!timeout_us)
+        {
+            pthread_cond_wait(&kb->cond, &kb->lock);
+        }
+        else if(pthread_cond_timedwait(&kb->cond, &kb->lock, &deadline) != 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&kb->lock);
+}
+
+// KBSR - is a key waiting? A plain load unless the guest has been spinning.
+int keyboard_poll(keyboard_t* kb)
+{
+    ++kb->polls;
+    if(kb->data)
+    {
+        return data_left(kb);
+    }
+    if(!ring_empty(kb))
+    {
+        kb->empty_polls = 0;
+        return 1;
+    }
+
+    if(++kb->empty_polls >= KBD_SPIN_POLLS && !atomic_load(&kb->eof))
+    {
+        ++kb->idles;
+        wait_input(kb, KBD_IDLE_US);
+        return !ring_empty(kb);
+    }
+    return 0;
+}
+
+// Sleep until a byte arrives, input ends or timeout_us passes, for a
+// guest that has nothing else to do. Returns 1 if a byte is waiting.
+int keyboard_sleep(keyboard_t* kb, long timeout_us)
+{
+    if(kb->data || !kb->started || atomic_load(&kb->eof))
+    {
+        return keyboard_ready(kb);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    wait_input(kb, timeout_us);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ++kb->spin_sleeps;
+    kb->spin_us += (uint64_t)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    return !ring_empty(kb);
+}
+
+// Take the next byte, blocking until one arrives. EOF once input ends.
+int keyboard_getc(keyboard_t* kb)
+{
+    if(kb->data)
+    {
+        return data_left(kb) ? kb->data[kb->data_pos++] : EOF;
+    }
+
+    kb->empty_polls = 0;
+    if(ring_empty(kb))
+    {
+        wait_input(kb, 0);
+        if(ring_empty(kb))
+        {
+            return EOF;
+        }
+    }
+
+    uint32_t tail = atomic_load_explicit(&kb->tail, memory_order_relaxed);
+    int c = kb->ring[tail % KBD_RING_SIZE];
+    atomic_store_explicit(&kb->tail, tail + 1, memory_order_release);
+    return c;
+}
@@ -0,0 +1,81 @@
+/*
+  Keyboard device. A reader thread moves bytes from the machine's input fd
+  into a single-producer/single-consumer ring, so KBSR and KBDR reads never
+  make a syscall. A guest that keeps polling KBSR with nothing to read is
+  parked on a condition variable for a moment instead of spinning, and one
+  stuck in a loop that does nothing but poll sleeps until a key arrives
+  (see console.c).
+
+  Headless machines can be given their input as a buffer instead, or a
+  callback that fills one, which needs no thread at all. Arriving bytes
+  set the machine's interrupt flag for guests that take keyboard
+  interrupts (see interrupt.h).
+*/
+#ifndef KEYBOARD_H
+#define KEYBOARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define KBD_RING_SIZE 4096
+// Empty KBSR polls in a row before the machine starts idling
+#define KBD_SPIN_POLLS 256
+// Longest a single idle wait lasts
+#define KBD_IDLE_US 1000
+// Longest a guest in a polling loop sleeps before it polls again
+#define KBD_SPIN_SLEEP_US 100000
+
+// Up to cap bytes into buf, returns how many (0 for none right now)
+typedef size_t (*keyboard_refill_t)(void* ctx, uint8_t* buf, size_t cap);
+
+typedef struct
+{
+    uint8_t ring[KBD_RING_SIZE];
+    _Atomic uint32_t head;      /* written by the reader thread */
+    _Atomic uint32_t tail;      /* written by the machine */
+    _Atomic int eof;
+
+    int fd;
+    int wake[2];                /* pipe used to stop the reader */
+    int started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when bytes arrive or at eof */
+    _Atomic int* irq;           /* vm->irq, set when bytes arrive */
+
+    // Fixed input set with keyboard_set_buffer(), used instead of the ring,
+    // or a buffer keyboard_set_callback() has refill() fill again once read
+    uint8_t* data;
+    size_t data_len;
+    size_t data_pos;
+    size_t data_cap;
+    keyboard_refill_t refill;
+    void* refill_ctx;
+
+    uint32_t empty_polls;
+    uint64_t polls;
+    uint64_t idles;
+
+    // Polling loop detection, kept by console.c
+    uint16_t spin_pc;           /* instruction behind the last empty poll */
+    uint32_t spin_polls;        /* empty polls in a row from spin_pc */
+    int spin_loop;              /* spin_pc is in a loop that only polls */
+    uint64_t spin_sleeps;
+    uint64_t spin_us;           /* time slept instead of spinning */
+} keyboard_t;
+
+struct vm;
+
+int keyboard_start(keyboard_t* kb, int fd);
+void keyboard_stop(keyboard_t* kb);
+int keyboard_set_buffer(keyboard_t* kb, const void* data, size_t len);
+int keyboard_set_callback(keyboard_t* kb, keyboard_refill_t refill, void* ctx);
+void keyboard_forget(keyboard_t* kb);
+int keyboard_ready(keyboard_t* kb);
+int keyboard_poll(keyboard_t* kb);
+int keyboard_getc(keyboard_t* kb);
+int keyboard_sleep(keyboard_t* kb, long timeout_us);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+  libvm - the LC-3 machine as a library, for running programs inside
+  another process. make lib builds lib/libvm.a and lib/libvm.so; the vm
+  command line tool is a thin wrapper over the same code (main.c).
+
+    vm_t* vm = vm_create();
+    vm_set_output_callback(vm, on_output, ctx);
+    vm_set_input(vm, "abc", 3);
+    if(vm_load_image_from_buffer(vm, obj, obj_len))
+    {
+        int reason = vm_run(vm, 1000000);  // VM_EXIT_*
+        ...
+    }
+    vm_destroy(vm);
+
+  A new machine starts at x3000 with its console on stdin and stdout.
+  Machines share nothing, so any number can run side by side as long as
+  each one is driven by one thread at a time. Functions that return int
+  return 1 on success and 0 on failure, unless they say otherwise.
+*/
+#ifndef LIBVM_H
+#define LIBVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm vm_t;
+
+// Registers
+// 10 Total Registers - Each holding 16 bits
+// 8 General purpose - R0-R7
+// 1 Program counter - PC
+// 1 Condition flag - COND
+
+enum
+{
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+    R_PC,
+    R_COND,
+    R_COUNT
+};
+
+// Trap Codes
+enum
+{
+    TRAP_GETC = 0x20,    /* get char from keyboard*/
+    TRAP_OUT = 0x21,     /* output a char */
+    TRAP_PUTS = 0x22,    /* output a word string */
+    TRAP_IN = 0x23,      /* get character from keyboard, echo to terminal */
+    TRAP_PUTSP = 0x24,   /* output a byte string */
+    TRAP_HALT = 0x25,    /* halt the program */
+
+    // Native fast traps, installed by vm_set_fast_traps() (see trap.c)
+    TRAP_MEMCPY = 0x26,  /* copy R2 words from R1 to R0 */
+    TRAP_MEMSET = 0x27,  /* store R1 in R2 words from R0 */
+    TRAP_MUL = 0x28,     /* R1:R0 = R0 * R1 */
+    TRAP_DIV = 0x29,     /* R0 = R0 / R1, R1 = R0 % R1 */
+    TRAP_PUTN = 0x2A     /* print R0 in decimal */
+};
+
+// Why vm_run() returned
+enum
+{
+    VM_EXIT_HALT = 0,  /* TRAP HALT */
+    VM_EXIT_BUDGET,    /* max_instructions executed */
+    VM_EXIT_TIMEOUT,   /* timeout_ms passed */
+    VM_EXIT_INPUT,     /* stop_on_input was set and the guest asked for input */
+    VM_EXIT_FAULT      /* exception without a handler, PC is left on the instruction */
+};
+
+// Console output as it is flushed, see vm_set_output_callback()
+typedef void (*vm_output_fn)(void* ctx, const char* data, size_t len);
+// Up to cap bytes of input into buf, returns how many; 0 when there are
+// none right now
+typedef size_t (*vm_input_fn)(void* ctx, uint8_t* buf, size_t cap);
+// A trap run on the host, see trap.c
+typedef void (*native_trap_t)(vm_t* vm);
+
+// Machines
+vm_t* vm_create();
+void vm_destroy(vm_t* vm);
+int vm_load_image(vm_t* vm, const char* path);
+// Several images in order, read from disk in parallel and with their code
+// predecoded across the cores. Returns how many loaded, stopping at the
+// first that fails.
+int vm_load_images(vm_t* vm, const char* const* paths, int count);
+int vm_load_image_from_buffer(vm_t* vm, const void* data, size_t size);
+
+// Run from PC for at most budget instructions (0 for no budget), to the
+// end of the basic block the budget runs out in. Returns VM_EXIT_*.
+int vm_run(vm_t* vm, uint64_t budget);
+// Run one instruction. Returns 0 if the machine stopped instead (HALT, a
+// fault, the limits), vm_exit_reason() says why.
+int vm_step(vm_t* vm);
+int vm_exit_reason(const vm_t* vm);
+uint64_t vm_instructions(const vm_t* vm);
+// Guest cycles those instructions took: one each, one more per data
+// access and one for the link of JSR and TRAP (vm_op_cycles in vm.c)
+uint64_t vm_cycles(const vm_t* vm);
+
+// Limits on top of vm_run()'s budget, 0 for none: a total instruction
+// count and the wall clock time of each run
+void vm_set_limits(vm_t* vm, uint64_t max_instructions, uint64_t timeout_ms);
+
+// Registers and memory. R_COND reads and writes N/Z/P (FL_* in vm.h).
+// vm_read() and vm_write() go through devices like guest loads and stores.
+uint16_t vm_get_reg(const vm_t* vm, int r);
+void vm_set_reg(vm_t* vm, int r, uint16_t val);
+uint16_t vm_read(vm_t* vm, uint16_t address);
+void vm_write(vm_t* vm, uint16_t address, uint16_t val);
+
+// Console input - a fixed buffer (copied), or a callback asked for more
+// whenever what it gave has been read. With stop_on_input set a guest that
+// wants input that isn't there stops the run with VM_EXIT_INPUT and the
+// trap runs again on the next one; otherwise it reads EOF (xFFFF).
+int vm_set_input(vm_t* vm, const void* data, size_t len);
+int vm_load_input(vm_t* vm, const char* path);
+int vm_set_input_callback(vm_t* vm, vm_input_fn fn, void* ctx);
+void vm_set_stop_on_input(vm_t* vm, int on);
+
+// Console output - to a callback, or into a buffer vm_output() returns
+void vm_set_output_callback(vm_t* vm, vm_output_fn fn, void* ctx);
+int vm_capture_output(vm_t* vm);
+const char* vm_output(vm_t* vm, size_t* len);
+
+// Run time metrics, see metrics.h. A machine counts into one of 256
+// slots, one per thread that runs machines. vm_write_metrics() writes
+// every slot in use to fd in the Prometheus text format, without
+// allocating; vm_serve_metrics() answers every connection to a Unix
+// socket at path with it, from a thread of its own.
+int vm_set_metrics_slot(vm_t* vm, int slot);
+int vm_write_metrics(int fd);
+int vm_serve_metrics(const char* path);
+
+// Trap table and the native fast traps, see trap.c
+void vm_set_trap(vm_t* vm, uint8_t vector, native_trap_t fn);
+void vm_set_fast_traps(vm_t* vm);
+void vm_set_guest_traps(vm_t* vm);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+  Image loading. Both big-endian .obj files and native .lc3img snapshots
+  (see image.c) are accepted, and .asm source is assembled (see
+  assembler.c). Files are mmap'ed and byte-swapped straight into the
+  machine's memory with the widest vector unit the build targets, or AVX2
+  when the CPU has it (see cpu.h), so nothing is read into an intermediate
+  buffer. Every image's address range is recorded so overlapping images
+  can be reported. Images already in memory load the same way through
+  vm_load_image_from_buffer().
+
+  vm_load_images() takes all of main()'s images at once: the files are
+  opened and paged in on a thread each, copied into memory in order, and
+  the code they hold is predecoded a shard of basic blocks per core before
+  the first instruction runs. --mkimg saves that block table with the
+  image, so an .lc3img skips finding the blocks again.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+/* unix */
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "vm.h"
+#include "cpu.h"
+#include "image.h"
+#include "assembler.h"
+
+// Threads a load starts at most, and the blocks worth a predecode thread
+#define LOADER_MAX_THREADS 16
+#define LOADER_MIN_BLOCKS 256
+
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+#if VM_HAVE_AVX2
+VM_TARGET_AVX2 static size_t swap16_avx2(uint16_t* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for(; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+#endif
+
+// Vector part of swap16_copy() for the targeted unit, returns the words done
+static size_t swap16_vector(uint16_t* dst, const uint16_t* src, size_t n)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    i = swap16_avx2(dst, src, n);
+#elif defined(__SSSE3__)
+    const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(v, mask));
+    }
+#elif defined(__SSE2__)
+    // Baseline x86-64 has no byte shuffle, but two shifts do the same job
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 8 <= n; i += 8)
+    {
+        uint8x16_t v = vld1q_u8((const uint8_t*)(src + i));
+        vst1q_u8((uint8_t*)(dst + i), vrev16q_u8(v));
+    }
+#endif
+    return i;
+}
+
+// dst[i] = swap16(src[i]), dst may equal src
+void swap16_copy(uint16_t* dst, const uint16_t* src, size_t n)
+{
+#if VM_MULTIVERSION
+    size_t i = cpu_avx2() ? swap16_avx2(dst, src, n) : swap16_vector(dst, src, n);
+#else
+    size_t i = swap16_vector(dst, src, n);
+#endif
+
+    for(; i < n; ++i)
+    {
+        dst[i] = swap16(src[i]);
+    }
+}
+
+// Remember where an image landed and warn if it lands on top of another one.
+// Anything decoded from the old contents is dropped.
+void record_image_range(vm_t* vm, const char* path, uint16_t origin, uint32_t length)
+{
+    uint32_t end = (uint32_t)origin + length;
+
+    invalidate_decode(vm, origin, end);
+    // Written behind the dirty page map's back
+    vm->dirty_base = NULL;
+
+    for(int i = 0; i < vm->image_count; ++i)
+    {
+        image_range_t* r = &vm->images[i];
+        uint32_t r_end = (uint32_t)r->origin + r->length;
+        if(length && r->length && origin < r_end && r->origin < end)
+        {
+            uint16_t lo = origin > r->origin ? origin : r->origin;
+            uint16_t hi = (end < r_end ? end : r_end) - 1;
+            fprintf(stderr, "warning: %s overlaps %s at x%04X-x%04X\n", path, r->path, lo, hi);
+        }
+    }
+
+    if(vm->image_count == VM_MAX_IMAGES)
+    {
+        return;
+    }
+
+    image_range_t* r = &vm->images[vm->image_count++];
+    r->path = strdup(path);
+    r->origin = origin;
+    r->length = length;
+}
+
+void read_image_file(vm_t* vm, FILE* file)
+{
+    // Origin tells us where in memory to place the image
+    uint16_t origin;
+    if(fread(&origin, sizeof(origin), 1, file) != 1)
+    {
+        return;
+    }
+    origin = swap16(origin);
+
+    size_t max_read = VM_MEMORY_WORDS - origin;
+    uint16_t* p = vm->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    swap16_copy(p, p, read);
+    record_image_range(vm, "<stream>", origin, read);
+}
+
+// An image file opened ahead of loading it, so that several can be
+// opened and read in from disk at once
+enum
+{
+    MAPPED_NONE,     /* could not be opened */
+    MAPPED_ASM,      /* source, left to the assembler */
+    MAPPED_SHORT,    /* too short for an origin */
+    MAPPED_MAP,      /* map holds all size bytes */
+    MAPPED_STREAM    /* not mappable, fd is open for reading */
+};
+
+typedef struct
+{
+    const char* path;
+    int kind;        /* MAPPED_* */
+    int fd;
+    void* map;
+    size_t size;
+} mapped_image_t;
+
+static void map_image(mapped_image_t* m)
+{
+    m->kind = MAPPED_NONE;
+    m->fd = -1;
+    m->map = NULL;
+    m->size = 0;
+
+    // Source goes through the built-in assembler
+    size_t path_len = strlen(m->path);
+    if(path_len > 4 && strcasecmp(m->path + path_len - 4, ".asm") == 0)
+    {
+        m->kind = MAPPED_ASM;
+        return;
+    }
+
+    int fd = open(m->path, O_RDONLY);
+    if(fd < 0)
+    {
+        return;
+    }
+
+    // Pipes and special files have no size to go by and can't be mapped,
+    // they are read instead
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        m->kind = MAPPED_STREAM;
+        m->fd = fd;
+        return;
+    }
+    if(st.st_size < 2)
+    {
+        m->kind = MAPPED_SHORT;
+        close(fd);
+        return;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void* map = mmap(NULL, st.st_size, PROT_READ, flags, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        m->kind = MAPPED_STREAM;
+        m->fd = fd;
+        return;
+    }
+    close(fd);
+
+    m->kind = MAPPED_MAP;
+    m->map = map;
+    m->size = st.st_size;
+}
+
+static void unmap_image(mapped_image_t* m)
+{
+    if(m->kind == MAPPED_MAP)
+    {
+        munmap(m->map, m->size);
+    }
+    else if(m->kind == MAPPED_STREAM)
+    {
+        close(m->fd);
+    }
+    m->kind = MAPPED_NONE;
+}
+
+// Copy a mapped image into memory and let go of the file
+static int load_mapped(vm_t* vm, mapped_image_t* m)
+{
+    int ok = 0;
+    switch(m->kind)
+    {
+        case MAPPED_ASM:
+            ok = assemble_file(vm, m->path);
+            break;
+        case MAPPED_SHORT:
+            fprintf(stderr, "%s: image has no origin\n", m->path);
+            break;
+        case MAPPED_MAP:
+            ok = read_image_buffer(vm, m->path, m->map, m->size);
+            break;
+        case MAPPED_STREAM:
+        {
+            FILE* file = fdopen(m->fd, "rb");
+            if(file)
+            {
+                read_image_file(vm, file);
+                fclose(file);
+                m->kind = MAPPED_NONE;
+                ok = 1;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    unmap_image(m);
+    return ok;
+}
+
+int read_image(vm_t* vm, const char* image_path)
+{
+    mapped_image_t m;
+    m.path = image_path;
+    map_image(&m);
+    return load_mapped(vm, &m);
+}
+
+// Work handed out an item at a time to the threads of run_parallel()
+typedef struct
+{
+    void (*fn)(void* ctx, int item);
+    void* ctx;
+    int count;
+    _Atomic int next;
+} loader_work_t;
+
+static void* loader_worker(void* arg)
+{
+    loader_work_t* w = arg;
+    for(int i; (i = atomic_fetch_add(&w->next, 1)) < w->count;)
+    {
+        w->fn(w->ctx, i);
+    }
+    return NULL;
+}
+
+// fn(ctx, 0) to fn(ctx, count - 1) on up to threads threads, the calling
+// one included. Threads that cannot be started leave more to the others.
+static void run_parallel(void (*fn)(void* ctx, int item), void* ctx, int count, int threads)
+{
+    loader_work_t w;
+    w.fn = fn;
+    w.ctx = ctx;
+    w.count = count;
+    atomic_init(&w.next, 0);
+
+    pthread_t tids[LOADER_MAX_THREADS];
+    int started = 0;
+    if(threads > LOADER_MAX_THREADS)
+    {
+        threads = LOADER_MAX_THREADS;
+    }
+    while(started < threads - 1 && started < count - 1 &&
+          pthread_create(&tids[started], NULL, loader_worker, &w) == 0)
+    {
+        ++started;
+    }
+    loader_worker(&w);
+    for(int i = 0; i < started; ++i)
+    {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+static int loader_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > LOADER_MAX_THREADS ? LOADER_MAX_THREADS : (int)n;
+}
+
+typedef struct
+{
+    vm_t* vm;
+    const lc3img_block_t* blocks;
+    size_t count;
+    size_t per_shard;
+    uint8_t* fresh;  /* addresses decoded by this call */
+} predecode_work_t;
+
+// Decode a run of blocks and add up their cycles. Blocks don't overlap,
+// so every shard writes entries of its own.
+static void predecode_shard(void* ctx, int shard)
+{
+    predecode_work_t* w = ctx;
+    vm_t* vm = w->vm;
+    size_t first = (size_t)shard * w->per_shard;
+    size_t end = first + w->per_shard < w->count ? first + w->per_shard : w->count;
+
+    for(size_t i = first; i < end; ++i)
+    {
+        uint16_t pc = w->blocks[i].start;
+        for(uint16_t n = 0; n < w->blocks[i].length; ++n, ++pc)
+        {
+            if(!vm->decode_cache[pc].fn)
+            {
+                predecode_plain(vm, pc);
+                w->fresh[pc] = 1;
+            }
+        }
+        block_cycles(vm, w->blocks[i].start, w->blocks[i].length);
+    }
+}
+
+// Predecode the blocks in a table like discover_blocks() builds, split
+// across the cores, and cache their cycles, so that the first pass over
+// them runs as fast as the ones after it. Superinstructions look across
+// block ends and are installed afterwards from this thread. Entries
+// already decoded are left alone.
+void predecode_blocks(vm_t* vm, const lc3img_block_t* blocks, size_t count)
+{
+    predecode_work_t w;
+    w.vm = vm;
+    w.blocks = blocks;
+    w.count = count;
+    w.fresh = calloc(VM_MEMORY_WORDS, 1);
+    if(!count || !w.fresh)
+    {
+        free(w.fresh);
+        for(size_t i = 0; i < count; ++i)
+        {
+            uint16_t pc = blocks[i].start;
+            for(uint16_t n = 0; n < blocks[i].length; ++n, ++pc)
+            {
+                predecode(vm, pc);
+            }
+        }
+        return;
+    }
+
+    size_t shards = count / LOADER_MIN_BLOCKS;
+    size_t threads = (size_t)loader_threads();
+    shards = shards < 1 ? 1 : shards > threads ? threads : shards;
+    w.per_shard = (count + shards - 1) / shards;
+    run_parallel(predecode_shard, &w, (int)shards, (int)shards);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        uint16_t pc = blocks[i].start;
+        for(uint16_t n = 0; n < blocks[i].length; ++n, ++pc)
+        {
+            if(w.fresh[pc])
+            {
+                predecode_finish(vm, pc);
+            }
+        }
+    }
+    free(w.fresh);
+}
+
+static void map_one(void* ctx, int item)
+{
+    map_image((mapped_image_t*)ctx + item);
+}
+
+// Load images in order, reading them in from disk in parallel first. What
+// overlaps an earlier image replaces it, with a warning. Code in .obj and
+// .asm images is then found and predecoded, .lc3img images bring theirs.
+// Returns how many were loaded, stopping at the first that fails.
+int read_images(vm_t* vm, const char* const* paths, int count)
+{
+    mapped_image_t* maps = calloc(count > 0 ? count : 1, sizeof(mapped_image_t));
+    if(!maps)
+    {
+        return 0;
+    }
+    for(int i = 0; i < count; ++i)
+    {
+        maps[i].path = paths[i];
+    }
+    run_parallel(map_one, maps, count, count);
+
+    int loaded = 0;
+    int discover = 0;
+    for(; loaded < count; ++loaded)
+    {
+        mapped_image_t* m = &maps[loaded];
+        discover |= m->kind != MAPPED_MAP || !image_is_native(m->map, m->size);
+        if(!load_mapped(vm, m))
+        {
+            break;
+        }
+    }
+    for(int i = loaded; i < count; ++i)
+    {
+        unmap_image(&maps[i]);
+    }
+    free(maps);
+
+    lc3img_block_t* blocks = discover && loaded ? malloc(LC3IMG_MAX_BLOCKS * sizeof(lc3img_block_t)) : NULL;
+    if(blocks)
+    {
+        size_t block_count = discover_blocks(vm, vm->reg[R_PC], blocks, LC3IMG_MAX_BLOCKS);
+        predecode_blocks(vm, blocks, block_count);
+        free(blocks);
+    }
+    return loaded;
+}
+
+// An .obj or .lc3img already in memory, name is what the image map and
+// warnings call it
+int read_image_buffer(vm_t* vm, const char* name, const void* data, size_t size)
+{
+    if(size < 2)
+    {
+        fprintf(stderr, "%s: image has no origin\n", name);
+        return 0;
+    }
+    if(image_is_native(data, size))
+    {
+        return read_native_image(vm, name, data, size);
+    }
+
+    const uint8_t* bytes = data;
+    uint16_t origin = (uint16_t)(bytes[0] << 8 | bytes[1]);
+    size_t count = size / 2 - 1;
+    size_t max_read = VM_MEMORY_WORDS - origin;
+
+    if(size & 1)
+    {
+        fprintf(stderr, "warning: %s has an odd trailing byte\n", name);
+    }
+    if(count > max_read)
+    {
+        fprintf(stderr, "warning: %s runs past the end of memory, truncated\n", name);
+        count = max_read;
+    }
+
+    // Straight from the buffer unless its words are misaligned
+    uint16_t* dst = vm->memory + origin;
+    if((uintptr_t)data & 1)
+    {
+        memcpy(dst, bytes + 2, count * sizeof(uint16_t));
+        swap16_copy(dst, dst, count);
+    }
+    else
+    {
+        swap16_copy(dst, (const uint16_t*)data + 1, count);
+    }
+
+    record_image_range(vm, name, origin, count);
+    return 1;
+}
+
+int vm_load_image(vm_t* vm, const char* path)
+{
+    return read_image(vm, path);
+}
+
+int vm_load_images(vm_t* vm, const char* const* paths, int count)
+{
+    return read_images(vm, paths, count);
+}
+
+int vm_load_image_from_buffer(vm_t* vm, const void* data, size_t size)
+{
+    return read_image_buffer(vm, "<buffer>", data, size);
+}
+
+void print_image_map(vm_t* vm, FILE* f)
+{
+    for(int i = 0; i < vm->image_count; ++i)
+    {
+        image_range_t* r = &vm->images[i];
+        if(r->length)
+        {
+            fprintf(f, "x%04X-x%04X %6u words  %s\n", r->origin,
+                    (unsigned)(r->origin + r->length - 1), (unsigned)r->length, r->path);
+        }
+        else
+        {
+            fprintf(f, "x%04X       %6u words  %s\n", r->origin, 0u, r->path);
+        }
+    }
+}
+
+void free_image_map(vm_t* vm)
+{
+    for(int i = 0; i < vm->image_count; ++i)
+    {
+        free(vm->images[i].path);
+    }
+    vm->image_count = 0;
+}
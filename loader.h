@@ -0,0 +1,38 @@
+/*
+  Image loading - .obj files are a big-endian origin word followed by
+  big-endian program words.
+*/
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+#define VM_MAX_IMAGES 16
+
+// Address range filled by one image
+typedef struct
+{
+    char* path;
+    uint16_t origin;
+    uint32_t length;   /* words */
+} image_range_t;
+
+struct vm;
+
+uint16_t swap16(uint16_t x);
+void swap16_copy(uint16_t* dst, const uint16_t* src, size_t n);
+
+void record_image_range(struct vm* vm, const char* path, uint16_t origin, uint32_t length);
+void read_image_file(struct vm* vm, FILE* file);
+int read_image(struct vm* vm, const char* image_path);
+int read_images(struct vm* vm, const char* const* paths, int count);
+void predecode_blocks(struct vm* vm, const lc3img_block_t* blocks, size_t count);
+int read_image_buffer(struct vm* vm, const char* name, const void* data, size_t size);
+void print_image_map(struct vm* vm, FILE* f);
+void free_image_map(struct vm* vm);
+
+#endif
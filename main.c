@@ -0,0 +1,425 @@
+/*
+  The lc3 command line tool - a thin wrapper over the machine in libvm.h.
+  Everything but the flags, the terminal and the exit status lives in the
+  library, the other tools (--batch, --debug, ...) are in their own files.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+/* unix */
+#include <unistd.h>
+
+#include <sys/termios.h>
+
+#include "vm.h"
+#include "cpu.h"
+#include "image.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "debug.h"
+#include "metrics.h"
+
+// Set by the makefile, see BUILD_INFO
+#ifndef VM_BUILD_FLAGS
+#define VM_BUILD_FLAGS "unknown"
+#endif
+
+// Machine that owns the terminal, restored on SIGINT
+static vm_t* console_vm = NULL;
+
+void disable_input_buffering(vm_t* vm)
+{
+    if(tcgetattr(STDIN_FILENO, &vm->original_tio) != 0)
+    {
+        return;
+    }
+    vm->tio_saved = 1;
+    struct termios new_tio = vm->original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+void restore_input_buffering(vm_t* vm)
+{
+    if(vm->tio_saved)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &vm->original_tio);
+        vm->tio_saved = 0;
+    }
+}
+
+void handle_interrupt(int signal)
+{
+    if(console_vm)
+    {
+        console_flush(console_vm);
+        restore_input_buffering(console_vm);
+    }
+    printf("\n");
+    exit(-2);
+}
+
+// What this binary was built with, a "name value" line each, so benchmark
+// results can be tied to a build (bench/bench.c records them)
+static int version_main()
+{
+    printf("compiler  %s\n", __VERSION__);
+    printf("build     %s\n", VM_BUILD_FLAGS);
+    printf("engine    %s\n", vm_engine_names[VM_ENGINE_DEFAULT]);
+    printf("options   profile=%d trace=%d fuse=%d\n", VM_PROFILE, VM_TRACE, VM_FUSE);
+    printf("kernels   swap=%s scan=%s%s\n", cpu_swap_kernel(), cpu_scan_kernel(),
+           VM_MULTIVERSION ? " (picked at run time)" : "");
+    return 0;
+}
+
+int main(int argc, const char* argv[]) {
+    // Every mode dumps its metrics to stderr on SIGUSR1, see metrics.h
+    signal(SIGUSR1, metrics_signal);
+
+    if(argc >= 2 && strcmp(argv[1], "--version") == 0)
+    {
+        return version_main();
+    }
+    if(argc >= 2 && strcmp(argv[1], "--batch") == 0)
+    {
+        return batch_main(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "--mkimg") == 0)
+    {
+        return mkimg_main(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "--trace-dump") == 0)
+    {
+        return trace_dump_main(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "--debug") == 0)
+    {
+        return debug_main(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "--diff") == 0)
+    {
+        return diff_main(argc - 2, argv + 2);
+    }
+    if(argc >= 2 && strcmp(argv[1], "--fuzz") == 0)
+    {
+        return fuzz_main(argc - 2, argv + 2);
+    }
+
+    // Load args
+    unsigned flush_ms = 0;
+    int show_map = 0;
+    int fusion_stats = 0;
+    int idle_stats = 0;
+    const char* profile_path = NULL;
+    const char* trace_path = NULL;
+    const char* input_path = NULL;
+    const char* output_path = NULL;
+    const char* snapshot_path = NULL;
+    const char* restore_path = NULL;
+    const char* fanout = NULL;
+    const char* metrics_socket = NULL;
+    int headless = 0;
+    int supervisor = 0;
+    int fast_traps = 0;
+    int guest_traps = 0;
+    uint64_t max_instructions = 0;
+    uint64_t timeout_ms = 0;
+    int first = 1;
+    while(first < argc && strncmp(argv[first], "--", 2) == 0)
+    {
+        if(strcmp(argv[first], "--flush-ms") == 0 && first + 1 < argc)
+        {
+            flush_ms = (unsigned)atoi(argv[first + 1]);
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--map") == 0)
+        {
+            show_map = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--fusion-stats") == 0)
+        {
+            fusion_stats = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--idle-stats") == 0)
+        {
+            idle_stats = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--supervisor") == 0)
+        {
+            supervisor = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--fast-traps") == 0)
+        {
+            fast_traps = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--guest-traps") == 0)
+        {
+            guest_traps = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--headless") == 0)
+        {
+            headless = 1;
+            first += 1;
+        }
+        else if(strcmp(argv[first], "--max-instr") == 0 && first + 1 < argc)
+        {
+            max_instructions = strtoull(argv[first + 1], NULL, 0);
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--timeout-ms") == 0 && first + 1 < argc)
+        {
+            timeout_ms = strtoull(argv[first + 1], NULL, 0);
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--input") == 0 && first + 1 < argc)
+        {
+            input_path = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--output") == 0 && first + 1 < argc)
+        {
+            output_path = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--snapshot") == 0 && first + 1 < argc)
+        {
+            snapshot_path = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--restore") == 0 && first + 1 < argc)
+        {
+            restore_path = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--fanout") == 0 && first + 1 < argc)
+        {
+            fanout = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--metrics-socket") == 0 && first + 1 < argc)
+        {
+            metrics_socket = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--profile") == 0 && first + 1 < argc)
+        {
+            profile_path = argv[first + 1];
+            first += 2;
+        }
+        else if(strcmp(argv[first], "--trace") == 0 && first + 1 < argc)
+        {
+            trace_path = argv[first + 1];
+            first += 2;
+        }
+        else
+        {
+            printf("unknown option: %s\n", argv[first]);
+            return 1;
+        }
+    }
+
+    if (first >= argc && !restore_path)
+    {
+        printf("lc3 --version\n");
+        printf("lc3 [--flush-ms ms] [--supervisor] [--fast-traps] [--guest-traps] [--map] [--fusion-stats] [--idle-stats] [--profile out.json] [--trace out.trc] [image-file1] ...\n");
+        printf("lc3 --headless [--max-instr n] [--timeout-ms ms] [--input file] [--output file] [image-file1] ...\n");
+        printf("lc3 [--restore snap] [--snapshot snap | --fanout input[,input...]] [image-file1] ...\n");
+        printf("lc3 [--metrics-socket path] [image-file1] ...\n");
+        printf("lc3 --batch [-j threads] [-m max-instr] [-t timeout-ms] [-s metrics-socket] [image[,image...]] ...\n");
+        printf("lc3 --mkimg [-e entry] -o out.lc3img [image-file1] ...\n");
+        printf("lc3 --trace-dump [-v] [-p pc] [-a address] trace.trc\n");
+        printf("lc3 --debug [-i input] [-g port] image-file1 ...\n");
+        printf("lc3 --diff [-a engine] [-b engine] [-n interval] [-m max-instr] [-i input | -r seed[,count]] [image-file1] ...\n");
+        printf("lc3 --fuzz [-m max-instr] [-n rounds] [-r seed[,count] | - | corpus-file-or-dir ...]\n");
+    }
+
+    vm_t* vm = vm_create();
+    if(!vm)
+    {
+        printf("failed to allocate vm\n");
+        return 1;
+    }
+    vm->console.flush_ms = flush_ms;
+    metrics_attach(vm, metrics_slot(0));
+    if(metrics_socket && !vm_serve_metrics(metrics_socket))
+    {
+        printf("failed to open metrics socket: %s\n", metrics_socket);
+        vm_destroy(vm);
+        return 1;
+    }
+    // For images that bring their own vector table and RTI to user code
+    if(supervisor)
+    {
+        vm->psr = 0;
+    }
+    if(guest_traps)
+    {
+        vm_set_guest_traps(vm);
+    }
+    if(fast_traps)
+    {
+        vm_set_fast_traps(vm);
+    }
+    vm_set_limits(vm, max_instructions, timeout_ms);
+    if(input_path && !vm_load_input(vm, input_path))
+    {
+        printf("failed to read input: %s\n", input_path);
+        vm_destroy(vm);
+        return 1;
+    }
+    if(output_path && !vm_capture_output(vm))
+    {
+        printf("failed to capture output\n");
+        vm_destroy(vm);
+        return 1;
+    }
+    if(profile_path)
+    {
+#if VM_PROFILE
+        vm->profile = profile_create();
+#else
+        fprintf(stderr, "warning: built without PROFILE=1, --profile ignored\n");
+        profile_path = NULL;
+#endif
+    }
+
+    if(trace_path)
+    {
+#if VM_TRACE
+        vm->trace = trace_open(trace_path);
+        if(!vm->trace)
+        {
+            printf("failed to open trace: %s\n", trace_path);
+            vm_destroy(vm);
+            return 1;
+        }
+#else
+        fprintf(stderr, "warning: built without TRACE=1, --trace ignored\n");
+#endif
+    }
+    // Tracing and profiling are set up first, they keep superinstructions
+    // out of the predecoded code
+    int loaded = vm_load_images(vm, argv + first, argc - first);
+    if(loaded < argc - first)
+    {
+        printf("failed to load image: %s\n", argv[first + loaded]);
+        vm_destroy(vm);
+        return 1;
+    }
+    if(restore_path && !vm_load_snapshot(vm, restore_path))
+    {
+        printf("failed to restore snapshot: %s\n", restore_path);
+        vm_destroy(vm);
+        return 1;
+    }
+    if(show_map)
+    {
+        print_image_map(vm, stderr);
+    }
+
+    // Warm up until the guest first waits for input, then save it or fan
+    // out into one run per input file
+    if(snapshot_path || fanout)
+    {
+        vm_set_stop_on_input(vm, 1);
+        headless = 1;
+    }
+    // Setup
+
+    // Headless runs leave the terminal and SIGINT alone
+    if(!headless)
+    {
+        console_vm = vm;
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering(vm);
+    }
+
+    vm_run(vm, 0);
+
+    // Shutdown VM
+    restore_input_buffering(vm);
+    console_vm = NULL;
+
+    int status = 0;
+    if(vm->trace)
+    {
+        if(!trace_close(vm->trace, vm->reg))
+        {
+            fprintf(stderr, "failed to write trace: %s\n", trace_path);
+            status = 1;
+        }
+        vm->trace = NULL;
+    }
+
+    if(fusion_stats)
+    {
+        print_fusion_stats(vm, stderr);
+    }
+    if(idle_stats)
+    {
+        print_idle_stats(vm, stderr);
+    }
+
+    if(snapshot_path && !vm_save_snapshot(vm, snapshot_path))
+    {
+        printf("failed to write snapshot: %s\n", snapshot_path);
+        status = 1;
+    }
+    else if(fanout && vm->exit_reason == VM_EXIT_INPUT)
+    {
+        status = vm_fanout(vm, fanout);
+    }
+    else if(vm->exit_reason == VM_EXIT_BUDGET)
+    {
+        fprintf(stderr, "stopped: instruction budget used up after %llu instructions\n",
+                (unsigned long long)vm->instructions);
+        status = 2;
+    }
+    else if(vm->exit_reason == VM_EXIT_TIMEOUT)
+    {
+        fprintf(stderr, "stopped: timed out after %llu instructions\n",
+                (unsigned long long)vm->instructions);
+        status = 3;
+    }
+    else if(vm->exit_reason == VM_EXIT_FAULT)
+    {
+        fprintf(stderr, "stopped: illegal instruction x%04X at x%04X\n",
+                vm->memory[vm->reg[R_PC]], vm->reg[R_PC]);
+        status = 5;
+    }
+
+    if(output_path)
+    {
+        size_t len;
+        const char* out = vm_output(vm, &len);
+        FILE* f = fopen(output_path, "wb");
+        if(!f || fwrite(out, 1, len, f) != len)
+        {
+            printf("failed to write output: %s\n", output_path);
+            status = 1;
+        }
+        if(f)
+        {
+            fclose(f);
+        }
+    }
+#if VM_PROFILE
+    if(vm->profile)
+    {
+        profile_report(vm->profile, stderr);
+        if(!profile_write_json(vm->profile, profile_path))
+        {
+            fprintf(stderr, "failed to write profile: %s\n", profile_path);
+        }
+    }
+#endif
+    vm_destroy(vm);
+    return status;
+}
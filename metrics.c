@@ -0,0 +1,311 @@
+/*
+  Run time metrics, see metrics.h
+*/
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+/* unix */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vm.h"
+#include "metrics.h"
+
+static vm_metrics_t slots[METRICS_SLOTS];
+static _Atomic int slot_count;
+
+// Whoever writes the metrics keeps the last sample for the rate gauge,
+// a write that finds it taken (a signal in the middle of a scrape) leaves
+// the gauge out
+static atomic_flag rate_busy = ATOMIC_FLAG_INIT;
+static uint64_t rate_instructions[METRICS_SLOTS];
+static uint64_t rate_ns;
+
+static const struct
+{
+    const char* name;
+    const char* help;
+    size_t offset;
+} counters[] =
+{
+    { "lc3_instructions_total", "Guest instructions retired.", offsetof(vm_metrics_t, instructions) },
+    { "lc3_cycles_total", "Guest cycles of those instructions.", offsetof(vm_metrics_t, cycles) },
+    { "lc3_kbsr_polls_total", "Reads of the keyboard status register.", offsetof(vm_metrics_t, kbsr_polls) },
+    { "lc3_output_bytes_total", "Console output bytes written.", offsetof(vm_metrics_t, output_bytes) },
+    { "lc3_jit_compiles_total", "Blocks compiled to native code.", offsetof(vm_metrics_t, jit_compiles) },
+    { "lc3_jit_invalidations_total", "Native code dropped after a store into it.", offsetof(vm_metrics_t, jit_invalidations) },
+};
+
+// The counters of slot, which then counts as in use
+vm_metrics_t* metrics_slot(int slot)
+{
+    if(slot < 0 || slot >= METRICS_SLOTS)
+    {
+        return NULL;
+    }
+    int count = atomic_load(&slot_count);
+    while(count <= slot && !atomic_compare_exchange_weak(&slot_count, &count, slot + 1))
+    {
+    }
+    return &slots[slot];
+}
+
+int vm_set_metrics_slot(vm_t* vm, int slot)
+{
+    vm_metrics_t* m = metrics_slot(slot);
+    if(!m)
+    {
+        return 0;
+    }
+    metrics_attach(vm, m);
+    return 1;
+}
+
+// Count vm into m from now on, NULL to stop. What the machine ran before
+// is not added.
+void metrics_attach(vm_t* vm, vm_metrics_t* m)
+{
+    metrics_publish(vm);
+    vm->metrics = m;
+    vm->published_instructions = vm->instructions;
+    vm->published_cycles = vm->cycles;
+}
+
+// Add the instructions and cycles run since the last call. A count that
+// went back (a restored snapshot) starts again from there.
+void metrics_publish(vm_t* vm)
+{
+    vm_metrics_t* m = vm->metrics;
+    if(!m)
+    {
+        return;
+    }
+    if(vm->instructions >= vm->published_instructions)
+    {
+        metrics_add(&m->instructions, vm->instructions - vm->published_instructions);
+        metrics_add(&m->cycles, vm->cycles - vm->published_cycles);
+    }
+    vm->published_instructions = vm->instructions;
+    vm->published_cycles = vm->cycles;
+}
+
+// Text goes out through a fixed buffer, formatted by hand so that a signal
+// handler can use it too
+typedef struct
+{
+    int fd;
+    int ok;
+    size_t len;
+    char buf[4096];
+} out_t;
+
+static void out_flush(out_t* o)
+{
+    size_t done = 0;
+    while(o->ok && done < o->len)
+    {
+        ssize_t n = send(o->fd, o->buf + done, o->len - done, MSG_NOSIGNAL);
+        if(n < 0 && errno == ENOTSOCK)
+        {
+            n = write(o->fd, o->buf + done, o->len - done);
+        }
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            o->ok = 0;
+            break;
+        }
+        done += (size_t)n;
+    }
+    o->len = 0;
+}
+
+static void out_str(out_t* o, const char* s)
+{
+    for(; *s; ++s)
+    {
+        if(o->len == sizeof(o->buf))
+        {
+            out_flush(o);
+        }
+        o->buf[o->len++] = *s;
+    }
+}
+
+static void out_u64(out_t* o, uint64_t v)
+{
+    char digits[21];
+    char* p = digits + sizeof(digits);
+    *--p = 0;
+    do
+    {
+        *--p = (char)('0' + v % 10);
+        v /= 10;
+    } while(v);
+    out_str(o, p);
+}
+
+static void out_sample(out_t* o, const char* name, int slot, uint64_t value)
+{
+    out_str(o, name);
+    out_str(o, "{vm=\"");
+    out_u64(o, (uint64_t)slot);
+    out_str(o, "\"} ");
+    out_u64(o, value);
+    out_str(o, "\n");
+}
+
+static void out_family(out_t* o, const char* name, const char* type, const char* help)
+{
+    out_str(o, "# HELP ");
+    out_str(o, name);
+    out_str(o, " ");
+    out_str(o, help);
+    out_str(o, "\n# TYPE ");
+    out_str(o, name);
+    out_str(o, " ");
+    out_str(o, type);
+    out_str(o, "\n");
+}
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Every slot in use in the Prometheus text format. Safe in a signal
+// handler. Returns 0 if fd could not take all of it.
+int vm_write_metrics(int fd)
+{
+    out_t o;
+    o.fd = fd;
+    o.ok = 1;
+    o.len = 0;
+    int count = atomic_load(&slot_count);
+
+    for(size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c)
+    {
+        out_family(&o, counters[c].name, "counter", counters[c].help);
+        for(int s = 0; s < count; ++s)
+        {
+            const _Atomic uint64_t* v = (const _Atomic uint64_t*)((const char*)&slots[s] + counters[c].offset);
+            out_sample(&o, counters[c].name, s, atomic_load_explicit(v, memory_order_relaxed));
+        }
+    }
+
+    out_family(&o, "lc3_traps_total", "counter", "Traps run, by vector.");
+    for(int s = 0; s < count; ++s)
+    {
+        for(int t = 0; t < 256; ++t)
+        {
+            uint64_t n = atomic_load_explicit(&slots[s].traps[t], memory_order_relaxed);
+            if(n)
+            {
+                static const char hex[] = "0123456789abcdef";
+                char vector[5] = { '0', 'x', hex[t >> 4], hex[t & 0xF], 0 };
+                out_str(&o, "lc3_traps_total{vm=\"");
+                out_u64(&o, (uint64_t)s);
+                out_str(&o, "\",vector=\"");
+                out_str(&o, vector);
+                out_str(&o, "\"} ");
+                out_u64(&o, n);
+                out_str(&o, "\n");
+            }
+        }
+    }
+
+    if(!atomic_flag_test_and_set(&rate_busy))
+    {
+        uint64_t ns = now_ns();
+        uint64_t elapsed = ns - rate_ns;
+        out_family(&o, "lc3_instructions_per_second", "gauge",
+                   "Instructions retired per second since the previous scrape.");
+        for(int s = 0; s < count; ++s)
+        {
+            uint64_t n = atomic_load_explicit(&slots[s].instructions, memory_order_relaxed);
+            uint64_t delta = n - rate_instructions[s];
+            out_sample(&o, "lc3_instructions_per_second", s,
+                       rate_ns && elapsed ? (uint64_t)((double)delta * 1e9 / elapsed) : 0);
+            rate_instructions[s] = n;
+        }
+        rate_ns = ns;
+        atomic_flag_clear(&rate_busy);
+    }
+
+    out_flush(&o);
+    return o.ok;
+}
+
+static void* serve_main(void* arg)
+{
+    int fd = (int)(intptr_t)arg;
+    for(;;)
+    {
+        int client = accept(fd, NULL, NULL);
+        if(client < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("metrics: accept");
+            close(fd);
+            return NULL;
+        }
+        vm_write_metrics(client);
+        close(client);
+    }
+}
+
+// Answer every connection to a Unix socket at path with the metrics, from
+// a thread of its own. An old socket file at path is replaced.
+int vm_serve_metrics(const char* path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        return 0;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        return 0;
+    }
+    unlink(path);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 8) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, serve_main, (void*)(intptr_t)fd) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+// SIGUSR1 handler, the metrics go to stderr
+void metrics_signal(int signal)
+{
+    (void)signal;
+    int saved = errno;
+    vm_write_metrics(STDERR_FILENO);
+    errno = saved;
+}
@@ -0,0 +1,64 @@
+/*
+  Run time metrics for long running machines, read while they run.
+
+  Counters live in slots, one per thread that runs machines (the CLI uses
+  slot 0, --batch gives every worker its own). Each slot is padded to
+  cache lines of its own and only the thread running the machine attached
+  to it writes it, with plain relaxed atomic stores, so counting is an add
+  and no two runners ever share a line. Any other thread - or a signal
+  handler - reads the slots without a lock.
+
+  Traps, KBSR polls, console output and JIT compiles and invalidations are
+  counted as they happen. Instructions and cycles are published from
+  vm_check_limits() at least every VM_CHECK_INTERVAL instructions and at
+  the end of every run. A slot keeps counting across the machines attached
+  to it one after another.
+
+  vm_write_metrics() puts every slot in use out in the Prometheus text
+  format without allocating. vm_serve_metrics() answers each connection to
+  a Unix socket with it and main() dumps it to stderr on SIGUSR1:
+
+    lc3 --metrics-socket /tmp/lc3.sock image.obj &
+    socat - UNIX-CONNECT:/tmp/lc3.sock
+    kill -USR1 %1
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define METRICS_SLOTS 256
+#define METRICS_LINE 64
+
+typedef struct vm_metrics
+{
+    _Alignas(METRICS_LINE) _Atomic uint64_t instructions;
+    _Atomic uint64_t cycles;
+    _Atomic uint64_t kbsr_polls;
+    _Atomic uint64_t output_bytes;
+    _Atomic uint64_t jit_compiles;
+    _Atomic uint64_t jit_invalidations;
+    _Atomic uint64_t traps[256];   /* by vector */
+} vm_metrics_t;
+
+_Static_assert(sizeof(vm_metrics_t) % METRICS_LINE == 0, "slots are padded to whole cache lines");
+
+struct vm;
+
+// Only the thread the counter belongs to adds, so no locked add is needed
+static inline void metrics_add(_Atomic uint64_t* counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+#define METRIC_ADD(vm, field, n) \
+    do { vm_metrics_t* m_ = (vm)->metrics; if(m_) { metrics_add(&m_->field, (n)); } } while(0)
+
+vm_metrics_t* metrics_slot(int slot);
+void metrics_attach(struct vm* vm, vm_metrics_t* m);
+void metrics_publish(struct vm* vm);
+void metrics_signal(int signal);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+  Instruction level profiler, see profile.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+
+// Top entries shown per table in the text report, the JSON has all of them
+#define PROFILE_TOP 20
+
+static const char* op_names[16] =
+{
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+static const char* trap_name(int vector)
+{
+    switch(vector)
+    {
+        case 0x20: return "GETC";
+        case 0x21: return "OUT";
+        case 0x22: return "PUTS";
+        case 0x23: return "IN";
+        case 0x24: return "PUTSP";
+        case 0x25: return "HALT";
+        case 0x26: return "MEMCPY";
+        case 0x27: return "MEMSET";
+        case 0x28: return "MUL";
+        case 0x29: return "DIV";
+        case 0x2A: return "PUTN";
+        default: return "?";
+    }
+}
+
+typedef struct
+{
+    uint32_t key;
+    uint64_t count;
+} profile_entry_t;
+
+static int by_count_desc(const void* a, const void* b)
+{
+    const profile_entry_t* x = a;
+    const profile_entry_t* y = b;
+    if(x->count != y->count)
+    {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Non-zero counts sorted highest first, caller frees
+static profile_entry_t* sorted(const uint64_t* counts, const uint64_t* extra, size_t n, size_t* out_len)
+{
+    profile_entry_t* e = malloc(n * sizeof(profile_entry_t));
+    size_t len = 0;
+    if(!e)
+    {
+        *out_len = 0;
+        return NULL;
+    }
+    for(size_t i = 0; i < n; ++i)
+    {
+        uint64_t c = counts[i] + (extra ? extra[i] : 0);
+        if(c)
+        {
+            e[len].key = (uint32_t)i;
+            e[len].count = c;
+            ++len;
+        }
+    }
+    qsort(e, len, sizeof(profile_entry_t), by_count_desc);
+    *out_len = len;
+    return e;
+}
+
+profile_t* profile_create()
+{
+    return calloc(1, sizeof(profile_t));
+}
+
+void profile_destroy(profile_t* p)
+{
+    free(p);
+}
+
+// Timestamp counter where there is one, nanoseconds otherwise
+uint64_t profile_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static double percent(uint64_t n, uint64_t total)
+{
+    return total ? 100.0 * n / total : 0.0;
+}
+
+void profile_report(const profile_t* p, FILE* out)
+{
+    size_t len;
+    profile_entry_t* e;
+
+    fprintf(out, "\n--- profile: %llu instructions, %llu guest cycles ---\n",
+            (unsigned long long)p->instructions, (unsigned long long)p->guest_cycles);
+
+    fprintf(out, "\nopcode        count      %%\n");
+    e = sorted(p->ops, NULL, 16, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        fprintf(out, "%-6s %12llu %6.2f\n", op_names[e[i].key],
+                (unsigned long long)e[i].count, percent(e[i].count, p->instructions));
+    }
+    free(e);
+
+    fprintf(out, "\nhot pc        count      %%\n");
+    e = sorted(p->pc_hits, NULL, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len && i < PROFILE_TOP; ++i)
+    {
+        fprintf(out, "x%04X  %12llu %6.2f\n", e[i].key,
+                (unsigned long long)e[i].count, percent(e[i].count, p->instructions));
+    }
+    free(e);
+
+    fprintf(out, "\nhot block  len        count       cycles      %%\n");
+    e = sorted(p->block_cycles, NULL, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len && i < PROFILE_TOP; ++i)
+    {
+        fprintf(out, "x%04X  %5u %12llu %12llu %6.2f\n", e[i].key, p->block_len[e[i].key],
+                (unsigned long long)p->block_hits[e[i].key], (unsigned long long)e[i].count,
+                percent(e[i].count, p->guest_cycles));
+    }
+    free(e);
+
+    fprintf(out, "\ntrap          count  host cycles    cycles/call\n");
+    e = sorted(p->trap_count, NULL, 256, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        uint64_t cycles = p->trap_cycles[e[i].key];
+        fprintf(out, "x%02X %-5s %9llu %12llu %14llu\n", e[i].key, trap_name(e[i].key),
+                (unsigned long long)e[i].count, (unsigned long long)cycles,
+                (unsigned long long)(cycles / e[i].count));
+    }
+    free(e);
+
+    fprintf(out, "\nbranch     executed    taken %%\n");
+    e = sorted(p->br_taken, p->br_not_taken, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len && i < PROFILE_TOP; ++i)
+    {
+        fprintf(out, "x%04X  %12llu %8.2f\n", e[i].key, (unsigned long long)e[i].count,
+                percent(p->br_taken[e[i].key], e[i].count));
+    }
+    free(e);
+}
+
+int profile_write_json(const profile_t* p, const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if(!f)
+    {
+        return 0;
+    }
+
+    size_t len;
+    profile_entry_t* e;
+
+    fprintf(f, "{\n  \"instructions\": %llu,\n  \"guest_cycles\": %llu,\n  \"opcodes\": {",
+            (unsigned long long)p->instructions, (unsigned long long)p->guest_cycles);
+    for(int i = 0; i < 16; ++i)
+    {
+        fprintf(f, "%s\"%s\": %llu", i ? ", " : "", op_names[i], (unsigned long long)p->ops[i]);
+    }
+
+    fprintf(f, "},\n  \"pcs\": [");
+    e = sorted(p->pc_hits, NULL, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        fprintf(f, "%s\n    {\"pc\": %u, \"count\": %llu}", i ? "," : "",
+                e[i].key, (unsigned long long)e[i].count);
+    }
+    free(e);
+
+    fprintf(f, "\n  ],\n  \"blocks\": [");
+    e = sorted(p->block_cycles, NULL, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        fprintf(f, "%s\n    {\"pc\": %u, \"len\": %u, \"count\": %llu, \"cycles\": %llu}", i ? "," : "",
+                e[i].key, p->block_len[e[i].key], (unsigned long long)p->block_hits[e[i].key],
+                (unsigned long long)e[i].count);
+    }
+    free(e);
+
+    fprintf(f, "\n  ],\n  \"traps\": [");
+    e = sorted(p->trap_count, NULL, 256, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        fprintf(f, "%s\n    {\"vector\": %u, \"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+                i ? "," : "", e[i].key, trap_name(e[i].key), (unsigned long long)e[i].count,
+                (unsigned long long)p->trap_cycles[e[i].key]);
+    }
+    free(e);
+
+    fprintf(f, "\n  ],\n  \"branches\": [");
+    e = sorted(p->br_taken, p->br_not_taken, UINT16_MAX + 1, &len);
+    for(size_t i = 0; i < len; ++i)
+    {
+        fprintf(f, "%s\n    {\"pc\": %u, \"taken\": %llu, \"not_taken\": %llu}", i ? "," : "",
+                e[i].key, (unsigned long long)p->br_taken[e[i].key],
+                (unsigned long long)p->br_not_taken[e[i].key]);
+    }
+    free(e);
+
+    fprintf(f, "\n  ]\n}\n");
+    return fclose(f) == 0;
+}
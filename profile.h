@@ -0,0 +1,75 @@
+/*
+  Instruction level profiler. Build with PROFILE=1 (-DVM_PROFILE=1) and
+  run with --profile out.json to record per-opcode counts, per-PC
+  execution counts, branch taken/not-taken counts, the basic blocks with
+  their length and guest cycles (see vm_op_cycles) and the number of host
+  cycles spent in each trap routine. A sorted text report goes to stderr
+  at exit and the same data is written to the JSON file.
+
+  When VM_PROFILE is 0 the PROFILE_* hooks expand to nothing.
+*/
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef VM_PROFILE
+#define VM_PROFILE 0
+#endif
+
+typedef struct profile
+{
+    uint64_t instructions;
+    uint64_t ops[16];
+
+    uint64_t pc_hits[UINT16_MAX + 1];
+    uint64_t br_taken[UINT16_MAX + 1];
+    uint64_t br_not_taken[UINT16_MAX + 1];
+
+    // Basic blocks by start address, the length is the last one seen
+    uint64_t guest_cycles;
+    uint64_t block_hits[UINT16_MAX + 1];
+    uint64_t block_cycles[UINT16_MAX + 1];
+    uint16_t block_len[UINT16_MAX + 1];
+
+    uint64_t trap_count[256];
+    uint64_t trap_cycles[256];
+} profile_t;
+
+struct vm;
+
+profile_t* profile_create();
+void profile_destroy(profile_t* p);
+uint64_t profile_clock();
+void profile_report(const profile_t* p, FILE* out);
+int profile_write_json(const profile_t* p, const char* path);
+
+#if VM_PROFILE
+
+#define PROFILE_INSTR(vm, pc, instr) \
+    do { profile_t* p_ = (vm)->profile; if(p_) { ++p_->instructions; ++p_->ops[(instr) >> 12]; ++p_->pc_hits[(uint16_t)(pc)]; } } while(0)
+
+#define PROFILE_BRANCH(vm, pc, taken) \
+    do { profile_t* p_ = (vm)->profile; if(p_) { if(taken) ++p_->br_taken[(uint16_t)(pc)]; else ++p_->br_not_taken[(uint16_t)(pc)]; } } while(0)
+
+#define PROFILE_BLOCK(vm, start, len, cycles) \
+    do { profile_t* p_ = (vm)->profile; if(p_ && (len)) { p_->guest_cycles += (cycles); ++p_->block_hits[(uint16_t)(start)]; p_->block_cycles[(uint16_t)(start)] += (cycles); p_->block_len[(uint16_t)(start)] = (len); } } while(0)
+
+#define PROFILE_TRAP_BEGIN(vm) \
+    uint64_t profile_start_ = (vm)->profile ? profile_clock() : 0
+
+#define PROFILE_TRAP_END(vm, vector) \
+    do { profile_t* p_ = (vm)->profile; if(p_) { ++p_->trap_count[(vector) & 0xFF]; p_->trap_cycles[(vector) & 0xFF] += profile_clock() - profile_start_; } } while(0)
+
+#else
+
+#define PROFILE_INSTR(vm, pc, instr) ((void)0)
+#define PROFILE_BRANCH(vm, pc, taken) ((void)0)
+#define PROFILE_BLOCK(vm, start, len, cycles) ((void)0)
+#define PROFILE_TRAP_BEGIN(vm) ((void)0)
+#define PROFILE_TRAP_END(vm, vector) ((void)0)
+
+#endif
+
+#endif
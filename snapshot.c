@@ -0,0 +1,325 @@
+/*
+  Machine snapshots, see snapshot.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+/* unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "image.h"
+#include "snapshot.h"
+#include "interrupt.h"
+
+#define PAGE_WORDS (1 << VM_PAGE_SHIFT)
+
+static int page_is_zero(const uint16_t* words, size_t n)
+{
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(words[i])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Memory changed underneath the machine, drop what was derived from it
+static void invalidate_page(vm_t* vm, int page)
+{
+    size_t base = (size_t)page << VM_PAGE_SHIFT;
+    invalidate_decode(vm, base, base + PAGE_WORDS);
+}
+
+static void invalidate_code(vm_t* vm)
+{
+#if VM_JIT
+    if(vm->jit)
+    {
+        jit_flush(vm->jit);
+    }
+#else
+    (void)vm;
+#endif
+}
+
+int vm_save_snapshot(vm_t* vm, const char* path)
+{
+    lc3snp_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LC3SNP_MAGIC, 6);
+    h.byte_order = LC3IMG_BYTE_ORDER;
+    h.version = LC3SNP_VERSION;
+    memcpy(h.reg, vm->reg, sizeof(h.reg));
+    h.reg[R_COND] = vm_cond(vm);  /* files hold the flags, not the last result */
+    h.psr = vm->psr;
+    h.saved_ssp = vm->saved_ssp;
+    h.saved_usp = vm->saved_usp;
+    h.instructions = vm->instructions;
+    h.cycles = vm->cycles;
+    h.hash = FNV_OFFSET;
+
+    for(int p = 0; p < VM_PAGE_COUNT; ++p)
+    {
+        const uint16_t* words = vm->memory + ((size_t)p << VM_PAGE_SHIFT);
+        if(!page_is_zero(words, PAGE_WORDS))
+        {
+            h.pages[p / 8] |= 1 << (p % 8);
+            h.hash = fnv1a(h.hash, words, PAGE_WORDS * sizeof(uint16_t));
+            ++h.page_count;
+        }
+    }
+
+    FILE* f = fopen(path, "wb");
+    if(!f)
+    {
+        return 0;
+    }
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for(int p = 0; ok && p < VM_PAGE_COUNT; ++p)
+    {
+        if(h.pages[p / 8] & (1 << (p % 8)))
+        {
+            size_t n = PAGE_WORDS;
+            ok = fwrite(vm->memory + ((size_t)p << VM_PAGE_SHIFT), sizeof(uint16_t), n, f) == n;
+        }
+    }
+    ok = fclose(f) == 0 && ok;
+    return ok;
+}
+
+int vm_load_snapshot(vm_t* vm, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f)
+    {
+        return 0;
+    }
+
+    lc3snp_header_t h;
+    if(fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, LC3SNP_MAGIC, 6) != 0)
+    {
+        fprintf(stderr, "%s: not a snapshot\n", path);
+        fclose(f);
+        return 0;
+    }
+    if(h.byte_order != LC3IMG_BYTE_ORDER || h.version != LC3SNP_VERSION)
+    {
+        fprintf(stderr, "%s: snapshot was written for another host or version\n", path);
+        fclose(f);
+        return 0;
+    }
+
+    // Read into a scratch copy so a bad file leaves the machine untouched
+    uint16_t* memory = calloc(1, sizeof(vm->memory));
+    if(!memory)
+    {
+        fclose(f);
+        return 0;
+    }
+    uint64_t hash = FNV_OFFSET;
+    int pages = 0;
+    for(int p = 0; p < VM_PAGE_COUNT; ++p)
+    {
+        if(h.pages[p / 8] & (1 << (p % 8)))
+        {
+            uint16_t* words = memory + ((size_t)p << VM_PAGE_SHIFT);
+            size_t n = PAGE_WORDS;
+            if(fread(words, sizeof(uint16_t), n, f) != n)
+            {
+                fprintf(stderr, "%s: snapshot is truncated\n", path);
+                free(memory);
+                fclose(f);
+                return 0;
+            }
+            hash = fnv1a(hash, words, n * sizeof(uint16_t));
+            ++pages;
+        }
+    }
+    fclose(f);
+
+    if(pages != h.page_count || hash != h.hash)
+    {
+        fprintf(stderr, "%s: checksum mismatch\n", path);
+        free(memory);
+        return 0;
+    }
+
+    memcpy(vm->memory, memory, sizeof(vm->memory));
+    free(memory);
+    memcpy(vm->reg, h.reg, sizeof(vm->reg));
+    vm_set_cond(vm, h.reg[R_COND]);
+    vm->psr = h.psr & PSR_MASK;
+    vm->saved_ssp = h.saved_ssp;
+    vm->saved_usp = h.saved_usp;
+    vm->instructions = h.instructions;
+    vm->cycles = h.cycles;
+    timer_set(&vm->timer, vm->memory[MR_TMI]);
+    interrupt_raise(vm);
+    memset(vm->decode_cache, 0, sizeof(vm->decode_cache));
+    memset(vm->blocks, 0, sizeof(vm->blocks));
+    memset(vm->block_map, 0, sizeof(vm->block_map));
+    invalidate_code(vm);
+    vm->dirty_base = NULL;
+    return 1;
+}
+
+vm_snapshot_t* vm_snapshot(vm_t* vm)
+{
+    vm_snapshot_t* snap = malloc(sizeof(vm_snapshot_t));
+    if(!snap)
+    {
+        return NULL;
+    }
+    vm->dirty_base = NULL;
+    vm_snapshot_update(vm, snap);
+    return snap;
+}
+
+// Bring snap up to the machine's state, a snapshot the machine was last
+// taken from or restored to only needs its dirty pages copied
+void vm_snapshot_update(vm_t* vm, vm_snapshot_t* snap)
+{
+    int dirty_only = vm->dirty_base == snap;
+    for(int p = 0; p < VM_PAGE_COUNT; ++p)
+    {
+        if(!dirty_only || vm->dirty_page[p])
+        {
+            size_t base = (size_t)p << VM_PAGE_SHIFT;
+            memcpy(snap->memory + base, vm->memory + base, PAGE_WORDS * sizeof(uint16_t));
+        }
+    }
+    memcpy(snap->reg, vm->reg, sizeof(snap->reg));
+    snap->psr = vm->psr;
+    snap->saved_ssp = vm->saved_ssp;
+    snap->saved_usp = vm->saved_usp;
+    snap->instructions = vm->instructions;
+    snap->cycles = vm->cycles;
+    memset(vm->dirty_page, 0, sizeof(vm->dirty_page));
+    vm->dirty_base = snap;
+}
+
+// Only pages written since the snapshot are copied back and lose their
+// decoded instructions, the rest of the decode cache stays warm. Going
+// back to the snapshot the machine was last taken from or restored to only
+// looks at the dirty pages, any other snapshot compares every page.
+void vm_restore(vm_t* vm, const vm_snapshot_t* snap)
+{
+    int changed = 0;
+    int dirty_only = vm->dirty_base == snap;
+    for(int p = 0; p < VM_PAGE_COUNT; ++p)
+    {
+        if(dirty_only && !vm->dirty_page[p])
+        {
+            continue;
+        }
+        size_t base = (size_t)p << VM_PAGE_SHIFT;
+        size_t n = PAGE_WORDS * sizeof(uint16_t);
+        if(memcmp(vm->memory + base, snap->memory + base, n) != 0)
+        {
+            memcpy(vm->memory + base, snap->memory + base, n);
+            invalidate_page(vm, p);
+            changed = 1;
+        }
+    }
+    if(changed)
+    {
+        invalidate_code(vm);
+    }
+    memset(vm->dirty_page, 0, sizeof(vm->dirty_page));
+    vm->dirty_base = snap;
+    memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+    vm->psr = snap->psr;
+    vm->saved_ssp = snap->saved_ssp;
+    vm->saved_usp = snap->saved_usp;
+    vm->instructions = snap->instructions;
+    vm->cycles = snap->cycles;
+    timer_set(&vm->timer, vm->memory[MR_TMI]);
+    interrupt_raise(vm);
+}
+
+void vm_snapshot_free(vm_snapshot_t* snap)
+{
+    free(snap);
+}
+
+// Run one scenario in a forked child, output goes to <input>.out
+static int run_scenario(vm_t* vm, const char* input)
+{
+    char out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s.out", input);
+
+    // The reader and timer threads do not exist in the child
+    keyboard_forget(&vm->keyboard);
+    timer_forget(&vm->timer);
+    timer_set(&vm->timer, vm->memory[MR_TMI]);
+    vm->in = NULL;
+    vm->stop_on_input = 0;
+    if(!vm_load_input(vm, input))
+    {
+        fprintf(stderr, "failed to read input: %s\n", input);
+        return 1;
+    }
+
+    FILE* out = fopen(out_path, "wb");
+    if(!out)
+    {
+        fprintf(stderr, "failed to write output: %s\n", out_path);
+        return 1;
+    }
+    vm->out = out;
+    vm_run(vm, 0);
+    fclose(out);
+    return vm->exit_reason == VM_EXIT_HALT ? 0 : 2 + vm->exit_reason - VM_EXIT_BUDGET;
+}
+
+// Fork the machine once for every comma separated input file and run each
+// copy to the end. Memory is shared copy-on-write until a child writes it.
+// Returns 0 if every scenario halted.
+int vm_fanout(vm_t* vm, const char* inputs)
+{
+    console_flush(vm);
+    fflush(NULL);
+
+    char* list = strdup(inputs);
+    char* save = NULL;
+    int count = 0;
+    pid_t pids[256];
+    const char* names[256];
+
+    for(char* in = strtok_r(list, ",", &save); in && count < 256; in = strtok_r(NULL, ",", &save))
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            _exit(run_scenario(vm, in));
+        }
+        if(pid < 0)
+        {
+            perror("fork");
+            break;
+        }
+        pids[count] = pid;
+        names[count] = in;
+        ++count;
+    }
+
+    int status = 0;
+    for(int i = 0; i < count; ++i)
+    {
+        int child = 0;
+        waitpid(pids[i], &child, 0);
+        int code = WIFEXITED(child) ? WEXITSTATUS(child) : 1;
+        fprintf(stderr, "%s: %s\n", names[i],
+                code == 0 ? "halted" : code == 2 ? "instruction budget used up" :
+                code == 3 ? "timed out" : "failed");
+        status |= code != 0;
+    }
+    free(list);
+    return status;
+}
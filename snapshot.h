@@ -0,0 +1,70 @@
+/*
+  Machine snapshots.
+
+  A snapshot file holds the registers, the PSR and the stack pointers
+  kept aside for each mode, the instruction and cycle counts and every non-zero 256
+  word page of memory; device registers live in memory so they come along
+  with it, and a running timer starts again with the interval in TMI. Like
+  .lc3img it is written in host byte order.
+
+    header        lc3snp_header_t
+    pages         page_count x 256 host-endian words, in page order
+
+  The hash is FNV-1a over the page words.
+
+  In process, vm_snapshot() keeps a full copy of a machine that
+  vm_restore() puts back by copying only the pages that changed since, and
+  vm_fanout() forks a warmed up machine once per input file so each
+  scenario starts from copy-on-write memory. The machine remembers the
+  snapshot it last matched and its dirty page map says what changed since,
+  so going back there only looks at dirty pages. Free a snapshot only once
+  no machine will be restored to it again.
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "vm.h"
+
+#define LC3SNP_MAGIC "LC3SNP"
+#define LC3SNP_VERSION 4
+
+typedef struct
+{
+    char magic[6];                       /* LC3SNP */
+    uint16_t byte_order;                 /* LC3IMG_BYTE_ORDER as written by the host */
+    uint32_t version;
+    uint16_t reg[R_COUNT];
+    uint16_t psr;                        /* mode and priority, N/Z/P are in reg */
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    uint16_t page_count;
+    uint8_t pages[VM_PAGE_COUNT / 8];    /* bit set for each page stored */
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t hash;
+} lc3snp_header_t;
+
+typedef struct
+{
+    uint16_t memory[VM_MEMORY_WORDS];
+    uint16_t reg[R_COUNT];
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    uint64_t instructions;
+    uint64_t cycles;
+} vm_snapshot_t;
+
+int vm_save_snapshot(vm_t* vm, const char* path);
+int vm_load_snapshot(vm_t* vm, const char* path);
+
+vm_snapshot_t* vm_snapshot(vm_t* vm);
+void vm_snapshot_update(vm_t* vm, vm_snapshot_t* snap);
+void vm_restore(vm_t* vm, const vm_snapshot_t* snap);
+void vm_snapshot_free(vm_snapshot_t* snap);
+
+int vm_fanout(vm_t* vm, const char* inputs);
+
+#endif
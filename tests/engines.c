@@ -0,0 +1,57 @@
+/*
+  Regression checks that drive machines through the library on every
+  engine this build has, run by make test.
+*/
+#include <stdio.h>
+
+#include "vm.h"
+
+static int failed;
+
+static void check(int ok, const char* engine, const char* what)
+{
+    if(!ok)
+    {
+        printf("FAIL: %s: %s\n", engine, what);
+        failed = 1;
+    }
+}
+
+int main()
+{
+    // x3000: ADD R0, R0, #1 / BRnzp x3000
+    static const uint8_t loop[] = { 0x30, 0x00, 0x10, 0x21, 0x0F, 0xFE };
+
+    for(int e = 0; e < VM_ENGINE_COUNT; ++e)
+    {
+        if(!vm_has_engine(e))
+        {
+            continue;
+        }
+        const char* name = vm_engine_names[e];
+        vm_t* vm = vm_create();
+        if(!vm || !vm_load_image_from_buffer(vm, loop, sizeof(loop)))
+        {
+            check(0, name, "machine setup");
+            vm_destroy(vm);
+            continue;
+        }
+
+        // Once the budget is used up, running again does nothing
+        vm_set_limits(vm, 10, 0);
+        vm_run_engine(vm, e);
+        check(vm->exit_reason == VM_EXIT_BUDGET, name, "first run stops for the budget");
+        uint64_t instructions = vm->instructions;
+        uint16_t r0 = vm->reg[R_R0];
+        for(int i = 0; i < 2; ++i)
+        {
+            vm_run_engine(vm, e);
+            check(vm->exit_reason == VM_EXIT_BUDGET, name, "rerun stops for the budget");
+            check(vm->instructions == instructions && vm->reg[R_R0] == r0, name,
+                  "rerun past the budget runs no instructions");
+        }
+        vm_destroy(vm);
+    }
+
+    return failed;
+}
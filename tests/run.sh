@@ -0,0 +1,45 @@
+#!/bin/sh
+# Regression checks for the command line tool, run by make test against
+# ./vm (or the binary given as $1). Images are written here as raw .obj
+# words so the checks need nothing but the vm itself.
+VM=${1:-./vm}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+FAILED=0
+
+fail()
+{
+    echo "FAIL: $1"
+    FAILED=1
+}
+
+# LEA R0, MSG / PUTS / HALT / MSG .STRINGZ "hi"
+printf '\060\000\340\002\360\042\360\045\000\150\000\151\000\000' > "$DIR/hi.obj"
+
+# An image read through a pipe, which has no size and can't be mapped
+out=$(cat "$DIR/hi.obj" | "$VM" --headless /dev/stdin)
+[ "$out" = "hiHALT" ] || fail "image from a pipe: '$out'"
+mkfifo "$DIR/fifo"
+cat "$DIR/hi.obj" > "$DIR/fifo" &
+out=$("$VM" --headless "$DIR/fifo" < /dev/null)
+[ "$out" = "hiHALT" ] || fail "image from a FIFO: '$out'"
+wait
+
+# HALT as the last instruction the budget allows, and at every check
+# boundary the diff harness steps through
+out=$("$VM" --headless --max-instr 3 "$DIR/hi.obj" 2>&1)
+status=$?
+[ $status = 0 ] && [ "$out" = "hiHALT" ] || fail "HALT on the budget: rc=$status '$out'"
+for n in 1 2 3; do
+    timeout 10 "$VM" --diff -a switch -b switch -n $n "$DIR/hi.obj" > /dev/null || fail "diff -n $n past HALT"
+done
+
+# A native image with its entry PC changed after it was written
+"$VM" --mkimg -o "$DIR/hi.lc3img" "$DIR/hi.obj" > /dev/null
+out=$("$VM" --headless "$DIR/hi.lc3img" < /dev/null)
+[ "$out" = "hiHALT" ] || fail "native image: '$out'"
+printf '\001' | dd of="$DIR/hi.lc3img" bs=1 seek=12 conv=notrunc 2> /dev/null
+"$VM" --headless "$DIR/hi.lc3img" < /dev/null > /dev/null 2>&1 && fail "native image with a changed entry loaded"
+
+[ $FAILED = 0 ] && echo "all tests passed"
+exit $FAILED
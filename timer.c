@@ -0,0 +1,117 @@
+/*
+  Interval timer device, see timer.h
+*/
+#include <errno.h>
+#include <time.h>
+
+#include "timer.h"
+
+static void add_ms(struct timespec* ts, unsigned ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if(ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int before(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void* timer_main(void* arg)
+{
+    vm_timer_t* t = arg;
+    struct timespec next, now;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    add_ms(&next, t->interval_ms);
+
+    pthread_mutex_lock(&t->lock);
+    while(!t->stop)
+    {
+        if(pthread_cond_timedwait(&t->cond, &t->lock, &next) != ETIMEDOUT)
+        {
+            continue;
+        }
+        atomic_store(&t->expired, 1);
+        atomic_store(t->irq, 1);
+
+        // Ticks missed while the host was busy are dropped, not caught up
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        do
+        {
+            add_ms(&next, t->interval_ms);
+        } while(before(&next, &now));
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// Restart the timer with a new interval, 0 stops it. Setting the interval
+// it already runs with changes nothing.
+int timer_set(vm_timer_t* t, unsigned interval_ms)
+{
+    if(interval_ms == t->interval_ms && (t->started || !interval_ms))
+    {
+        return 1;
+    }
+    timer_stop(t);
+    if(!interval_ms)
+    {
+        return 1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&t->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&t->lock, NULL);
+    t->stop = 0;
+    t->interval_ms = interval_ms;
+
+    if(pthread_create(&t->thread, NULL, timer_main, t) != 0)
+    {
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+        t->interval_ms = 0;
+        return 0;
+    }
+    t->started = 1;
+    return 1;
+}
+
+void timer_stop(vm_timer_t* t)
+{
+    t->interval_ms = 0;
+    atomic_store(&t->expired, 0);
+    if(!t->started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    t->started = 0;
+}
+
+// In a forked child the thread is gone, drop it without joining
+void timer_forget(vm_timer_t* t)
+{
+    t->started = 0;
+    t->interval_ms = 0;
+}
+
+// Has an interval passed since the last call?
+int timer_expired(vm_timer_t* t)
+{
+    return atomic_exchange(&t->expired, 0);
+}
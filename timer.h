@@ -0,0 +1,32 @@
+/*
+  Interval timer device. Setting an interval starts a thread that marks
+  the timer expired every interval_ms and sets the machine's interrupt
+  flag, so a guest with timer interrupts enabled is interrupted at the next
+  basic block end (see interrupt.h). The machine never waits on it.
+*/
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+typedef struct
+{
+    _Atomic int expired;        /* set by the thread, cleared by timer_expired() */
+    _Atomic int* irq;           /* vm->irq */
+
+    unsigned interval_ms;       /* 0 while stopped */
+    int started;
+    int stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled to stop the thread */
+} vm_timer_t;
+
+int timer_set(vm_timer_t* t, unsigned interval_ms);
+void timer_stop(vm_timer_t* t);
+void timer_forget(vm_timer_t* t);
+int timer_expired(vm_timer_t* t);
+
+#endif
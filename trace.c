@@ -0,0 +1,579 @@
+/*
+  Execution trace recorder, see trace.h
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include "vm.h"
+#include "image.h"
+#include "trace.h"
+
+// Encoded bytes collected before each fwrite
+#define TRACE_BUFFER_SIZE (256 * 1024)
+
+static const char* op_names[16] =
+{
+    "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+    "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"
+};
+
+// What the writer and the reader both remember, so each record only has to
+// say what changed
+typedef struct trace_codec
+{
+    uint16_t pc;                     /* last step */
+    uint16_t address;                /* last memory write */
+    uint16_t reg[8];
+    uint32_t instr[UINT16_MAX + 1];  /* last word run at each pc, ~0 if none */
+} trace_codec_t;
+
+static trace_codec_t* codec_create()
+{
+    trace_codec_t* c = malloc(sizeof(trace_codec_t));
+    if(c)
+    {
+        memset(c, 0, sizeof(*c));
+        memset(c->instr, 0xFF, sizeof(c->instr));
+        c->pc = 0xFFFF;
+    }
+    return c;
+}
+
+static uint16_t zigzag(uint16_t from, uint16_t to)
+{
+    int16_t d = (int16_t)(uint16_t)(to - from);
+    return (uint16_t)((d << 1) ^ (d >> 15));
+}
+
+static uint16_t unzigzag(uint16_t from, uint16_t z)
+{
+    return from + (uint16_t)((z >> 1) ^ -(z & 1));
+}
+
+static size_t put_varint(uint8_t* out, uint16_t v)
+{
+    size_t n = 0;
+    while(v >= 0x80)
+    {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t encode_reg(trace_codec_t* c, uint16_t r, uint16_t value, uint8_t* out)
+{
+    out[0] = TRACE_REG | (r << 2);
+    size_t n = 1 + put_varint(out + 1, zigzag(c->reg[r], value));
+    c->reg[r] = value;
+    return n;
+}
+
+// At most 10 bytes, a step with its register change
+static size_t encode(trace_codec_t* c, const trace_event_t* e, uint8_t* out)
+{
+    size_t n = 1;
+    switch(e->kind)
+    {
+        case TRACE_STEP:
+        {
+            uint8_t* start = out;
+            if(e->reg != TRACE_NO_REG)
+            {
+                out += encode_reg(c, e->reg, e->value, out);
+            }
+            uint8_t tag = TRACE_STEP;
+            if(e->a == (uint16_t)(c->pc + 1))
+            {
+                tag |= 1 << 2;
+            }
+            else
+            {
+                n += put_varint(out + n, zigzag(c->pc + 1, e->a));
+            }
+            if(c->instr[e->a] == e->b)
+            {
+                tag |= 1 << 3;
+            }
+            else
+            {
+                n += put_varint(out + n, e->b);
+                c->instr[e->a] = e->b;
+            }
+            c->pc = e->a;
+            out[0] = tag;
+            return (size_t)(out - start) + n;
+        }
+        case TRACE_REG:
+            return encode_reg(c, e->a, e->b, out);
+        case TRACE_MEM:
+            out[0] = TRACE_MEM;
+            n += put_varint(out + n, zigzag(c->address, e->a));
+            n += put_varint(out + n, e->b);
+            c->address = e->a;
+            break;
+        default:
+            out[0] = TRACE_END;
+            break;
+    }
+    return n;
+}
+
+static void flush_buffer(trace_t* t)
+{
+    if(t->buf_len && fwrite(t->buf, 1, t->buf_len, t->f) != t->buf_len)
+    {
+        t->failed = 1;
+    }
+    t->buf_len = 0;
+}
+
+// Nothing to write, wait for the machine to fill the ring or for a while
+// to pass, whichever comes first
+static void writer_idle(trace_t* t, uint32_t tail)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += TRACE_IDLE_MS * 1000000L;
+    if(until.tv_nsec >= 1000000000L)
+    {
+        until.tv_nsec -= 1000000000L;
+        ++until.tv_sec;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    atomic_store(&t->sleeping, 1);
+    if(atomic_load(&t->head) == tail)
+    {
+        pthread_cond_timedwait(&t->cond, &t->lock, &until);
+    }
+    atomic_store(&t->sleeping, 0);
+    pthread_mutex_unlock(&t->lock);
+}
+
+// Drains the ring until it has written the TRACE_END trace_close() pushes
+static void* trace_writer(void* arg)
+{
+    trace_t* t = arg;
+    uint32_t tail = 0;
+
+    for(;;)
+    {
+        uint32_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        if(tail == head)
+        {
+            writer_idle(t, tail);
+            continue;
+        }
+
+        int done = 0;
+        for(; tail != head && !done; ++tail)
+        {
+            const trace_event_t* e = &t->ring[tail & (TRACE_RING_SIZE - 1)];
+            if(t->buf_len > TRACE_BUFFER_SIZE - 16)
+            {
+                flush_buffer(t);
+            }
+            t->buf_len += encode(t->codec, e, t->buf + t->buf_len);
+            done = e->kind == TRACE_END;
+        }
+        atomic_store_explicit(&t->tail, tail, memory_order_release);
+
+        if(done)
+        {
+            flush_buffer(t);
+            return NULL;
+        }
+    }
+}
+
+trace_t* trace_open(const char* path)
+{
+    trace_t* t = calloc(1, sizeof(trace_t));
+    if(!t)
+    {
+        return NULL;
+    }
+    t->codec = codec_create();
+    t->buf = malloc(TRACE_BUFFER_SIZE);
+    t->last_instr = 0xF000;  /* as if after a trap, the first step sends every register */
+    t->f = fopen(path, "wb");
+
+    lc3trc_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, LC3TRC_MAGIC, 6);
+    h.byte_order = LC3IMG_BYTE_ORDER;
+    h.version = LC3TRC_VERSION;
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+
+    if(!t->codec || !t->buf || !t->f || fwrite(&h, sizeof(h), 1, t->f) != 1 ||
+       pthread_create(&t->thread, NULL, trace_writer, t) != 0)
+    {
+        if(t->f)
+        {
+            fclose(t->f);
+        }
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        free(t->buf);
+        free(t->codec);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void wake_writer(trace_t* t)
+{
+    if(atomic_load(&t->sleeping))
+    {
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+// Final register changes, then wait for the writer to finish the file
+int trace_close(trace_t* t, const uint16_t* reg)
+{
+    if(!t)
+    {
+        return 1;
+    }
+    int r = trace_sync_regs(t, reg);
+    if(r != TRACE_NO_REG)
+    {
+        trace_push(t, TRACE_REG, r, reg[r], TRACE_NO_REG, 0);
+    }
+    trace_push(t, TRACE_END, 0, 0, TRACE_NO_REG, 0);
+    wake_writer(t);
+    pthread_join(t->thread, NULL);
+
+    int ok = !t->failed;
+    ok = fclose(t->f) == 0 && ok;
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t->buf);
+    free(t->codec);
+    free(t);
+    return ok;
+}
+
+// Every register that changed, one is left for the caller to send with
+// its step and the rest go out on their own. Returns that one, or
+// TRACE_NO_REG if nothing changed.
+int trace_sync_regs(trace_t* t, const uint16_t* reg)
+{
+    int first = TRACE_NO_REG;
+    for(int r = 0; r < 8; ++r)
+    {
+        if(t->shadow[r] == reg[r])
+        {
+            continue;
+        }
+        if(first == TRACE_NO_REG)
+        {
+            first = r;
+            continue;
+        }
+        t->shadow[r] = reg[r];
+        trace_push(t, TRACE_REG, r, reg[r], TRACE_NO_REG, 0);
+    }
+    return first;
+}
+
+// Ring is full, let the writer catch up
+void trace_wait(trace_t* t)
+{
+    uint32_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    wake_writer(t);
+    for(;;)
+    {
+        t->tail_cache = atomic_load_explicit(&t->tail, memory_order_acquire);
+        if(head - t->tail_cache < TRACE_RING_SIZE)
+        {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+// Reader
+
+static int get_varint(FILE* f, uint16_t* v)
+{
+    uint32_t x = 0;
+    for(int shift = 0; shift < 21; shift += 7)
+    {
+        int b = getc(f);
+        if(b == EOF)
+        {
+            return 0;
+        }
+        x |= (uint32_t)(b & 0x7F) << shift;
+        if(!(b & 0x80))
+        {
+            *v = (uint16_t)x;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Up to TRACE_STEP_CHANGES changes are kept per step for printing
+#define TRACE_STEP_CHANGES 16
+
+typedef struct
+{
+    uint64_t index;
+    uint16_t pc;
+    uint16_t instr;
+    int count;
+    uint8_t kind[TRACE_STEP_CHANGES];
+    uint16_t a[TRACE_STEP_CHANGES];
+    uint16_t b[TRACE_STEP_CHANGES];
+} trace_step_t;
+
+typedef struct
+{
+    int verbose;
+    int pc;          /* only steps at pc, -1 for all */
+    int address;     /* only steps that wrote address, -1 for all */
+    uint64_t shown;
+} trace_filter_t;
+
+static void print_step(const trace_step_t* s, const trace_codec_t* c, trace_filter_t* filter, int start)
+{
+    if(!start && filter->pc >= 0 && s->pc != filter->pc)
+    {
+        return;
+    }
+    if(filter->address >= 0)
+    {
+        int wrote = 0;
+        for(int i = 0; i < s->count; ++i)
+        {
+            wrote |= s->kind[i] == TRACE_MEM && s->a[i] == filter->address;
+        }
+        if(!wrote)
+        {
+            return;
+        }
+    }
+    if(start && filter->pc >= 0)
+    {
+        return;
+    }
+
+    if(start)
+    {
+        printf("%10s                     ", "start");
+    }
+    else
+    {
+        const char* op = op_names[s->instr >> 12];
+        printf("%10llu  x%04X  x%04X  %s", (unsigned long long)s->index, s->pc, s->instr, op);
+        if(s->count)
+        {
+            printf("%*s", 5 - (int)strlen(op), "");
+        }
+    }
+    for(int i = 0; i < s->count; ++i)
+    {
+        if(s->kind[i] == TRACE_REG)
+        {
+            printf("  R%d=x%04X", s->a[i], s->b[i]);
+        }
+        else
+        {
+            printf("  [x%04X]=x%04X", s->a[i], s->b[i]);
+        }
+    }
+    if(s->count == TRACE_STEP_CHANGES)
+    {
+        printf("  ...");
+    }
+    printf("\n");
+
+    if(filter->verbose)
+    {
+        printf("%10s       ", "");
+        for(int r = 0; r < 8; ++r)
+        {
+            printf("  R%d=x%04X", r, c->reg[r]);
+        }
+        printf("\n");
+    }
+    ++filter->shown;
+}
+
+static int dump_trace(FILE* f, const char* path, trace_filter_t* filter)
+{
+    trace_codec_t* c = codec_create();
+    if(!c)
+    {
+        return 0;
+    }
+
+    trace_step_t step;
+    memset(&step, 0, sizeof(step));
+    int start = 1;
+    int ok = 0;
+
+    for(;;)
+    {
+        int tag = getc(f);
+        if(tag == EOF)
+        {
+            fprintf(stderr, "%s: trace ends without an end record\n", path);
+            break;
+        }
+
+        int kind = tag & 0x3;
+        uint16_t a = 0;
+        uint16_t b = 0;
+        if(kind == TRACE_STEP || kind == TRACE_END)
+        {
+            if(!start || step.count)
+            {
+                print_step(&step, c, filter, start);
+            }
+            if(kind == TRACE_END)
+            {
+                ok = 1;
+                break;
+            }
+
+            uint16_t z = 0;
+            if(!(tag & (1 << 2)) && !get_varint(f, &z))
+            {
+                break;
+            }
+            a = unzigzag(c->pc + 1, z);
+            if(tag & (1 << 3))
+            {
+                b = (uint16_t)c->instr[a];
+            }
+            else if(!get_varint(f, &b))
+            {
+                break;
+            }
+            c->instr[a] = b;
+            c->pc = a;
+
+            step.index = start ? 0 : step.index + 1;
+            step.pc = a;
+            step.instr = b;
+            step.count = 0;
+            start = 0;
+            continue;
+        }
+
+        if(kind == TRACE_REG)
+        {
+            uint16_t z;
+            if(!get_varint(f, &z))
+            {
+                break;
+            }
+            a = (tag >> 2) & 0x7;
+            b = unzigzag(c->reg[a], z);
+            c->reg[a] = b;
+        }
+        else
+        {
+            uint16_t z;
+            if(!get_varint(f, &z) || !get_varint(f, &b))
+            {
+                break;
+            }
+            a = unzigzag(c->address, z);
+            c->address = a;
+        }
+
+        if(step.count < TRACE_STEP_CHANGES)
+        {
+            step.kind[step.count] = kind;
+            step.a[step.count] = a;
+            step.b[step.count] = b;
+            ++step.count;
+        }
+    }
+
+    if(ok)
+    {
+        fprintf(stderr, "%llu steps, %llu shown\n",
+                (unsigned long long)(start ? 0 : step.index + 1), (unsigned long long)filter->shown);
+    }
+    free(c);
+    return ok;
+}
+
+// Addresses in LC-3 style x3000 as well as 0x3000
+static int parse_address(const char* s)
+{
+    return (uint16_t)strtol(s[0] == 'x' ? s + 1 : s, NULL, s[0] == 'x' ? 16 : 0);
+}
+
+// lc3 --trace-dump [-v] [-p pc] [-a address] trace.trc
+int trace_dump_main(int argc, const char* argv[])
+{
+    trace_filter_t filter = { 0, -1, -1, 0 };
+    int i = 0;
+
+    for(; i < argc && argv[i][0] == '-'; ++i)
+    {
+        if(strcmp(argv[i], "-v") == 0)
+        {
+            filter.verbose = 1;
+        }
+        else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            filter.pc = parse_address(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            filter.address = parse_address(argv[++i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i + 1 != argc)
+    {
+        printf("lc3 --trace-dump [-v] [-p pc] [-a address] trace.trc\n");
+        return 1;
+    }
+
+    const char* path = argv[i];
+    FILE* f = fopen(path, "rb");
+    if(!f)
+    {
+        printf("failed to open trace: %s\n", path);
+        return 1;
+    }
+
+    lc3trc_header_t h;
+    int ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, LC3TRC_MAGIC, 6) == 0;
+    if(!ok)
+    {
+        fprintf(stderr, "%s: not a trace\n", path);
+    }
+    else if(h.byte_order != LC3IMG_BYTE_ORDER || h.version != LC3TRC_VERSION)
+    {
+        fprintf(stderr, "%s: trace was written for another host or version\n", path);
+        ok = 0;
+    }
+
+    ok = ok && dump_trace(f, path, &filter);
+    fclose(f);
+    return ok ? 0 : 1;
+}
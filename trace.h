@@ -0,0 +1,176 @@
+/*
+  Execution trace recorder. Build with TRACE=1 (-DVM_TRACE=1) and run with
+  --trace out.trc to log every instruction executed: its PC and word, then
+  the general purpose registers and memory words it changed.
+
+  The machine only appends fixed size events to a single-producer/
+  single-consumer ring. A writer thread encodes them and streams them to
+  the file, so the machine never waits on the disk unless the ring fills.
+
+  lc3 --trace-dump [-v] [-p pc] [-a address] trace.trc replays a trace,
+  optionally only the steps at pc or the ones that wrote address.
+
+  When VM_TRACE is 0 the TRACE_* hooks expand to nothing.
+
+  File format, in host byte order like .lc3img:
+
+    lc3trc_header_t, then records until TRACE_END. Each record starts with
+    a tag byte, the low two bits are the kind:
+
+    TRACE_STEP  bit 2 set: pc is the previous step's pc + 1, otherwise a
+                varint with the zigzag difference follows. Bit 3 set: same
+                word as the last time pc ran, otherwise a varint word.
+    TRACE_REG   bits 2-4 register, varint zigzag difference to its last
+                value (registers start at zero).
+    TRACE_MEM   varint zigzag difference to the last address written,
+                varint value.
+
+  Register and memory records belong to the step before them, the ones in
+  front of the first step are the starting state.
+*/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#ifndef VM_TRACE
+#define VM_TRACE 0
+#endif
+
+#define LC3TRC_MAGIC "LC3TRC"
+#define LC3TRC_VERSION 1
+
+// Events, must be a power of two
+#define TRACE_RING_SIZE (1 << 16)
+// Longest the writer sleeps on an empty ring, the machine wakes it sooner
+// once the ring fills up
+#define TRACE_IDLE_MS 10
+
+enum
+{
+    TRACE_STEP = 0,
+    TRACE_REG,
+    TRACE_MEM,
+    TRACE_END
+};
+
+typedef struct
+{
+    char magic[6];              /* LC3TRC */
+    uint16_t byte_order;        /* LC3IMG_BYTE_ORDER as written by the host */
+    uint32_t version;
+} lc3trc_header_t;
+
+// One per step, memory write or extra register change. A step carries the
+// register the step before it changed, the usual case, so most
+// instructions cost a single event.
+typedef struct
+{
+    uint16_t a;                 /* pc, register or address */
+    uint16_t b;                 /* instruction word or new value */
+    uint16_t value;             /* step: new value of reg */
+    uint8_t reg;                /* step: register changed, TRACE_NO_REG for none */
+    uint8_t kind;
+} trace_event_t;
+
+#define TRACE_NO_REG 0xFF
+
+typedef struct trace
+{
+    trace_event_t ring[TRACE_RING_SIZE];
+    _Atomic uint32_t head;      /* written by the machine */
+    _Atomic uint32_t tail;      /* written by the writer thread */
+    uint32_t tail_cache;        /* machine's last look at tail */
+
+    // Registers as of the last event, and the instruction that ran since
+    uint16_t shadow[8];
+    uint16_t last_instr;
+
+    FILE* f;
+    struct trace_codec* codec;  /* writer's encoder state */
+    uint8_t* buf;               /* encoded bytes not written yet */
+    size_t buf_len;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* signalled when the ring is full */
+    _Atomic int sleeping;       /* writer is waiting on cond */
+    int failed;                 /* a write error, reported by trace_close() */
+} trace_t;
+
+trace_t* trace_open(const char* path);
+int trace_close(trace_t* t, const uint16_t* reg);
+int trace_sync_regs(trace_t* t, const uint16_t* reg);
+void trace_wait(trace_t* t);
+int trace_dump_main(int argc, const char* argv[]);
+
+static inline void trace_push(trace_t* t, uint8_t kind, uint16_t a, uint16_t b, uint8_t reg, uint16_t value)
+{
+    uint32_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    if(head - t->tail_cache == TRACE_RING_SIZE)
+    {
+        trace_wait(t);
+    }
+    t->ring[head & (TRACE_RING_SIZE - 1)] = (trace_event_t){ a, b, value, reg, kind };
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+// Opcodes whose only register write is DR (ADD LD AND LDR NOT LDI LEA),
+// and the ones that write none (BR ST STR STI JMP). JSR writes R7, any
+// other opcode (the traps) has every register compared.
+#define TRACE_OPS_DST   ((1 << 1) | (1 << 2) | (1 << 5) | (1 << 6) | (1 << 9) | (1 << 10) | (1 << 14))
+#define TRACE_OPS_NONE  ((1 << 0) | (1 << 3) | (1 << 7) | (1 << 11) | (1 << 12))
+#define TRACE_OP_JSR    4
+
+// The register the last step changed goes along with this one. Only that
+// register is looked at, a wide compare of reg[] right after the machine
+// stored one word of it would stall on every instruction.
+static inline void trace_step(trace_t* t, const uint16_t* reg, uint16_t pc, uint16_t instr)
+{
+    uint16_t last = t->last_instr;
+    int op = last >> 12;
+    int r = TRACE_NO_REG;
+    t->last_instr = instr;
+
+    if((1 << op) & TRACE_OPS_DST)
+    {
+        r = (last >> 9) & 0x7;
+    }
+    else if(op == TRACE_OP_JSR)
+    {
+        r = 7;
+    }
+    else if(!((1 << op) & TRACE_OPS_NONE))
+    {
+        r = trace_sync_regs(t, reg);
+    }
+
+    if(r != TRACE_NO_REG && t->shadow[r] != reg[r])
+    {
+        t->shadow[r] = reg[r];
+        trace_push(t, TRACE_STEP, pc, instr, r, reg[r]);
+    }
+    else
+    {
+        trace_push(t, TRACE_STEP, pc, instr, TRACE_NO_REG, 0);
+    }
+}
+
+#if VM_TRACE
+
+#define TRACE_INSTR(vm, pc, instr) \
+    do { trace_t* t_ = (vm)->trace; if(t_) trace_step(t_, (vm)->reg, (pc), (instr)); } while(0)
+
+#define TRACE_WRITE(vm, address, value) \
+    do { trace_t* t_ = (vm)->trace; if(t_) trace_push(t_, TRACE_MEM, (address), (value), TRACE_NO_REG, 0); } while(0)
+
+#else
+
+#define TRACE_INSTR(vm, pc, instr) ((void)0)
+#define TRACE_WRITE(vm, address, value) ((void)0)
+
+#endif
+
+#endif
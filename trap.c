@@ -0,0 +1,168 @@
+/*
+  Trap table and native fast traps.
+
+  Every machine has a table of 256 trap handlers. TRAP runs the native
+  handler for its vector if there is one, otherwise it does what the LC-3
+  does: R7 gets the return address and the guest routine memory[vector]
+  points at runs. A zero there, no routine, leaves the trap doing nothing.
+  New machines have GETC, OUT, PUTS, IN, PUTSP and HALT as native handlers.
+  vm_set_guest_traps() hands those to a guest OS that brings its own, and
+  vm_set_trap() puts any handler, or NULL, on any vector.
+
+  vm_set_fast_traps() adds host versions of routines guest programs spend
+  their time in:
+
+    MEMCPY  x26  copy R2 words from R1 to R0, overlap is fine
+    MEMSET  x27  store R1 in R2 words from R0
+    MUL     x28  R1:R0 = R0 * R1, signed, R0 has the low word
+    DIV     x29  R0 = R0 / R1, R1 = R0 % R1, signed and rounded toward
+                 zero; dividing by zero leaves both alone
+    PUTN    x2A  print R0 as a signed decimal
+
+  MUL and DIV set N/Z/P from R0. MEMCPY and MEMSET load and store like the
+  guest would, devices included, and wrap at the top of memory. Ranges of
+  plain memory go in one copy followed by one pass over the dirty page
+  map, the decode cache and native code.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+
+// Can n words from address be accessed as one array? Not across the top
+// of memory or a device page, and not while tracing, which records every
+// store.
+static int plain_range(vm_t* vm, uint16_t address, uint16_t n)
+{
+    if(vm->trace || (uint32_t)address + n > VM_MEMORY_WORDS)
+    {
+        return 0;
+    }
+    for(uint32_t p = address >> VM_PAGE_SHIFT; p <= (uint32_t)(address + n - 1) >> VM_PAGE_SHIFT; ++p)
+    {
+        if(vm->device_page[p])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// What mem_write() does after a store, for a whole range at once
+static void stored_range(vm_t* vm, uint16_t address, uint16_t n)
+{
+    uint32_t end = (uint32_t)address + n;
+    for(uint32_t p = address >> VM_PAGE_SHIFT; p <= (end - 1) >> VM_PAGE_SHIFT; ++p)
+    {
+        vm->dirty_page[p] = 1;
+    }
+    invalidate_decode(vm, address, end);
+}
+
+static void trap_memcpy(vm_t* vm)
+{
+    uint16_t dst = vm->reg[R_R0];
+    uint16_t src = vm->reg[R_R1];
+    uint16_t n = vm->reg[R_R2];
+    if(!n)
+    {
+        return;
+    }
+    if(plain_range(vm, dst, n) && plain_range(vm, src, n))
+    {
+        memmove(vm->memory + dst, vm->memory + src, n * sizeof(uint16_t));
+        stored_range(vm, dst, n);
+        return;
+    }
+
+    // Backwards when the destination starts inside the source
+    if((uint16_t)(dst - src) < n)
+    {
+        for(uint16_t i = n; i-- > 0;)
+        {
+            vm_write(vm, (uint16_t)(dst + i), vm_read(vm, (uint16_t)(src + i)));
+        }
+    }
+    else
+    {
+        for(uint16_t i = 0; i < n; ++i)
+        {
+            vm_write(vm, (uint16_t)(dst + i), vm_read(vm, (uint16_t)(src + i)));
+        }
+    }
+}
+
+static void trap_memset(vm_t* vm)
+{
+    uint16_t dst = vm->reg[R_R0];
+    uint16_t val = vm->reg[R_R1];
+    uint16_t n = vm->reg[R_R2];
+    if(!n)
+    {
+        return;
+    }
+    if(plain_range(vm, dst, n))
+    {
+        for(uint16_t i = 0; i < n; ++i)
+        {
+            vm->memory[dst + i] = val;
+        }
+        stored_range(vm, dst, n);
+        return;
+    }
+    for(uint16_t i = 0; i < n; ++i)
+    {
+        vm_write(vm, (uint16_t)(dst + i), val);
+    }
+}
+
+static void trap_mul(vm_t* vm)
+{
+    int32_t product = (int32_t)(int16_t)vm->reg[R_R0] * (int16_t)vm->reg[R_R1];
+    vm->reg[R_R0] = (uint16_t)product;
+    vm->reg[R_R1] = (uint16_t)((uint32_t)product >> 16);
+    vm->reg[R_COND] = vm->reg[R_R0];
+}
+
+static void trap_div(vm_t* vm)
+{
+    int32_t a = (int16_t)vm->reg[R_R0];
+    int32_t b = (int16_t)vm->reg[R_R1];
+    if(b)
+    {
+        vm->reg[R_R0] = (uint16_t)(a / b);
+        vm->reg[R_R1] = (uint16_t)(a % b);
+    }
+    vm->reg[R_COND] = vm->reg[R_R0];
+}
+
+static void trap_putn(vm_t* vm)
+{
+    char buf[8];
+    int n = snprintf(buf, sizeof(buf), "%d", (int16_t)vm->reg[R_R0]);
+    console_write(vm, buf, (size_t)n);
+    console_trap_done(vm);
+}
+
+void vm_set_trap(vm_t* vm, uint8_t vector, native_trap_t fn)
+{
+    vm->traps[vector] = fn;
+}
+
+void vm_set_fast_traps(vm_t* vm)
+{
+    vm->traps[TRAP_MEMCPY] = trap_memcpy;
+    vm->traps[TRAP_MEMSET] = trap_memset;
+    vm->traps[TRAP_MUL] = trap_mul;
+    vm->traps[TRAP_DIV] = trap_div;
+    vm->traps[TRAP_PUTN] = trap_putn;
+}
+
+// The console traps run the guest's routines from here on
+void vm_set_guest_traps(vm_t* vm)
+{
+    for(int v = TRAP_GETC; v <= TRAP_HALT; ++v)
+    {
+        vm->traps[v] = NULL;
+    }
+}
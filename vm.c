@@ -28,159 +28,86 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <signal.h>
+#include <time.h>
 /* unix */
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
-#include <sys/mman.h>
-
-// 2^16 Memory Locations - Each with store 16bit Value - 128Kb Memory
-uint16_t memory[UINT16_MAX];
-
-// Is the program running?
-int running = 0;
-
-// For unix terminals
-struct termios original_tio;
-
-// Registers
-// 10 Total Registers - Each holding 16 bits
-// 8 General purpose - R0-R7
-// 1 Program counter - PC
-// 1 Condition flag - COND
-
-enum
-{
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-    R_PC,
-    R_COND,
-    R_COUNT
-};
-
-uint16_t reg[R_COUNT];
-
-// Opcodes
-// 16 Opcodes
-// Each instruction is 16 bits, Left 4 bits for opcode - the rest for the params
-enum
-{
-    OP_BR = 0,  /* branch */
-    OP_ADD,     /* add */
-    OP_LD,      /* load */
-    OP_ST,      /* store */
-    OP_JSR,     /* jump register */
-    OP_AND,     /* bitwise and */
-    OP_LDR,     /* load register */
-    OP_STR,     /* store register */
-    OP_RTI,     /* unused */
-    OP_NOT,     /* bitwise not */
-    OP_LDI,     /* load indirect */
-    OP_STI,     /* store indirect */
-    OP_JMP,     /* jump */
-    OP_RES,     /* reserved (unused) */
-    OP_LEA,     /* load effective address */
-    OP_TRAP     /* exectute trap */
-};
-
-// Trap Codes
-enum
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "vm.h"
+#include "cpu.h"
+#include "jit.h"
+#include "image.h"
+#include "snapshot.h"
+#include "debug.h"
+#include "interrupt.h"
+
+VM_INLINE void mem_write(vm_t* vm, uint16_t address, uint16_t val)
 {
-    TRAP_GETC = 0x20,    /* get char from keyboard*/
-    TRAP_OUT = 0x21,     /* output a char */
-    TRAP_PUTS = 0x22,    /* output a word string */
-    TRAP_IN = 0x23,      /* get character from keyboard, echo to terminal */
-    TRAP_PUTSP = 0x24,   /* output a byte string */
-    TRAP_HALT = 0x25     /* halt the program */
-};
-
-// Condition flags
-enum
-{
-    FL_POS = 1 << 0, /* P */
-    FL_ZRO = 1 << 1, /* Z */
-    FL_NEG = 1 << 2  /* N */
-};
-
-// Memory mapped registers
-enum
-{
-    MR_KBSR = 0xFE00, /* keyboard status */ 
-    MR_KBDR = 0xFE00  /* keyboard data */ 
-};
-
-void mem_write(uint16_t address, uint16_t val)
-{
-    memory[address] = val;
-}
-
-uint16_t check_key()
-{
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
+    TRACE_WRITE(vm, address, val);
+    uint8_t dev = vm->device_page[address >> VM_PAGE_SHIFT];
+    if(__builtin_expect(dev != 0, 0) && vm->devices[dev - 1].write)
+    {
+        vm->devices[dev - 1].write(vm, address, val);
+        return;
+    }
 
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+    vm->memory[address] = val;
+    vm_mark_dirty(vm, address);
+    // Self modifying code - decode again next time it runs, along with any
+    // superinstruction that starts a word or two earlier. None runs over
+    // the top of memory, the wrap at x0000 only drops a word or two extra.
+    vm->decode_cache[address].fn = NULL;
+#if VM_FUSE
+    vm->decode_cache[(uint16_t)(address - 1)].fn = NULL;
+    vm->decode_cache[(uint16_t)(address - 2)].fn = NULL;
+#endif
+    if(vm->block_map[address])
+    {
+        block_invalidate(vm, address);
+    }
 }
 
-uint16_t mem_read(uint16_t address)
+VM_INLINE uint16_t mem_read(vm_t* vm, uint16_t address)
 {
-    if(address == MR_KBSR)
+    uint8_t dev = vm->device_page[address >> VM_PAGE_SHIFT];
+    if(__builtin_expect(dev != 0, 0) && vm->devices[dev - 1].read)
     {
-        if(check_key())
-        {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
-        }
-        else
-        {
-            memory[MR_KBSR] = 0;
-        }
+        return vm->devices[dev - 1].read(vm, address);
     }
-
-    return memory[address];
+    return vm->memory[address];
 }
 
-uint16_t sign_extend(uint16_t x, int bit_count)
+// Only the result is kept, br() turns it into N/Z/P if it ever looks
+VM_INLINE void update_flags(vm_t* vm, uint16_t r)
 {
-    if ((x >> (bit_count - 1)) & 1) {
-        x |= (0xFFFF << bit_count);
-    }
-
-    return x;
+    vm->reg[R_COND] = vm->reg[r];
 }
 
-void update_flags(uint16_t r)
+// Function Implementations
+// Called by every instruction that ends a basic block, with the address
+// after it. Code between two block ends runs straight through, so the
+// length of the block is just the distance from where it started. This is
+// also where a pending interrupt is taken.
+VM_INLINE void end_block(vm_t* vm, uint16_t next)
 {
-    if (reg[r] == 0)
-    {
-        reg[R_COND] = FL_ZRO;
-    }
-    else if(reg[r] >> 15) // a 1 in the left-most bit indicates negative
-    {
-        reg[R_COND] = FL_NEG;
-    }
-    else
+    vm_count(vm, next);
+    vm->block_start = vm->reg[R_PC];
+    if(__builtin_expect(vm->instructions >= vm->next_check ||
+                        atomic_load_explicit(&vm->irq, memory_order_relaxed), 0))
     {
-        reg[R_COND] = FL_POS;
+        vm_check_limits(vm);
     }
 }
 
-// Function Implementations
-void add(uint16_t instr)
+VM_INLINE void add(vm_t* vm, uint16_t instr)
 {
     // Destination Register
     uint16_t r0 = (instr >> 9) & 0x7;
@@ -194,18 +121,18 @@ void add(uint16_t instr)
     if(imm_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
+        vm->reg[r0] = vm->reg[r1] + imm5;
     }
     else
     {
         uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
+        vm->reg[r0] = vm->reg[r1] + vm->reg[r2];
     }
 
-    update_flags(r0);
+    update_flags(vm, r0);
 }
 
-void and(uint16_t instr) {
+VM_INLINE void and(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
     uint16_t imm_flag = (instr >> 5) & 0x1;
@@ -213,321 +140,1494 @@ void and(uint16_t instr) {
     if(imm_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[r0] = reg[r1] + imm5;
+        vm->reg[r0] = vm->reg[r1] & imm5;
     }
     else
     {
         uint16_t r2 = instr & 0x7;
-        reg[r0] = reg[r1] + reg[r2];
+        vm->reg[r0] = vm->reg[r1] & vm->reg[r2];
     }
 
-    update_flags(r0);
+    update_flags(vm, r0);
 }
 
-void not(uint16_t instr) {
+VM_INLINE void not(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
-    reg[r0] = ~reg[r1];
-    update_flags(r0);
+    vm->reg[r0] = ~vm->reg[r1];
+    update_flags(vm, r0);
 }
 
-void br(uint16_t instr) {
-    uint16_t pc_offset = sign_extend(instr * 0x1FF, 9);
+VM_INLINE void br(vm_t* vm, uint16_t instr) {
+    uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
     uint16_t cond_flag = (instr >> 9) & 0x7;
 
-    if(cond_flag & reg[R_COND])
+    uint16_t next = vm->reg[R_PC];
+    uint16_t taken = cond_flag & vm_cond(vm);
+
+    PROFILE_BRANCH(vm, vm->reg[R_PC] - 1, taken);
+    if(taken)
     {
-        reg[R_PC] += pc_offset;
+        vm->reg[R_PC] += pc_offset;
     }
+    end_block(vm, next);
 }
 
-void jmp(uint16_t instr) {
+VM_INLINE void jmp(vm_t* vm, uint16_t instr) {
     uint16_t r1 = (instr >> 6) & 0x7;
-    reg[R_PC] = reg[r1];
+    uint16_t next = vm->reg[R_PC];
+    vm->reg[R_PC] = vm->reg[r1];
+    end_block(vm, next);
 }
 
-void jsr(uint16_t instr) {
+VM_INLINE void jsr(vm_t* vm, uint16_t instr) {
     uint16_t long_flag = (instr >> 11) & 1;
-    reg[R_R7] = reg[R_PC];
+    // Base register read first, JSRR R7 jumps to the old R7
+    uint16_t base = vm->reg[(instr >> 6) & 0x7];
+    vm->reg[R_R7] = vm->reg[R_PC];
 
     if(long_flag)
     {
         uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
-        reg[R_PC] += long_pc_offset; /* JSR */
+        vm->reg[R_PC] += long_pc_offset; /* JSR */
     }
     else
     {
-        uint16_t r1 = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[r1];
+        vm->reg[R_PC] = base; /* JSRR */
     }
+    end_block(vm, vm->reg[R_R7]);
 }
 
-void ld(uint16_t instr) {
+VM_INLINE void ld(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = mem_read(reg[R_PC] + pc_offset);
-    update_flags(r0);
+    vm->reg[r0] = mem_read(vm, vm->reg[R_PC] + pc_offset);
+    update_flags(vm, r0);
 }
-void ldi(uint16_t instr) {
+VM_INLINE void ldi(vm_t* vm, uint16_t instr) {
     // Destination Register
     uint16_t r0 = (instr >> 9) & 0x7;
 
     // PC Offset
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
 
-    // Add pc offset to current PC, look at that memory location to get the final address.
-    reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-    update_flags(r0);
+    // Add pc offset to current PC, look at that vm->memory location to get the final address.
+    vm->reg[r0] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + pc_offset));
+    update_flags(vm, r0);
 }
 
-void ldr(uint16_t instr) {
+VM_INLINE void ldr(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
     uint16_t offset = sign_extend(instr & 0x3F, 6);
-    reg[r0] = mem_read(reg[r1] + offset);
-    update_flags(r0);
+    vm->reg[r0] = mem_read(vm, vm->reg[r1] + offset);
+    update_flags(vm, r0);
 }
 
-void lea(uint16_t instr) {
+VM_INLINE void lea(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    reg[r0] = reg[R_PC] + pc_offset;
-    update_flags(r0);
+    vm->reg[r0] = vm->reg[R_PC] + pc_offset;
+    update_flags(vm, r0);
 }
 
-void st(uint16_t instr) {
+VM_INLINE void st(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+    mem_write(vm, vm->reg[R_PC] + pc_offset, vm->reg[r0]);
 }
 
-void sti(uint16_t instr) {
+VM_INLINE void sti(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-    mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
+    mem_write(vm, mem_read(vm, vm->reg[R_PC] + pc_offset), vm->reg[r0]);
 }
 
-void str(uint16_t instr) {
+VM_INLINE void str(vm_t* vm, uint16_t instr) {
     uint16_t r0 = (instr >> 9) & 0x7;
     uint16_t r1 = (instr >> 6) & 0x7;
     uint16_t pc_offset = sign_extend(instr & 0x3F, 6);
-    mem_write(reg[r1] + pc_offset, reg[r0]);
+    mem_write(vm, vm->reg[r1] + pc_offset, vm->reg[r0]);
+}
+
+// An exception the guest has no handler for. The machine stops in front
+// of the instruction instead of taking the process down, so whoever runs
+// it can look at the fault and carry on with the next program. The block
+// is counted without end_block(), an interrupt must not move PC now, and
+// the fault wins over an MCR halt earlier in the block.
+static void fault(vm_t* vm)
+{
+    vm->reg[R_PC]--;
+    vm_count(vm, vm->reg[R_PC]);
+    vm->block_start = vm->reg[R_PC];
+    vm->halt_pending = 0;
+    vm->exit_reason = VM_EXIT_FAULT;
+    vm->running = 0;
+}
+
+static void exception(vm_t* vm, uint16_t vector)
+{
+    uint16_t next = vm->reg[R_PC];
+    if(!interrupt_enter(vm, vector, PSR_PRIORITY(vm->psr)))
+    {
+        fault(vm);
+        return;
+    }
+    end_block(vm, next);
 }
 
-void bad(uint16_t opcode) {
-    printf("Unknown opcode!, %d\n", opcode);
+static void rti(vm_t* vm)
+{
+    uint16_t next = vm->reg[R_PC];
+    if(!interrupt_return(vm))
+    {
+        exception(vm, VEC_PRIVILEGE);
+        return;
+    }
+    end_block(vm, next);
 }
 
 // Trap Routines
-void trap_getc() {
-    reg[R_R0] = (uint16_t)getchar();
+// Leave PC on the trap so it runs again once there is input
+VM_INLINE int stop_for_input(vm_t* vm)
+{
+    if(console_wants_stop(vm))
+    {
+        vm->reg[R_PC]--;
+        return 1;
+    }
+    return 0;
+}
+
+void trap_getc(vm_t* vm) {
+    if(stop_for_input(vm))
+    {
+        return;
+    }
+    vm->reg[R_R0] = (uint16_t)console_getchar(vm);
 }
 
-void trap_out() {
-    putc((char)reg[R_R0], stdout);
-    fflush(stdout);
+void trap_out(vm_t* vm) {
+    console_putc(&vm->console, vm, (char)vm->reg[R_R0]);
+    console_trap_done(vm);
 }
 
-void trap_in() {
-    printf("Enter a character: ");
-    char c = getchar();
-    putc(c, stdout);
-    reg[R_R0] = (uint16_t)c;
+void trap_in(vm_t* vm) {
+    static const char prompt[] = "Enter a character: ";
+    if(stop_for_input(vm))
+    {
+        return;
+    }
+    console_write(vm, prompt, sizeof(prompt) - 1);
+    char c = console_getchar(vm);
+    console_putc(&vm->console, vm, c);
+    console_trap_done(vm);
+    vm->reg[R_R0] = (uint16_t)c;
 }
 
-void trap_putsp() {
-    uint16_t* c = memory + reg[R_R0];
-    while(*c)
+// String traps scan with SSE2 where there is one, or AVX2 (see cpu.h). A
+// string that isn't terminated before the end of memory stops there.
+#define MEMORY_WORDS (sizeof(((vm_t*)0)->memory) / sizeof(uint16_t))
+
+// Vector parts of the scans below. They return where they found the word
+// they look for, or how far they got in whole vectors.
+#if VM_HAVE_AVX2
+VM_TARGET_AVX2 static size_t scan_zero_word_avx2(const uint16_t* s, size_t n)
+{
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16)
     {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+        if(mask)
+        {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+    return i;
+}
+
+VM_TARGET_AVX2 static size_t scan_zero_high_avx2(const uint16_t* s, size_t n)
+{
+    size_t i = 0;
+    for(; i + 16 <= n; i += 16)
+    {
+        __m256i v = _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(s + i)), 8);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, _mm256_setzero_si256()));
+        if(mask)
+        {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+    return i;
+}
+#endif
+
+static size_t scan_zero_word_sse2(const uint16_t* s, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+        if(mask)
+        {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+#endif
+    return i;
+}
+
+static size_t scan_zero_high_sse2(const uint16_t* s, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for(; i + 8 <= n; i += 8)
+    {
+        __m128i v = _mm_srli_epi16(_mm_loadu_si128((const __m128i*)(s + i)), 8);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_setzero_si128()));
+        if(mask)
+        {
+            return i + (__builtin_ctz(mask) >> 1);
+        }
+    }
+#endif
+    return i;
+}
+
+#if VM_MULTIVERSION
+#define SCAN_VECTOR(scan, s, n) (cpu_avx2() ? scan##_avx2(s, n) : scan##_sse2(s, n))
+#elif VM_HAVE_AVX2
+#define SCAN_VECTOR(scan, s, n) scan##_avx2(s, n)
+#else
+#define SCAN_VECTOR(scan, s, n) scan##_sse2(s, n)
+#endif
+
+// Words before the first zero word, at most n
+static size_t scan_zero_word(const uint16_t* s, size_t n)
+{
+    size_t i = SCAN_VECTOR(scan_zero_word, s, n);
+    while(i < n && s[i])
+    {
+        ++i;
+    }
+    return i;
+}
+
+// Words before the first one with a zero high byte, at most n. For PUTSP
+// that is the last word of the string, or the end of it.
+static size_t scan_zero_high(const uint16_t* s, size_t n)
+{
+    size_t i = SCAN_VECTOR(scan_zero_high, s, n);
+    while(i < n && (s[i] >> 8))
+    {
+        ++i;
+    }
+    return i;
+}
+
+void trap_putsp(vm_t* vm) {
+    const uint16_t* c = vm->memory + vm->reg[R_R0];
+    size_t left = MEMORY_WORDS - vm->reg[R_R0];
+
+    while(left && *c)
+    {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        // Words with both bytes set are already low byte, high byte in memory
+        size_t n = scan_zero_high(c, left);
+        console_write(vm, (const char*)c, n * 2);
+        c += n;
+        left -= n;
+        if(!left || !*c)
+        {
+            break;
+        }
+#endif
         char char1 = (*c) & 0xFF;
-        putc(char1, stdout);
+        console_putc(&vm->console, vm, char1);
         char char2 = (*c) >> 8;
-        if(char2) putc(char2, stdout);
+        if(char2) console_putc(&vm->console, vm, char2);
         ++c;
+        --left;
     }
 
-    fflush(stdout);
+    console_trap_done(vm);
 }
 
-void trap_halt() {
-    puts("HALT");
-    fflush(stdout);
-    running = 0;
+void trap_halt(vm_t* vm) {
+    console_write(vm, "HALT\n", 5);
+    console_flush(vm);
+    vm->running = 0;
 }
 
-void trap_puts() {
-    uint16_t* c = memory + reg[R_R0];
-    while(* c)
+void trap_puts(vm_t* vm) {
+    const uint16_t* c = vm->memory + vm->reg[R_R0];
+    console_write_chars(vm, c, scan_zero_word(c, MEMORY_WORDS - vm->reg[R_R0]));
+    console_trap_done(vm);
+}
+
+// The native handler for the vector, or the guest routine the trap
+// vector table points at (see trap.c)
+void trap(vm_t* vm, uint16_t instr) {
+    uint16_t next = vm->reg[R_PC];
+    uint8_t vector = instr & 0xFF;
+    native_trap_t fn = vm->traps[vector];
+    METRIC_ADD(vm, traps[vector], 1);
+    PROFILE_TRAP_BEGIN(vm);
+    if(fn)
     {
-        putc((char)*c, stdout);
-        ++c;
+        fn(vm);
     }
-    fflush(stdout);
+    else if(vm->memory[vector])
+    {
+        vm->reg[R_R7] = next;
+        vm->reg[R_PC] = vm->memory[vector];
+    }
+    PROFILE_TRAP_END(vm, instr);
+    end_block(vm, next);
+}
+
+
+
+// Predecoded handlers - same semantics as the handlers above, but operands
+// come out of the decode cache instead of the instruction word
+void pd_add_reg(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = vm->reg[d->src1] + vm->reg[d->src2];
+    update_flags(vm, d->dst);
 }
 
-void trap(uint16_t instr) {
-    switch(instr & 0xFF)
+void pd_add_imm(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = vm->reg[d->src1] + d->imm;
+    update_flags(vm, d->dst);
+}
+
+void pd_and_reg(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = vm->reg[d->src1] & vm->reg[d->src2];
+    update_flags(vm, d->dst);
+}
+
+void pd_and_imm(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = vm->reg[d->src1] & d->imm;
+    update_flags(vm, d->dst);
+}
+
+void pd_not(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = ~vm->reg[d->src1];
+    update_flags(vm, d->dst);
+}
+
+void pd_br(vm_t* vm, const decoded_t* d)
+{
+    uint16_t next = vm->reg[R_PC];
+    uint16_t taken = d->dst & vm_cond(vm);
+    PROFILE_BRANCH(vm, vm->reg[R_PC] - 1, taken);
+    if(taken)
     {
-        case TRAP_GETC:
-            trap_getc();
+        vm->reg[R_PC] += d->imm;
+    }
+    end_block(vm, next);
+}
+
+// BRnzp (and BR with no condition bits) do not need to look at the flags
+void pd_br_always(vm_t* vm, const decoded_t* d)
+{
+    uint16_t next = vm->reg[R_PC];
+    PROFILE_BRANCH(vm, vm->reg[R_PC] - 1, 1);
+    vm->reg[R_PC] += d->imm;
+    end_block(vm, next);
+}
+
+// Still the end of a block, so the run limits are looked at in the same
+// places as on the other engines
+void pd_nop(vm_t* vm, const decoded_t* d)
+{
+    (void)d;
+    end_block(vm, vm->reg[R_PC]);
+}
+
+void pd_jmp(vm_t* vm, const decoded_t* d)
+{
+    uint16_t next = vm->reg[R_PC];
+    vm->reg[R_PC] = vm->reg[d->src1];
+    end_block(vm, next);
+}
+
+void pd_jsr(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[R_R7] = vm->reg[R_PC];
+    vm->reg[R_PC] += d->imm;
+    end_block(vm, vm->reg[R_R7]);
+}
+
+void pd_jsrr(vm_t* vm, const decoded_t* d)
+{
+    uint16_t target = vm->reg[d->src1];
+    vm->reg[R_R7] = vm->reg[R_PC];
+    vm->reg[R_PC] = target;
+    end_block(vm, vm->reg[R_R7]);
+}
+
+void pd_ld(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = mem_read(vm, vm->reg[R_PC] + d->imm);
+    update_flags(vm, d->dst);
+}
+
+void pd_ldi(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = mem_read(vm, mem_read(vm, vm->reg[R_PC] + d->imm));
+    update_flags(vm, d->dst);
+}
+
+void pd_ldr(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = mem_read(vm, vm->reg[d->src1] + d->imm);
+    update_flags(vm, d->dst);
+}
+
+void pd_lea(vm_t* vm, const decoded_t* d)
+{
+    vm->reg[d->dst] = vm->reg[R_PC] + d->imm;
+    update_flags(vm, d->dst);
+}
+
+void pd_st(vm_t* vm, const decoded_t* d)
+{
+    mem_write(vm, vm->reg[R_PC] + d->imm, vm->reg[d->dst]);
+}
+
+void pd_sti(vm_t* vm, const decoded_t* d)
+{
+    mem_write(vm, mem_read(vm, vm->reg[R_PC] + d->imm), vm->reg[d->dst]);
+}
+
+void pd_str(vm_t* vm, const decoded_t* d)
+{
+    mem_write(vm, vm->reg[d->src1] + d->imm, vm->reg[d->dst]);
+}
+
+void pd_trap(vm_t* vm, const decoded_t* d)
+{
+    trap(vm, d->instr);
+}
+
+void pd_rti(vm_t* vm, const decoded_t* d)
+{
+    (void)d;
+    rti(vm);
+}
+
+void pd_res(vm_t* vm, const decoded_t* d)
+{
+    (void)d;
+    exception(vm, VEC_ILLEGAL);
+}
+
+// Superinstructions
+// predecode() looks at the words after some instructions and, for a few
+// common sequences, installs a handler that runs the whole sequence in one
+// dispatch. They are built from the handlers above, so R_COND and every
+// side effect come out exactly as if each instruction ran on its own. The
+// following entries keep their own decoding, which the fused handler reads
+// through d[1] and d[2], and which a jump into the middle of the sequence
+// runs as usual. A fused entry takes the opcode of its last instruction so
+// the block structure seen by interpret_block() does not change.
+#if VM_FUSE
+// AND Rx,Ry,#0 ; ADD Rx,Rx,#imm - load a constant
+void pd_fuse_const(vm_t* vm, const decoded_t* d)
+{
+    ++vm->fusion_hits[FUSE_CONST];
+    vm->reg[R_PC]++;
+    vm->reg[d->dst] = d[1].imm;
+    update_flags(vm, d->dst);
+}
+
+// ADD ; BR - loop counters
+#define FUSE_ADD_BR(name, add) \
+void name(vm_t* vm, const decoded_t* d) \
+{ \
+    ++vm->fusion_hits[FUSE_ADD_BR]; \
+    add(vm, d); \
+    vm->reg[R_PC]++; \
+    pd_br(vm, d + 1); \
+}
+
+FUSE_ADD_BR(pd_fuse_add_imm_br, pd_add_imm)
+FUSE_ADD_BR(pd_fuse_add_reg_br, pd_add_reg)
+
+#undef FUSE_ADD_BR
+
+// LDR ; ADD #imm ; STR - read-modify-write
+void pd_fuse_rmw(vm_t* vm, const decoded_t* d)
+{
+    ++vm->fusion_hits[FUSE_RMW];
+    pd_ldr(vm, d);
+    vm->reg[R_PC]++;
+    pd_add_imm(vm, d + 1);
+    vm->reg[R_PC]++;
+    pd_str(vm, d + 2);
+}
+
+// LEA R0 ; TRAP PUTS - print a string
+void pd_fuse_puts(vm_t* vm, const decoded_t* d)
+{
+    ++vm->fusion_hits[FUSE_PUTS];
+    pd_lea(vm, d);
+    vm->reg[R_PC]++;
+    pd_trap(vm, d + 1);
+}
+#endif
+
+// Decode vm->memory[pc] into the cache. Reads vm->memory directly rather than through
+// mem_read(vm, ) so decoding never triggers device side effects.
+static void decode_one(vm_t* vm, uint16_t pc)
+{
+    uint16_t instr = vm->memory[pc];
+    decoded_t* d = &vm->decode_cache[pc];
+
+    d->instr = instr;
+    d->op = instr >> 12;
+    d->dst = (instr >> 9) & 0x7;
+    d->src1 = (instr >> 6) & 0x7;
+    d->src2 = instr & 0x7;
+    d->imm = 0;
+
+    uint16_t imm_flag = (instr >> 5) & 0x1;
+
+    switch(d->op)
+    {
+        case OP_ADD:
+            d->imm = sign_extend(instr & 0x1F, 5);
+            d->fn = imm_flag ? pd_add_imm : pd_add_reg;
+            break;
+        case OP_AND:
+            d->imm = sign_extend(instr & 0x1F, 5);
+            d->fn = imm_flag ? pd_and_imm : pd_and_reg;
+            break;
+        case OP_NOT:
+            d->fn = pd_not;
+            break;
+        case OP_BR:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            if(d->dst == 0x7) d->fn = pd_br_always;
+            else if(d->dst == 0) d->fn = pd_nop;
+            else d->fn = pd_br;
+            break;
+        case OP_JMP:
+            d->fn = pd_jmp;
+            break;
+        case OP_JSR:
+            if((instr >> 11) & 1)
+            {
+                d->imm = sign_extend(instr & 0x7FF, 11);
+                d->fn = pd_jsr;
+            }
+            else
+            {
+                d->fn = pd_jsrr;
+            }
             break;
-        case TRAP_OUT:
-            trap_out();
+        case OP_LD:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            d->fn = pd_ld;
             break;
-        case TRAP_PUTS:
-            trap_puts();
+        case OP_LDI:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            d->fn = pd_ldi;
             break;
-        case TRAP_IN:
-            trap_in();
+        case OP_LDR:
+            d->imm = sign_extend(instr & 0x3F, 6);
+            d->fn = pd_ldr;
             break;
-        case TRAP_PUTSP:
-            trap_putsp();
+        case OP_LEA:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            d->fn = pd_lea;
             break;
-        case TRAP_HALT:
-            trap_halt();
+        case OP_ST:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            d->fn = pd_st;
             break;
+        case OP_STI:
+            d->imm = sign_extend(instr & 0x1FF, 9);
+            d->fn = pd_sti;
+            break;
+        case OP_STR:
+            d->imm = sign_extend(instr & 0x3F, 6);
+            d->fn = pd_str;
+            break;
+        case OP_TRAP:
+            d->imm = instr & 0xFF;
+            d->fn = pd_trap;
+            break;
+        case OP_RTI:
+            d->fn = pd_rti;
+            break;
+        case OP_RES:
+        default:
+            d->fn = pd_res;
+            break;
+    }
+}
+
+#if VM_FUSE
+// Replace the entry at pc with a superinstruction if the words after it
+// complete one of the known sequences
+static void fuse(vm_t* vm, uint16_t pc)
+{
+    // Profiles count dispatches, a breakpoint could sit inside a sequence,
+    // and sequences stay out of device pages
+    if(vm->profile || vm->trace || vm->debug || pc > VM_MEMORY_WORDS - VM_FUSE_MAX ||
+       vm->device_page[(pc + VM_FUSE_MAX - 1) >> VM_PAGE_SHIFT])
+    {
+        return;
+    }
+
+    decoded_t* d = &vm->decode_cache[pc];
+    uint16_t next = vm->memory[pc + 1];
+    uint16_t after = vm->memory[pc + 2];
+    uint16_t next_op = next >> 12;
+    uint16_t next_imm = (next >> 5) & 0x1;
+    uint16_t next_dst = (next >> 9) & 0x7;
+    handler_t fn = NULL;
+    int kind = 0;
+    int length = 2;
+
+    if(d->fn == pd_and_imm && d->imm == 0 &&
+       next_op == OP_ADD && next_imm && next_dst == d->dst && ((next >> 6) & 0x7) == d->dst)
+    {
+        fn = pd_fuse_const;
+        kind = FUSE_CONST;
+    }
+    else if((d->fn == pd_add_imm || d->fn == pd_add_reg) && next_op == OP_BR && next_dst != 0)
+    {
+        fn = d->fn == pd_add_imm ? pd_fuse_add_imm_br : pd_fuse_add_reg_br;
+        kind = FUSE_ADD_BR;
+    }
+    else if(d->fn == pd_ldr && next_op == OP_ADD && next_imm && (after >> 12) == OP_STR)
+    {
+        fn = pd_fuse_rmw;
+        kind = FUSE_RMW;
+        length = 3;
+    }
+    else if(d->fn == pd_lea && d->dst == R_R0 && next == (OP_TRAP << 12 | TRAP_PUTS))
+    {
+        fn = pd_fuse_puts;
+        kind = FUSE_PUTS;
+    }
+    if(!fn)
+    {
+        return;
+    }
+
+    for(int i = 1; i < length; ++i)
+    {
+        if(!d[i].fn)
+        {
+            decode_one(vm, pc + i);
+        }
+    }
+    d->fn = fn;
+    d->op = d[length - 1].op;
+    ++vm->fusion_sites[kind];
+}
+#endif
+
+void predecode(vm_t* vm, uint16_t pc)
+{
+    decode_one(vm, pc);
+    predecode_finish(vm, pc);
+}
+
+// predecode() in two steps for the loader, which decodes disjoint blocks
+// from several threads and then fuses them from one. Only the second step
+// looks at the neighbours of pc or touches state shared by every entry.
+void predecode_plain(vm_t* vm, uint16_t pc)
+{
+    decode_one(vm, pc);
+}
+
+void predecode_finish(vm_t* vm, uint16_t pc)
+{
+#if VM_FUSE
+    fuse(vm, pc);
+#endif
+    if(__builtin_expect(vm->debug != NULL, 0))
+    {
+        debug_patch(vm, pc);
     }
 }
 
+// Forget decoded instructions for [start, end), superinstructions that
+// reach into the range included, and the blocks built from the range
+void invalidate_decode(vm_t* vm, uint32_t start, uint32_t end)
+{
+    if(end > VM_MEMORY_WORDS)
+    {
+        end = VM_MEMORY_WORDS;
+    }
+    for(uint32_t a = start; a < end; ++a)
+    {
+        if(vm->block_map[a])
+        {
+            block_invalidate(vm, (uint16_t)a);
+        }
+    }
+    start = start >= VM_FUSE_MAX - 1 ? start - (VM_FUSE_MAX - 1) : 0;
+    for(uint32_t a = start; a < end; ++a)
+    {
+        vm->decode_cache[a].fn = NULL;
+    }
+}
+
+// Guest cycles per opcode: one to run it, one for each data access and
+// one for the return address JSR and TRAP keep. Time a native trap
+// spends on the host is not guest time.
+const uint8_t vm_op_cycles[16] =
+{
+    [OP_BR] = 1, [OP_ADD] = 1, [OP_LD] = 2, [OP_ST] = 2,
+    [OP_JSR] = 2, [OP_AND] = 1, [OP_LDR] = 2, [OP_STR] = 2,
+    [OP_RTI] = 3, [OP_NOT] = 1, [OP_LDI] = 3, [OP_STI] = 3,
+    [OP_JMP] = 1, [OP_RES] = 1, [OP_LEA] = 1, [OP_TRAP] = 2
+};
 
-uint16_t swap16(uint16_t x)
+// Slow path of vm_count(), adds up the cycles of len instructions from
+// start. A whole basic block is kept for the next time it runs, a run cut
+// short (a fault, a step, a debugger stop) is not.
+uint32_t block_cycles(vm_t* vm, uint16_t start, uint16_t len)
 {
-    return (x << 8) | (x >> 8);
+    uint32_t cycles = 0;
+    uint16_t pc = start;
+    for(uint16_t n = 0; n < len; ++n, ++pc)
+    {
+        cycles += vm_op_cycles[vm->memory[pc] >> 12];
+    }
+    if(len && len <= VM_BLOCK_MAX && OP_ENDS_BLOCK(vm->memory[(uint16_t)(pc - 1)] >> 12))
+    {
+        vm->blocks[start].len = len;
+        vm->blocks[start].cycles = (uint16_t)cycles;
+        pc = start;
+        for(uint16_t n = 0; n < len; ++n, ++pc)
+        {
+            vm->block_map[pc] = 1;
+        }
+    }
+    return cycles;
 }
 
-void read_image_file(FILE* file)
+// A store to address, drop every block that runs over it and the native
+// code built from it. Blocks that start before the instruction ending the
+// block in front of address don't reach it.
+void block_invalidate(vm_t* vm, uint16_t address)
 {
-    // Origin tells us where in memory to place the image
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    vm->block_map[address] = 0;
+    uint16_t p = address;
+    for(int n = 0; n < VM_BLOCK_MAX; ++n, --p)
+    {
+        vm->blocks[p].len = 0;
+        vm->blocks[p].cycles = 0;
+        if(OP_ENDS_BLOCK(vm->memory[(uint16_t)(p - 1)] >> 12))
+        {
+            break;
+        }
+    }
+#if VM_JIT
+    if(vm->jit && vm->jit->code_map[address])
+    {
+        jit_flush(vm->jit);
+        METRIC_ADD(vm, jit_invalidations, 1);
+    }
+#endif
+}
 
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t* p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+// Registers an instruction reads and writes, bit R_COND for the flags.
+// Returns 0 for anything but a branch, a load or register arithmetic.
+static int spin_regs(uint16_t instr, unsigned* reads, unsigned* writes)
+{
+    unsigned dr = 1u << ((instr >> 9) & 0x7);
+    unsigned sr1 = 1u << ((instr >> 6) & 0x7);
+    *reads = 0;
+    *writes = dr | (1u << R_COND);
+    switch(instr >> 12)
+    {
+        case OP_ADD:
+        case OP_AND:
+            *reads = sr1 | (((instr >> 5) & 1) ? 0 : 1u << (instr & 0x7));
+            return 1;
+        case OP_NOT:
+        case OP_LDR:
+            *reads = sr1;
+            return 1;
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+            return 1;
+        case OP_BR:
+            *reads = (instr >> 9) & 0x7 ? 1u << R_COND : 0;
+            *writes = 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
 
-    while(read-- > 0)
+// Is the instruction at pc part of a loop of at most VM_SPIN_MAX words,
+// closed by a backward BR, that only loads and computes? With no stores,
+// traps or jumps in it and no register carried from one pass to the next,
+// every pass does the same thing until a load reads something different,
+// so an empty KBSR poll from pc can wait for a key instead of spinning.
+int vm_spin_loop(vm_t* vm, uint16_t pc)
+{
+    for(uint32_t end = pc; end < (uint32_t)pc + VM_SPIN_MAX && end < MEMORY_WORDS; ++end)
     {
-        *p = swap16(*p);
-        ++p;
+        uint16_t instr = vm->memory[end];
+        uint32_t start = (uint16_t)(end + 1 + sign_extend(instr & 0x1FF, 9));
+        if(instr >> 12 != OP_BR || !((instr >> 9) & 0x7) || start > pc || end - start >= VM_SPIN_MAX)
+        {
+            continue;
+        }
+
+        unsigned reads, writes, written = 0, defined = 0;
+        for(uint32_t a = start; a <= end; ++a)
+        {
+            if(!spin_regs(vm->memory[a], &reads, &writes))
+            {
+                return 0;
+            }
+            written |= writes;
+        }
+        for(uint32_t a = start; a <= end; ++a)
+        {
+            spin_regs(vm->memory[a], &reads, &writes);
+            if(reads & written & ~defined)
+            {
+                return 0;
+            }
+            defined |= writes;
+        }
+        return 1;
     }
+    return 0;
 }
 
-int read_image(const char * image_path)
+void print_fusion_stats(vm_t* vm, FILE* f)
 {
-    FILE* file = fopen(image_path, "rb");
-    if(!file) { return 0; }
-    read_image_file(file);
-    fclose(file);
-    return 1;
+    static const char* names[FUSE_COUNT] = { "and+add", "add+br", "ldr+add+str", "lea+puts" };
+    fprintf(f, "superinstruction     sites         runs\n");
+    for(int i = 0; i < FUSE_COUNT; ++i)
+    {
+        fprintf(f, "%-16s %9llu %12llu\n", names[i], (unsigned long long)vm->fusion_sites[i],
+                (unsigned long long)vm->fusion_hits[i]);
+    }
 }
 
+// KBSR polls, the short idle waits after a run of empty ones, and the
+// sleeps of a guest caught in a polling loop - host CPU time not spent
+// spinning
+void print_idle_stats(vm_t* vm, FILE* f)
+{
+    const keyboard_t* kb = &vm->keyboard;
+    fprintf(f, "KBSR polls       %12llu\n", (unsigned long long)kb->polls);
+    fprintf(f, "idle waits       %12llu\n", (unsigned long long)kb->idles);
+    fprintf(f, "spin sleeps      %12llu\n", (unsigned long long)kb->spin_sleeps);
+    fprintf(f, "time slept       %10.3f s\n", kb->spin_us / 1e6);
+}
 
-void disable_input_buffering()
+// Fetch and run one instruction
+VM_INLINE void execute(vm_t* vm)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    /* FETCH */
+    uint16_t instr = vm->memory[vm->reg[R_PC]++];
+    uint16_t op = instr >> 12;
+    PROFILE_INSTR(vm, vm->reg[R_PC] - 1, instr);
+    TRACE_INSTR(vm, vm->reg[R_PC] - 1, instr);
+
+    switch(op)
+    {
+        case OP_ADD:
+            add(vm, instr);
+            break;
+        case OP_AND:
+            and(vm, instr);
+            break;
+        case OP_NOT:
+            not(vm, instr);
+            break;
+        case OP_BR:
+            br(vm, instr);
+            break;
+        case OP_JMP:
+            jmp(vm, instr);
+            break;
+        case OP_JSR:
+            jsr(vm, instr);
+            break;
+        case OP_LD:
+            ld(vm, instr);
+            break;
+        case OP_LDI:
+            ldi(vm, instr);
+            break;
+        case OP_LDR:
+            ldr(vm, instr);
+            break;
+        case OP_LEA:
+            lea(vm, instr);
+            break;
+        case OP_ST:
+            st(vm, instr);
+            break;
+        case OP_STI:
+            sti(vm, instr);
+            break;
+        case OP_STR:
+            str(vm, instr);
+            break;
+        case OP_TRAP:
+            trap(vm, instr);
+            break;
+        case OP_RTI:
+            rti(vm);
+            break;
+        case OP_RES:
+        default:
+            exception(vm, VEC_ILLEGAL);
+            break;
+    }
 }
 
-void restore_input_buffering()
+// Switch dispatch - portable fallback for compilers without computed goto
+void run_switch(vm_t* vm)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    while(vm->running)
+    {
+        execute(vm);
+    }
 }
 
+// Predecoded dispatch - decode on first execution, then call the cached handler
+void run_predecoded(vm_t* vm)
+{
+    while(vm->running)
+    {
+        decoded_t* d = &vm->decode_cache[vm->reg[R_PC]];
+        if(!d->fn)
+        {
+            predecode(vm, vm->reg[R_PC]);
+        }
+        PROFILE_INSTR(vm, vm->reg[R_PC], d->instr);
+        TRACE_INSTR(vm, vm->reg[R_PC], d->instr);
+        vm->reg[R_PC]++;
+        d->fn(vm, d);
+    }
+}
 
-void handle_interrupt(int signal)
+#if VM_JIT
+// Interpret from R_PC up to the end of the current basic block
+void interpret_block(vm_t* vm)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    for(;;)
+    {
+        decoded_t* d = &vm->decode_cache[vm->reg[R_PC]];
+        if(!d->fn)
+        {
+            predecode(vm, vm->reg[R_PC]);
+        }
+        PROFILE_INSTR(vm, vm->reg[R_PC], d->instr);
+        TRACE_INSTR(vm, vm->reg[R_PC], d->instr);
+        vm->reg[R_PC]++;
+        d->fn(vm, d);
+        if(OP_ENDS_BLOCK(d->op))
+        {
+            return;
+        }
+    }
 }
 
-int main(int argc, const char* argv[]) {
-    // Load args
-    if (argc < 2)
+// JIT dispatch - blocks are interpreted until they have run JIT_THRESHOLD
+// times, then they run as native code
+void run_jit(vm_t* vm)
+{
+    // Native blocks count instructions and stop for the limits and
+    // interrupts at block ends, but are not instrumented, so stay in the
+    // interpreter while profiling or tracing
+    int native = !vm->profile && !vm->trace;
+    if(native && !vm->jit)
     {
-        printf("lc3 [image-file1] ...\n");
+        vm->jit = jit_create();
     }
 
-    for(int j = 1; j < argc; ++j)
+    while(vm->running)
     {
-        if(!read_image(argv[j]))
+        jit_t* jit = native ? vm->jit : NULL;
+        uint16_t pc = vm->reg[R_PC];
+        void* code = jit ? jit->entry[pc] : NULL;
+        if(jit && !code && ++jit->hits[pc] == JIT_THRESHOLD)
+        {
+            code = jit_compile(vm, pc);
+        }
+        if(code && !jit_run(vm, code))
         {
-            printf("failed to load image: %s\n", argv[j]);
+            continue;
         }
+        interpret_block(vm);
+    }
+}
+#endif
+
+#if VM_THREADED
+// Direct-threaded dispatch - every handler ends with its own indirect jump to
+// the next instruction, so the branch predictor gets one site per opcode
+// instead of a single shared switch. Only TRAP, exceptions and the checks
+// at the end of a block can stop the machine, so `vm->running` is only
+// checked after those.
+void run_threaded(vm_t* vm)
+{
+    static void* dispatch_table[16] =
+    {
+        &&op_br, &&op_add, &&op_ld, &&op_st,
+        &&op_jsr, &&op_and, &&op_ldr, &&op_str,
+        &&op_rti, &&op_not, &&op_ldi, &&op_sti,
+        &&op_jmp, &&op_res, &&op_lea, &&op_trap
+    };
+    uint16_t instr;
+
+#define DISPATCH() \
+    do { \
+        instr = vm->memory[vm->reg[R_PC]++]; \
+        PROFILE_INSTR(vm, vm->reg[R_PC] - 1, instr); \
+        TRACE_INSTR(vm, vm->reg[R_PC] - 1, instr); \
+        goto *dispatch_table[instr >> 12]; \
+    } while(0)
+#define DISPATCH_BLOCK() \
+    do { if(__builtin_expect(!vm->running, 0)) return; DISPATCH(); } while(0)
+
+    // The limits were looked at before the first block, and may have
+    // stopped the machine already
+    DISPATCH_BLOCK();
+
+op_add:  add(vm, instr);  DISPATCH();
+op_and:  and(vm, instr);  DISPATCH();
+op_not:  not(vm, instr);  DISPATCH();
+op_br:   br(vm, instr);   DISPATCH_BLOCK();
+op_jmp:  jmp(vm, instr);  DISPATCH_BLOCK();
+op_jsr:  jsr(vm, instr);  DISPATCH_BLOCK();
+op_ld:   ld(vm, instr);   DISPATCH();
+op_ldi:  ldi(vm, instr);  DISPATCH();
+op_ldr:  ldr(vm, instr);  DISPATCH();
+op_lea:  lea(vm, instr);  DISPATCH();
+op_st:   st(vm, instr);   DISPATCH();
+op_sti:  sti(vm, instr);  DISPATCH();
+op_str:  str(vm, instr);  DISPATCH();
+op_trap:
+    trap(vm, instr);
+    DISPATCH_BLOCK();
+op_rti:
+    rti(vm);
+    DISPATCH_BLOCK();
+op_res:
+    exception(vm, VEC_ILLEGAL);
+    DISPATCH_BLOCK();
+
+#undef DISPATCH_BLOCK
+#undef DISPATCH
+}
+#endif
+
+#define VM_MAP_SIZE ((sizeof(vm_t) + VM_HUGEPAGE - 1) & ~(size_t)(VM_HUGEPAGE - 1))
+
+// Memory and the decode cache are over 1MB and touched all over, one
+// hugepage keeps them to a single TLB entry. The mapping comes zeroed.
+static vm_t* vm_map()
+{
+    size_t span = VM_MAP_SIZE + VM_HUGEPAGE;
+    uint8_t* map = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED)
+    {
+        return NULL;
     }
-    // Setup
 
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
+    // Trim to an aligned VM_MAP_SIZE
+    uint8_t* base = (uint8_t*)(((uintptr_t)map + VM_HUGEPAGE - 1) & ~(uintptr_t)(VM_HUGEPAGE - 1));
+    if(base > map)
+    {
+        munmap(map, base - map);
+    }
+    munmap(base + VM_MAP_SIZE, map + span - (base + VM_MAP_SIZE));
+#ifdef MADV_HUGEPAGE
+    madvise(base, VM_MAP_SIZE, MADV_HUGEPAGE);
+#endif
+    return (vm_t*)base;
+}
 
-    /* Set PC to start position */
-    /* 0x3000 is the default */
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
+vm_t* vm_create()
+{
+    vm_t* vm = vm_map();
+    if(!vm)
+    {
+        return NULL;
+    }
+    vm->in = stdin;
+    vm->out = stdout;
+    vm->reg[R_PC] = PC_START;
+    vm->traps[TRAP_GETC] = trap_getc;
+    vm->traps[TRAP_OUT] = trap_out;
+    vm->traps[TRAP_PUTS] = trap_puts;
+    vm->traps[TRAP_IN] = trap_in;
+    vm->traps[TRAP_PUTSP] = trap_putsp;
+    vm->traps[TRAP_HALT] = trap_halt;
+    console_map_devices(vm);
+    interrupt_init(vm);
+    return vm;
+}
 
-    running = 1;
-    while(running)
+void vm_destroy(vm_t* vm)
+{
+    if(!vm)
     {
-        /* FETCH */
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12;
+        return;
+    }
+#if VM_JIT
+    jit_destroy(vm->jit);
+#endif
+    keyboard_stop(&vm->keyboard);
+    timer_stop(&vm->timer);
+    profile_destroy(vm->profile);
+    free(vm->debug);
+    if(vm->capture_stream)
+    {
+        fclose(vm->capture_stream);
+        free(vm->capture);
+    }
+    free_image_map(vm);
+    munmap(vm, VM_MAP_SIZE);
+}
 
-        switch(op)
+// Route loads and stores for page_count pages from first_page to dev.
+// Returns 0 if a page already belongs to a device or the table is full.
+int vm_map_device(vm_t* vm, uint16_t first_page, uint16_t page_count, const device_t* dev)
+{
+    if(vm->device_count == VM_MAX_DEVICES || first_page + page_count > VM_PAGE_COUNT)
+    {
+        return 0;
+    }
+    for(uint16_t p = first_page; p < first_page + page_count; ++p)
+    {
+        if(vm->device_page[p])
         {
-            case OP_ADD:
-                add(instr);
-                break;
-            case OP_AND:
-                and(instr);
-                break;
-            case OP_NOT:
-                not(instr);
-                break;
-            case OP_BR:
-                br(instr);
-                break;
-            case OP_JMP:
-                jmp(instr);
-                break;
-            case OP_JSR:
-                jsr(instr);
-                break;
-            case OP_LD:
-                ld(instr);
-                break;
-            case OP_LDI:
-                ldi(instr);
-                break;
-            case OP_LDR:
-                ldr(instr);
-                break;
-            case OP_LEA:
-                lea(instr);
-                break;
-            case OP_ST:
-                st(instr);
-                break;
-            case OP_STI:
-                str(instr);
-                break;
-            case OP_STR:
-                str(instr);
-                break;
-            case OP_TRAP:
-                trap(instr);
-                break;
-            case OP_RES:
-            case OP_RTI:
-            default:
-                abort();
-                break;
+            return 0;
         }
+    }
 
+    vm->devices[vm->device_count++] = *dev;
+    memset(vm->device_page + first_page, vm->device_count, page_count);
+#if VM_JIT
+    // Compiled blocks access memory in these pages directly
+    if(vm->jit)
+    {
+        jit_flush(vm->jit);
+    }
+#endif
+    return 1;
+}
+
+uint64_t vm_now_ms()
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Slow path of end_block(), takes a pending interrupt, stops the machine
+// once a limit is reached and otherwise writes out console output that is
+// due and picks the instruction count to look again at
+void vm_check_limits(vm_t* vm)
+{
+    // HALT or a stop for input ended the block. Its reason stands, and like
+    // a fault it wins over an MCR halt earlier in the block.
+    if(!vm->running)
+    {
+        vm->halt_pending = 0;
+        return;
+    }
+    if(atomic_load_explicit(&vm->irq, memory_order_relaxed))
+    {
+        interrupt_deliver(vm);
+        if(!vm->running)
+        {
+            return;
+        }
+    }
+    if(vm->max_instructions && vm->instructions >= vm->max_instructions)
+    {
+        vm->exit_reason = VM_EXIT_BUDGET;
+        vm->running = 0;
+        return;
+    }
+    if(vm->deadline_ms && vm_now_ms() >= vm->deadline_ms)
+    {
+        vm->exit_reason = VM_EXIT_TIMEOUT;
+        vm->running = 0;
+        return;
+    }
+
+    console_flush_due(vm);
+    metrics_publish(vm);
+    vm->next_check = UINT64_MAX;
+    if(vm->deadline_ms || vm->metrics || !vm->console.immediate)
+    {
+        vm->next_check = vm->instructions + VM_CHECK_INTERVAL;
+    }
+    if(vm->max_instructions && vm->max_instructions < vm->next_check)
+    {
+        vm->next_check = vm->max_instructions;
+    }
+}
+
+// Send console output to a buffer instead of vm->out, see vm_output()
+int vm_capture_output(vm_t* vm)
+{
+    if(vm->capture_stream)
+    {
+        return 1;
+    }
+    vm->capture_stream = open_memstream(&vm->capture, &vm->capture_len);
+    if(!vm->capture_stream)
+    {
+        return 0;
+    }
+    vm->out = vm->capture_stream;
+    return 1;
+}
+
+// Everything written so far by a machine set up with vm_capture_output()
+const char* vm_output(vm_t* vm, size_t* len)
+{
+    if(!vm->capture_stream)
+    {
+        *len = 0;
+        return NULL;
+    }
+    console_flush(vm);
+    fflush(vm->capture_stream);
+    *len = vm->capture_len;
+    return vm->capture;
+}
+
+// Feed GETC, IN and KBDR from a buffer instead of vm->in. The data is copied.
+int vm_set_input(vm_t* vm, const void* data, size_t len)
+{
+    return keyboard_set_buffer(&vm->keyboard, data, len);
+}
+
+// Feed them from fn instead, asked again each time its input runs out
+int vm_set_input_callback(vm_t* vm, vm_input_fn fn, void* ctx)
+{
+    return keyboard_set_callback(&vm->keyboard, fn, ctx);
+}
+
+void vm_set_stop_on_input(vm_t* vm, int on)
+{
+    vm->stop_on_input = on;
+}
+
+// Hand console output to fn, as it is flushed, instead of writing vm->out
+void vm_set_output_callback(vm_t* vm, vm_output_fn fn, void* ctx)
+{
+    console_flush(vm);
+    vm->output_fn = fn;
+    vm->output_ctx = ctx;
+}
+
+const char* vm_engine_names[VM_ENGINE_COUNT] = { "switch", "threaded", "predecode", "jit" };
+
+int vm_has_engine(int engine)
+{
+    switch(engine)
+    {
+        case VM_ENGINE_SWITCH:
+        case VM_ENGINE_PREDECODE:
+            return 1;
+        case VM_ENGINE_THREADED:
+            return VM_THREADED;
+        case VM_ENGINE_JIT:
+            return VM_JIT;
     }
-    // Shutdown VM
-    restore_input_buffering();
     return 0;
 }
+
+// Run from R_PC until HALT, or until max_instructions or timeout_ms runs
+// out, on the given engine (the switch loop if this build doesn't have
+// it). The reason is left in vm->exit_reason.
+void vm_run_engine(vm_t* vm, int engine)
+{
+    console_attach(vm);
+    vm->running = 1;
+    vm->exit_reason = VM_EXIT_HALT;
+    vm->block_start = vm->reg[R_PC];
+    vm->deadline_ms = vm->timeout_ms ? vm_now_ms() + vm->timeout_ms : 0;
+    vm->next_check = 0;
+    vm_check_limits(vm);
+    switch(engine)
+    {
+#if VM_JIT
+        case VM_ENGINE_JIT:
+            run_jit(vm);
+            break;
+#endif
+#if VM_THREADED
+        case VM_ENGINE_THREADED:
+            run_threaded(vm);
+            break;
+#endif
+        case VM_ENGINE_PREDECODE:
+            run_predecoded(vm);
+            break;
+        default:
+            run_switch(vm);
+            break;
+    }
+    console_flush(vm);
+    metrics_publish(vm);
+}
+
+// On the engine picked at build time, for at most budget instructions on
+// top of the limits. The budget is checked like max_instructions, at the
+// end of a basic block.
+int vm_run(vm_t* vm, uint64_t budget)
+{
+    uint64_t max_instructions = vm->max_instructions;
+    if(budget && (!max_instructions || vm->instructions + budget < max_instructions))
+    {
+        vm->max_instructions = vm->instructions + budget;
+    }
+    vm_run_engine(vm, VM_ENGINE_DEFAULT);
+    vm->max_instructions = max_instructions;
+    return vm->exit_reason;
+}
+
+// One instruction on the switch engine. The limits are looked at first,
+// so a pending interrupt is taken before it and a step past
+// max_instructions doesn't run.
+int vm_step(vm_t* vm)
+{
+    console_attach(vm);
+    vm->running = 1;
+    vm->exit_reason = VM_EXIT_HALT;
+    vm->block_start = vm->reg[R_PC];
+    vm->deadline_ms = 0;
+    vm->next_check = 0;
+    vm_check_limits(vm);
+    if(vm->running)
+    {
+        execute(vm);
+    }
+    // Instructions that end a block have counted themselves
+    vm_count(vm, vm->reg[R_PC]);
+    vm->block_start = vm->reg[R_PC];
+    console_flush(vm);
+
+    int running = vm->running;
+    vm->running = 0;
+    return running;
+}
+
+int vm_exit_reason(const vm_t* vm)
+{
+    return vm->exit_reason;
+}
+
+uint64_t vm_instructions(const vm_t* vm)
+{
+    return vm->instructions;
+}
+
+uint64_t vm_cycles(const vm_t* vm)
+{
+    return vm->cycles;
+}
+
+void vm_set_limits(vm_t* vm, uint64_t max_instructions, uint64_t timeout_ms)
+{
+    vm->max_instructions = max_instructions;
+    vm->timeout_ms = timeout_ms;
+}
+
+uint16_t vm_get_reg(const vm_t* vm, int r)
+{
+    if(r < 0 || r >= R_COUNT)
+    {
+        return 0;
+    }
+    return r == R_COND ? vm_cond(vm) : vm->reg[r];
+}
+
+void vm_set_reg(vm_t* vm, int r, uint16_t val)
+{
+    if(r == R_COND)
+    {
+        vm_set_cond(vm, val);
+    }
+    else if(r >= 0 && r < R_COUNT)
+    {
+        vm->reg[r] = val;
+    }
+}
+
+// A load as the guest would make it, devices included
+uint16_t vm_read(vm_t* vm, uint16_t address)
+{
+    return mem_read(vm, address);
+}
+
+// A store as the guest would make it, for tools that patch a machine
+void vm_write(vm_t* vm, uint16_t address, uint16_t val)
+{
+    mem_write(vm, address, val);
+}
+
+// Keyboard input for a headless run, read whole up front
+int vm_load_input(vm_t* vm, const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f)
+    {
+        return 0;
+    }
+    char* data = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    size_t n;
+    do
+    {
+        if(len == cap)
+        {
+            cap = cap ? cap * 2 : 4096;
+            char* grown = realloc(data, cap);
+            if(!grown)
+            {
+                free(data);
+                fclose(f);
+                return 0;
+            }
+            data = grown;
+        }
+        n = fread(data + len, 1, cap - len, f);
+        len += n;
+    } while(n);
+    fclose(f);
+
+    int ok = vm_set_input(vm, data, len);
+    free(data);
+    return ok;
+}
@@ -0,0 +1,405 @@
+/*
+  Shared definitions for the LC-3 VM - machine state, opcode and trap
+  numbers, and the predecoded instruction format used by the engines.
+*/
+#ifndef VM_H
+#define VM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <sys/termios.h>
+
+#include "libvm.h"
+#include "console.h"
+#include "keyboard.h"
+#include "loader.h"
+#include "timer.h"
+#include "profile.h"
+#include "trace.h"
+#include "metrics.h"
+
+// Dispatch engine
+// Direct-threaded dispatch (computed goto) is used when the compiler supports
+// labels as values. Build with -DVM_SWITCH_DISPATCH to force the switch loop.
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_THREADED 1
+#else
+#define VM_THREADED 0
+#endif
+
+// Build with -DVM_PREDECODE to run from the predecoded instruction cache
+#ifndef VM_PREDECODE
+#define VM_PREDECODE 0
+#endif
+
+// Build with -DVM_FUSE=0 to predecode without superinstructions
+#ifndef VM_FUSE
+#define VM_FUSE 1
+#endif
+
+// Handlers are small, force them into the dispatch loop
+#if defined(__GNUC__)
+#define VM_INLINE static inline __attribute__((always_inline))
+#else
+#define VM_INLINE static inline
+#endif
+
+// Build with -DVM_JIT=1 to run hot basic blocks as native code
+#ifndef VM_JIT
+#define VM_JIT 0
+#endif
+
+// Build with -DVM_FUZZ=1 for the libFuzzer target, fuzz.c then takes the
+// place of main.c (make fuzz leaves it out)
+#ifndef VM_FUZZ
+#define VM_FUZZ 0
+#endif
+
+// Engines, by the DISPATCH names in the makefile. Every build has the
+// switch and predecoded loops, the threaded and JIT engines only exist in
+// builds that have them (see vm_has_engine()). vm_run() uses the default.
+enum
+{
+    VM_ENGINE_SWITCH = 0,
+    VM_ENGINE_THREADED,
+    VM_ENGINE_PREDECODE,
+    VM_ENGINE_JIT,
+    VM_ENGINE_COUNT
+};
+
+#if VM_JIT
+#define VM_ENGINE_DEFAULT VM_ENGINE_JIT
+#elif VM_PREDECODE
+#define VM_ENGINE_DEFAULT VM_ENGINE_PREDECODE
+#elif VM_THREADED
+#define VM_ENGINE_DEFAULT VM_ENGINE_THREADED
+#else
+#define VM_ENGINE_DEFAULT VM_ENGINE_SWITCH
+#endif
+
+// Opcodes
+// 16 Opcodes
+// Each instruction is 16 bits, Left 4 bits for opcode - the rest for the params
+enum
+{
+    OP_BR = 0,  /* branch */
+    OP_ADD,     /* add */
+    OP_LD,      /* load */
+    OP_ST,      /* store */
+    OP_JSR,     /* jump register */
+    OP_AND,     /* bitwise and */
+    OP_LDR,     /* load register */
+    OP_STR,     /* store register */
+    OP_RTI,     /* return from interrupt */
+    OP_NOT,     /* bitwise not */
+    OP_LDI,     /* load indirect */
+    OP_STI,     /* store indirect */
+    OP_JMP,     /* jump */
+    OP_RES,     /* reserved (unused) */
+    OP_LEA,     /* load effective address */
+    OP_TRAP     /* exectute trap */
+};
+
+// Condition flags
+enum
+{
+    FL_POS = 1 << 0, /* P */
+    FL_ZRO = 1 << 1, /* Z */
+    FL_NEG = 1 << 2  /* N */
+};
+
+// Memory mapped registers
+enum
+{
+    MR_KBSR = 0xFE00, /* keyboard status */ 
+    MR_KBDR = 0xFE02, /* keyboard data */ 
+    MR_TMR = 0xFFF8,  /* timer status */
+    MR_TMI = 0xFFFA,  /* timer interval, ms */
+    MR_PSR = 0xFFFC,  /* processor status */
+    MR_MCR = 0xFFFE   /* machine control */
+};
+
+// Opcodes that end a basic block
+#define OP_ENDS_BLOCK(op) \
+    ((1 << (op)) & ((1 << OP_BR) | (1 << OP_JMP) | (1 << OP_JSR) | \
+                    (1 << OP_TRAP) | (1 << OP_RTI) | (1 << OP_RES)))
+
+// Guest cycles each opcode costs, see vm_op_cycles in vm.c
+extern const uint8_t vm_op_cycles[16];
+
+// Basic blocks
+// The length and cost of the block starting at each address, filled in the
+// first time the block ends (len 0 until then). The counters add them once
+// per block instead of once per instruction. Longer runs of straight line
+// code are added up each time, a store only looks this far back for the
+// blocks it lands in.
+#define VM_BLOCK_MAX 255
+
+typedef struct
+{
+    uint16_t len;     /* instructions, 0 if not known */
+    uint16_t cycles;  /* guest cycles */
+} block_t;
+
+// Predecoded instructions
+// Each word of memory is decoded once, the first time it is executed. Register
+// fields are pulled out, immediates are sign-extended and the handler for the
+// opcode/addressing mode is picked up front. A NULL handler means the entry
+// has not been decoded yet (or was invalidated by a store).
+typedef struct decoded decoded_t;
+typedef void (*handler_t)(vm_t* vm, const decoded_t* d);
+
+struct decoded
+{
+    handler_t fn;    /* handler, NULL if not decoded */
+    uint8_t op;      /* opcode */
+    uint8_t dst;     /* DR / SR for stores / nzp for BR */
+    uint8_t src1;    /* SR1 / BaseR */
+    uint8_t src2;    /* SR2 */
+    uint16_t imm;    /* sign-extended immediate or offset, trap vector */
+    uint16_t instr;  /* raw instruction word */
+};
+
+VM_INLINE uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1) {
+        x |= (0xFFFF << bit_count);
+    }
+
+    return x;
+}
+
+// Condition codes
+// Instructions that set N/Z/P only leave their result in reg[R_COND], the
+// flags are worked out when something reads them (BR, a snapshot file, the
+// debugger). Negative and zero are exclusive, so this picks N, Z or P.
+VM_INLINE uint16_t cond_flags(uint16_t value)
+{
+    return FL_POS << ((value >> 15) * 2 + (value == 0));
+}
+
+// Memory mapped I/O
+// Memory is split into 256 pages of 256 words. Loads and stores to a page
+// marked in device_page[] go through that device's callbacks, every other
+// access (and every instruction fetch) is a plain array access.
+#define VM_PAGE_SHIFT 8
+#define VM_PAGE_COUNT 256
+#define VM_MEMORY_WORDS (UINT16_MAX + 1)
+#define VM_MAX_DEVICES 8
+
+typedef uint16_t (*device_read_t)(vm_t* vm, uint16_t address);
+typedef void (*device_write_t)(vm_t* vm, uint16_t address, uint16_t val);
+
+typedef struct
+{
+    const char* name;
+    device_read_t read;    /* NULL reads memory */
+    device_write_t write;  /* NULL writes memory */
+} device_t;
+
+// Superinstructions - sequences predecode() runs as one handler
+#define VM_FUSE_MAX 3  /* longest sequence, a store invalidates this many entries */
+
+enum
+{
+    FUSE_CONST = 0,  /* AND Rx,Ry,#0 ; ADD Rx,Rx,#imm */
+    FUSE_ADD_BR,     /* ADD ; BR */
+    FUSE_RMW,        /* LDR ; ADD #imm ; STR */
+    FUSE_PUTS,       /* LEA R0 ; TRAP PUTS */
+    FUSE_COUNT
+};
+
+// Longest loop vm_spin_loop() recognises, in words
+#define VM_SPIN_MAX 8
+
+// Instructions between wall clock checks when a timeout is set, and
+// between metrics updates
+#define VM_CHECK_INTERVAL (1 << 16)
+
+/* Set PC to start position */
+/* 0x3000 is the default */
+enum { PC_START = 0x3000 };
+
+// Machines are mapped on their own, aligned to and sized in units of this,
+// and backed by transparent hugepages where the kernel has them
+#define VM_HUGEPAGE (2 << 20)
+
+// One LC-3 machine. Everything an image can observe lives here, so any
+// number of machines can run side by side in one process.
+struct vm
+{
+    // 2^16 Memory Locations - Each with store 16bit Value - 128Kb Memory.
+    // First in the struct so it starts on the mapping's 2MB boundary, and
+    // a 16 bit address can never index past it.
+    uint16_t memory[VM_MEMORY_WORDS];
+
+    // Registers
+    // 10 Total Registers - Each holding 16 bits
+    // 8 General purpose - R0-R7
+    // 1 Program counter - PC
+    // 1 Condition flag - COND, holds the last result, see vm_cond()
+    uint16_t reg[R_COUNT];
+
+    // Privilege and interrupts, see interrupt.h. psr has everything but
+    // N/Z/P, the stack pointer of the mode not running is kept aside.
+    // Devices set irq from any thread to have a pending interrupt looked
+    // at the next basic block end.
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    _Atomic int irq;
+    int halt_pending;       /* MCR cleared, stop at the block end */
+    vm_timer_t timer;
+
+    // Is the program running?
+    int running;
+
+    // Console - NULL input never has a key waiting
+    FILE* in;
+    FILE* out;
+    console_t console;
+    keyboard_t keyboard;
+
+    // For unix terminals, saved while input buffering is disabled
+    struct termios original_tio;
+    int tio_saved;
+
+    // A store clears the entries for up to VM_FUSE_MAX - 1 words before it,
+    // native code does so without a bounds check and lands here for x0000
+    decoded_t decode_guard[VM_FUSE_MAX - 1];
+    decoded_t decode_cache[VM_MEMORY_WORDS];
+
+    // Basic blocks seen so far. block_map is set for every word a block in
+    // blocks[] or a native block was built from, a store there drops them.
+    block_t blocks[VM_MEMORY_WORDS];
+    uint8_t block_map[VM_MEMORY_WORDS];
+
+    // Superinstructions installed by predecode() and times each one ran
+    uint64_t fusion_sites[FUSE_COUNT];
+    uint64_t fusion_hits[FUSE_COUNT];
+
+    // Native handler for each trap vector, NULL runs the guest routine
+    // memory[vector] points at
+    native_trap_t traps[256];
+
+    // Devices and the pages they own, device_page[] holds an index into
+    // devices[] plus one, 0 for ordinary memory
+    uint8_t device_page[VM_PAGE_COUNT];
+    device_t devices[VM_MAX_DEVICES];
+    int device_count;
+
+    // Pages stored to since vm_snapshot() or vm_restore() last cleared the
+    // map, with the snapshot the machine matched then. Stores from the
+    // guest mark their page, loading an image clears dirty_base instead.
+    uint8_t dirty_page[VM_PAGE_COUNT];
+    const void* dirty_base;
+
+    // Address ranges filled by read_image()
+    image_range_t images[VM_MAX_IMAGES];
+    int image_count;
+
+    // Native code for hot blocks, created on first use by the JIT engine
+    struct jit* jit;
+
+    // Counters for --profile, NULL when not profiling
+    struct profile* profile;
+
+    // Counters read by the metrics exporter, NULL when not attached, and
+    // the counts last published to them
+    struct vm_metrics* metrics;
+    uint64_t published_instructions;
+    uint64_t published_cycles;
+
+    // Recorder for --trace, NULL when not tracing
+    struct trace* trace;
+
+    // Breakpoints and watchpoints for --debug, NULL when not debugging
+    struct debug* debug;
+
+    // Run limits, 0 for none. They are checked once per basic block, so
+    // a run can go a few instructions past max_instructions.
+    uint64_t max_instructions;
+    uint64_t timeout_ms;
+    int exit_reason;        /* VM_EXIT_* */
+
+    // Stop instead of waiting the first time the guest wants a key that
+    // isn't there. GETC and IN are left to run again on the next vm_run().
+    int stop_on_input;
+
+    // Instructions executed and the guest cycles they took, counted a basic
+    // block at a time
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t next_check;    /* count at which the limits are looked at again */
+    uint64_t deadline_ms;
+    uint16_t block_start;
+
+    // Output callback for vm_set_output_callback(), NULL writes to out
+    vm_output_fn output_fn;
+    void* output_ctx;
+
+    // Output buffer for vm_capture_output()
+    FILE* capture_stream;
+    char* capture;
+    size_t capture_len;
+};
+
+VM_INLINE void vm_mark_dirty(vm_t* vm, uint16_t address)
+{
+    vm->dirty_page[address >> VM_PAGE_SHIFT] = 1;
+}
+
+// N/Z/P as the LC-3 defines them
+VM_INLINE uint16_t vm_cond(const vm_t* vm)
+{
+    return cond_flags(vm->reg[R_COND]);
+}
+
+// Any value that gives those flags back
+VM_INLINE void vm_set_cond(vm_t* vm, uint16_t flags)
+{
+    vm->reg[R_COND] = (flags & FL_NEG) ? 0x8000 : (flags & FL_ZRO) ? 0 : 1;
+}
+
+uint32_t block_cycles(vm_t* vm, uint16_t start, uint16_t len);
+void block_invalidate(vm_t* vm, uint16_t address);
+
+// Count the instructions from block_start up to end and their cycles. A
+// block that was seen before costs one lookup, anything else is added up.
+VM_INLINE void vm_count(vm_t* vm, uint16_t end)
+{
+    uint16_t len = end - vm->block_start;
+    const block_t* b = &vm->blocks[vm->block_start];
+    uint32_t cycles = __builtin_expect(b->len == len, 1) ? b->cycles :
+                      block_cycles(vm, vm->block_start, len);
+    vm->instructions += len;
+    vm->cycles += cycles;
+    PROFILE_BLOCK(vm, vm->block_start, len, cycles);
+}
+
+void vm_run_engine(vm_t* vm, int engine);
+int vm_has_engine(int engine);
+extern const char* vm_engine_names[VM_ENGINE_COUNT];
+void vm_check_limits(vm_t* vm);
+uint64_t vm_now_ms();
+int vm_map_device(vm_t* vm, uint16_t first_page, uint16_t page_count, const device_t* dev);
+
+void predecode(vm_t* vm, uint16_t pc);
+void predecode_plain(vm_t* vm, uint16_t pc);
+void predecode_finish(vm_t* vm, uint16_t pc);
+void run_predecoded(vm_t* vm);
+void invalidate_decode(vm_t* vm, uint32_t start, uint32_t end);
+void print_fusion_stats(vm_t* vm, FILE* f);
+void print_idle_stats(vm_t* vm, FILE* f);
+int vm_spin_loop(vm_t* vm, uint16_t pc);
+void trap(vm_t* vm, uint16_t instr);
+
+// Run images on a pool of worker threads, see batch.c
+int batch_main(int argc, const char* argv[]);
+// Run a program on two engines and compare them, see diff.c
+int diff_main(int argc, const char* argv[]);
+// Run fuzz inputs in a reused machine, see fuzz.c
+int fuzz_main(int argc, const char* argv[]);
+
+#endif